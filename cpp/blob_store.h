@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "unordered_dense.h"
+#include "framed_writer.h"
+
+namespace retracesoftware_stream {
+
+// Content-addressed sidecar file for large payloads.
+//
+// The file is a sequence of records [hash:8][len:8][data:len], both
+// header fields little-endian. A payload is stored once; the stream
+// carries only its hash and length (EXTENDED BLOB_*).
+//
+// Records are appended with a single writev on an O_APPEND descriptor,
+// so a parent and its forked children can share one file, and a child
+// inherits the set of hashes already stored. Records are keyed on both
+// hash and length, so payloads that collide on the hash alone stay apart.
+
+inline uint64_t blob_hash(const uint8_t* data, size_t len) {
+    return ankerl::unordered_dense::detail::wyhash::hash(data, len);
+}
+
+using BlobKey = std::pair<uint64_t, uint64_t>;     // hash, len
+
+class BlobWriter {
+    int fd_ = -1;
+    size_t threshold_;
+    ankerl::unordered_dense::set<BlobKey> stored_;
+    // Set once the file ends in a partial record: anything appended after
+    // it would be misread, so puts fail and payloads go inline instead.
+    bool broken_ = false;
+
+    // Seed stored_ from records already in the file (earlier runs, or a
+    // parent process).
+    void scan() {
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            broken_ = true;
+            return;
+        }
+        uint64_t size = (uint64_t)st.st_size, pos = 0;
+        uint64_t header[2];
+        while (pos + sizeof(header) <= size &&
+               pread(fd_, header, sizeof(header), (off_t)pos) == (ssize_t)sizeof(header)) {
+            uint64_t len = to_le64(header[1]);
+            if (len > size - pos - sizeof(header)) break;
+            stored_.insert({to_le64(header[0]), len});
+            pos += sizeof(header) + len;
+        }
+        if (pos != size) broken_ = true;
+    }
+
+public:
+    BlobWriter(const char* path, size_t threshold) : threshold_(threshold) {
+        fd_ = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ >= 0) scan();
+    }
+
+    ~BlobWriter() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    BlobWriter(const BlobWriter&) = delete;
+    BlobWriter& operator=(const BlobWriter&) = delete;
+
+    bool ok() const { return fd_ >= 0; }
+    size_t threshold() const { return threshold_; }
+
+    // Stores data unless already present. Returns false, leaving the
+    // caller to write the payload inline, if the append fails.
+    bool put(const uint8_t* data, size_t len, uint64_t& hash) {
+        if (broken_) return false;
+        hash = blob_hash(data, len);
+        if (stored_.contains({hash, (uint64_t)len})) return true;
+
+        uint64_t header[2] = {to_le64(hash), to_le64((uint64_t)len)};
+        struct iovec iov[2] = {
+            {header, sizeof(header)},
+            {const_cast<uint8_t*>(data), len},
+        };
+        size_t total = sizeof(header) + len;
+        ssize_t written;
+        do {
+            written = ::writev(fd_, iov, 2);
+        } while (written < 0 && errno == EINTR);
+
+        if (written != (ssize_t)total) {
+            // A short write leaves part of a record behind.
+            if (written > 0) broken_ = true;
+            return false;
+        }
+        stored_.insert({hash, (uint64_t)len});
+        return true;
+    }
+};
+
+// Read side: maps the blob file and indexes it, remapping when a lookup
+// misses because the writer has appended since.
+class BlobReader {
+    int fd_ = -1;
+    const uint8_t* map_ = nullptr;
+    size_t mapped_ = 0;
+    size_t scanned_ = 0;
+    ankerl::unordered_dense::map<BlobKey, size_t> index_;    // -> offset of the data
+
+    void unmap() {
+        if (map_) munmap(const_cast<uint8_t*>(map_), mapped_);
+        map_ = nullptr;
+        mapped_ = 0;
+    }
+
+    bool refresh() {
+        struct stat st;
+        if (fstat(fd_, &st) != 0) return false;
+        size_t size = (size_t)st.st_size;
+        if (size == mapped_) return true;
+
+        unmap();
+        if (size == 0) return true;
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) return false;
+        map_ = (const uint8_t*)p;
+        mapped_ = size;
+
+        while (scanned_ + 16 <= mapped_) {
+            uint64_t hash, len;
+            memcpy(&hash, map_ + scanned_, 8);
+            memcpy(&len, map_ + scanned_ + 8, 8);
+            hash = to_le64(hash);
+            len = to_le64(len);
+            if (len > mapped_ - scanned_ - 16) break;
+            index_.emplace(BlobKey{hash, len}, scanned_ + 16);
+            scanned_ += 16 + len;
+        }
+        return true;
+    }
+
+public:
+    explicit BlobReader(const char* path) {
+        fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd_ >= 0) refresh();
+    }
+
+    ~BlobReader() {
+        unmap();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    BlobReader(const BlobReader&) = delete;
+    BlobReader& operator=(const BlobReader&) = delete;
+
+    bool ok() const { return fd_ >= 0; }
+
+    // The stored bytes for hash and len, or nullptr if absent. Valid
+    // until the next call.
+    const uint8_t* find(uint64_t hash, size_t len) {
+        BlobKey key{hash, (uint64_t)len};
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            if (!refresh()) return nullptr;
+            it = index_.find(key);
+            if (it == index_.end()) return nullptr;
+        }
+        return map_ + it->second;
+    }
+};
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Python.h>
+#include <string>
+
+#include "blob_store.h"
+
+namespace retracesoftware_stream {
+
+// Preset string dictionary: a tuple of str that MessageStream and
+// ObjectStream both preload, in order, as their first interned strings,
+// so a trace refers to them by STR_REF without ever writing them. The
+// trace records only the dictionary's hash (in CAPABILITIES); the reader
+// must be given the same tuple.
+
+static constexpr Py_ssize_t MAX_DICTIONARY_SIZE = 16384;
+
+// A new tuple of the interned strings of a sequence, or nullptr with an
+// error set.
+static inline PyObject * as_dictionary(PyObject * strings) {
+    PyObject * seq = PySequence_Tuple(strings);
+    if (!seq) return nullptr;
+
+    Py_ssize_t n = PyTuple_GET_SIZE(seq);
+    if (n > MAX_DICTIONARY_SIZE) {
+        PyErr_Format(PyExc_ValueError, "dictionary has %zd strings, at most %zd are allowed",
+                     n, MAX_DICTIONARY_SIZE);
+        Py_DECREF(seq);
+        return nullptr;
+    }
+
+    PyObject * result = PyTuple_New(n);
+    if (!result) {
+        Py_DECREF(seq);
+        return nullptr;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject * str = PyTuple_GET_ITEM(seq, i);
+        if (!PyUnicode_CheckExact(str)) {
+            PyErr_Format(PyExc_TypeError, "dictionary entries must be str, got %R", str);
+            Py_DECREF(seq);
+            Py_DECREF(result);
+            return nullptr;
+        }
+        Py_INCREF(str);
+        PyUnicode_InternInPlace(&str);
+        PyTuple_SET_ITEM(result, i, str);
+    }
+    Py_DECREF(seq);
+    return result;
+}
+
+// Hash over each entry's UTF-8 length (8 bytes, little-endian) and bytes.
+// Returns 0 with an error set if an entry cannot be encoded.
+static inline uint64_t dictionary_hash(PyObject * dictionary) {
+    std::string buffer;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(dictionary); i++) {
+        Py_ssize_t size;
+        const char * utf8 = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(dictionary, i), &size);
+        if (!utf8) return 0;
+        uint64_t len = to_le64((uint64_t)size);
+        buffer.append((const char *)&len, sizeof(len));
+        buffer.append(utf8, size);
+    }
+    return blob_hash((const uint8_t *)buffer.data(), buffer.size());
+}
+
+}
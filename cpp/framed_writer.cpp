@@ -109,7 +109,9 @@ namespace retracesoftware_stream {
                 self->writer = nullptr;
             }
             self->stored_path.~basic_string();
-            Py_TYPE(self)->tp_free((PyObject*)self);
+            PyTypeObject* tp = Py_TYPE(self);
+            tp->tp_free((PyObject*)self);
+            Py_DECREF(tp);
         }
 
         // --- Python methods ---
@@ -231,22 +233,26 @@ namespace retracesoftware_stream {
         {NULL}
     };
 
-    PyTypeObject FramedWriter_Type = {
-        .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = MODULE "FramedWriter",
-        .tp_basicsize = sizeof(PyFramedWriter),
-        .tp_itemsize = 0,
-        .tp_dealloc = (destructor)PyFramedWriter::dealloc,
-        .tp_flags = Py_TPFLAGS_DEFAULT,
-        .tp_doc = "PID-framed binary writer with typed primitive methods",
-        .tp_methods = PyFramedWriter_methods,
-        .tp_getset = PyFramedWriter_getset,
-        .tp_init = (initproc)PyFramedWriter::init,
-        .tp_new = PyFramedWriter::tp_new,
+    static PyType_Slot PyFramedWriter_slots[] = {
+        {Py_tp_dealloc, (void*)PyFramedWriter::dealloc},
+        {Py_tp_doc, (void*)"PID-framed binary writer with typed primitive methods"},
+        {Py_tp_methods, PyFramedWriter_methods},
+        {Py_tp_getset, PyFramedWriter_getset},
+        {Py_tp_init, (void*)PyFramedWriter::init},
+        {Py_tp_new, (void*)PyFramedWriter::tp_new},
+        {0, nullptr}
+    };
+
+    PyType_Spec FramedWriter_spec = {
+        .name = MODULE "FramedWriter",
+        .basicsize = sizeof(PyFramedWriter),
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+        .slots = PyFramedWriter_slots,
     };
 
     FramedWriter* FramedWriter_get(PyObject* obj) {
-        if (Py_TYPE(obj) != &FramedWriter_Type) {
+        // Not subclassable; each interpreter's copy shares tp_dealloc.
+        if (Py_TYPE(obj)->tp_dealloc != (destructor)PyFramedWriter::dealloc) {
             PyErr_SetString(PyExc_TypeError, "expected FramedWriter");
             return nullptr;
         }
@@ -1,20 +1,157 @@
 #include "stream.h"
 #include "wireformat.h"
+#include "dictionary.h"
+#include "module_state.h"
 
-static PyTypeObject * hidden_types[] = {
-    &retracesoftware_stream::StreamHandle_Type,
-    &retracesoftware_stream::Deleter_Type,
-    nullptr
-};
+#include <mutex>
+
+using retracesoftware_stream::ModuleState;
 
-static PyTypeObject * exposed_types[] = {
-    &retracesoftware_stream::FramedWriter_Type,
-    &retracesoftware_stream::ObjectWriter_Type,
-    &retracesoftware_stream::ObjectStream_Type,
-    &retracesoftware_stream::AsyncFilePersister_Type,
-    nullptr
+// The types each interpreter creates, and whether the module exposes them.
+static const struct {
+    PyType_Spec * spec;
+    PyTypeObject * ModuleState::* slot;
+    bool exposed;
+} module_types[] = {
+    {&retracesoftware_stream::StreamHandle_spec, &ModuleState::stream_handle_type, false},
+    {&retracesoftware_stream::Deleter_spec, &ModuleState::deleter_type, false},
+    {&retracesoftware_stream::FramedWriter_spec, &ModuleState::framed_writer_type, true},
+    {&retracesoftware_stream::ObjectWriter_spec, &ModuleState::object_writer_type, true},
+    {&retracesoftware_stream::ObjectStream_spec, &ModuleState::object_stream_type, true},
+    {&retracesoftware_stream::AsyncFilePersister_spec, &ModuleState::persister_type, true},
 };
 
+namespace retracesoftware_stream {
+
+    // Every imported instance of the module, for module_state(). Each
+    // interpreter runs under its own GIL (see moduledef's slots), so the
+    // list has a lock of its own. A state is only used, or freed, by its
+    // own interpreter.
+    static std::mutex module_states_lock;
+    static std::vector<ModuleState *> module_states;
+    // Bumped whenever module_states changes, to expire cached lookups.
+    static std::atomic<uint64_t> module_states_version{1};
+
+    static void module_states_changed() {
+        module_states_version.fetch_add(1, std::memory_order_release);
+    }
+
+    ModuleState * module_state() {
+        // Every patched tp_free asks, so each thread keeps its last answer.
+        struct Lookup {
+            PyInterpreterState * interp = nullptr;
+            ModuleState * state = nullptr;
+            uint64_t version = 0;
+        };
+        static thread_local Lookup last;
+
+        PyInterpreterState * interp = PyInterpreterState_Get();
+        uint64_t version = module_states_version.load(std::memory_order_acquire);
+        if (last.interp == interp && last.version == version) return last.state;
+
+        ModuleState * found = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(module_states_lock);
+            // Newest first: a re-import replaces the state that came before.
+            for (auto it = module_states.rbegin(); it != module_states.rend(); ++it) {
+                if ((*it)->interp == interp) {
+                    found = *it;
+                    break;
+                }
+            }
+        }
+        last = {interp, found, version};
+        return found;
+    }
+
+    static void add_module_state(ModuleState * state) {
+        std::lock_guard<std::mutex> guard(module_states_lock);
+        for (auto it = module_states.rbegin(); it != module_states.rend(); ++it) {
+            if ((*it)->interp == state->interp) {
+                state->older = *it;
+                break;
+            }
+        }
+        module_states.push_back(state);
+        module_states_changed();
+    }
+
+    static void remove_module_state(ModuleState * state) {
+        std::lock_guard<std::mutex> guard(module_states_lock);
+        for (ModuleState * other : module_states) {
+            if (other->older == state) other->older = state->older;
+        }
+        std::erase(module_states, state);
+        module_states_changed();
+    }
+
+    static PyTypeObject * import_type(const char * module, const char * name) {
+        PyObject * mod = PyImport_ImportModule(module);
+        if (!mod) { PyErr_Clear(); return nullptr; }
+        PyObject * type = PyObject_GetAttrString(mod, name);
+        Py_DECREF(mod);
+        if (!type || !PyType_Check(type)) {
+            PyErr_Clear();
+            Py_XDECREF(type);
+            return nullptr;
+        }
+        return (PyTypeObject *)type;
+    }
+
+    static void load_stdlib_types(StdlibTypes & types) {
+        types.datetime_api = (PyDateTime_CAPI *)PyCapsule_Import(PyDateTime_CAPSULE_NAME, 0);
+        if (types.datetime_api) {
+            types.date = types.datetime_api->DateType;
+            types.datetime = types.datetime_api->DateTimeType;
+            types.timedelta = types.datetime_api->DeltaType;
+            types.timezone = Py_TYPE(types.datetime_api->TimeZone_UTC);
+        } else {
+            PyErr_Clear();
+        }
+        types.decimal = import_type("decimal", "Decimal");
+        types.uuid = import_type("uuid", "UUID");
+        types.array = import_type("array", "array");
+    }
+
+    const StdlibTypes & stdlib_types() {
+        static const StdlibTypes none;
+        ModuleState * state = module_state();
+        if (!state) return none;
+        if (!state->stdlib_loaded) {
+            state->stdlib_loaded = true;
+            load_stdlib_types(state->stdlib);
+        }
+        return state->stdlib;
+    }
+
+    PyTypeObject * numpy_ndarray() {
+        ModuleState * state = module_state();
+        if (!state) return nullptr;
+        if (!state->numpy_ndarray) {
+            PyObject * name = PyUnicode_InternFromString("numpy");
+            if (!name) {
+                PyErr_Clear();
+                return nullptr;
+            }
+            PyObject * mod = PyImport_GetModule(name);
+            Py_DECREF(name);
+            if (!mod) {
+                PyErr_Clear();
+                return nullptr;
+            }
+            PyObject * type = PyObject_GetAttrString(mod, "ndarray");
+            Py_DECREF(mod);
+            if (!type || !PyType_Check(type)) {
+                PyErr_Clear();
+                Py_XDECREF(type);
+                return nullptr;
+            }
+            state->numpy_ndarray = (PyTypeObject *)type;
+        }
+        return state->numpy_ndarray;
+    }
+}
+
 static PyObject * thread_id(PyObject * module, PyObject * unused) {
     PyObject * id = PyDict_GetItem(PyThreadState_GetDict(), module);
 
@@ -30,8 +167,19 @@ static PyObject * set_thread_id(PyObject * module, PyObject * id) {
     Py_RETURN_NONE;
 }
 
+static PyObject * dictionary_hash(PyObject * module, PyObject * strings) {
+    PyObject * dictionary = retracesoftware_stream::as_dictionary(strings);
+    if (!dictionary) return nullptr;
+    uint64_t hash = retracesoftware_stream::dictionary_hash(dictionary);
+    Py_DECREF(dictionary);
+    if (PyErr_Occurred()) return nullptr;
+    return PyLong_FromUnsignedLongLong(hash);
+}
+
 static PyMethodDef module_methods[] = {
     {"thread_id", (PyCFunction)thread_id, METH_NOARGS, "TODO"},
+    {"dictionary_hash", (PyCFunction)dictionary_hash, METH_O,
+     "Hash by which a trace refers to a preset string dictionary"},
     {"set_thread_id", (PyCFunction)set_thread_id, METH_O, "TODO"},
     // {"create_wrapping_proxy_type", (PyCFunction)create_wrapping_proxy_type, METH_VARARGS | METH_KEYWORDS, "TODO"},
     // {"unwrap_apply", (PyCFunction)unwrap_apply, METH_FASTCALL | METH_KEYWORDS, "Call the wrapped target with unproxied *args/**kwargs."},
@@ -55,44 +203,112 @@ static PyMethodDef module_methods[] = {
 #define _CONCAT(a, b) a##b
 #define CONCAT(a, b) _CONCAT(a, b)
 
+static int module_exec(PyObject * module) {
+    using namespace retracesoftware_stream;
+
+    ModuleState * state = new (PyModule_GetState(module)) ModuleState();
+    state->interp = PyInterpreterState_Get();
+    add_module_state(state);
+
+    for (const auto & entry : module_types) {
+        PyObject * type = PyType_FromModuleAndSpec(module, entry.spec, nullptr);
+        if (!type) return -1;
+        state->*entry.slot = (PyTypeObject *)type;
+        if (!entry.exposed) continue;
+
+        // Find the last dot in the string
+        const char *last_dot = strrchr(entry.spec->name, '.');
+
+        // If a dot is found, the substring starts after the dot
+        const char *name = (last_dot != NULL) ? (last_dot + 1) : entry.spec->name;
+
+        if (PyModule_AddObjectRef(module, name, type) < 0) return -1;
+    }
+
+    if (PyModule_AddIntConstant(module, "FORMAT_VERSION", (long)FORMAT_VERSION) < 0 ||
+        PyModule_AddIntConstant(module, "CAP_BLOBS", (long)CAP_BLOBS) < 0 ||
+        PyModule_AddIntConstant(module, "CAP_TIMESTAMPS", (long)CAP_TIMESTAMPS) < 0 ||
+        PyModule_AddIntConstant(module, "CAP_STACKS", (long)CAP_STACKS) < 0 ||
+        PyModule_AddIntConstant(module, "CAP_DICTIONARY", (long)CAP_DICTIONARY) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// The state is zeroed until module_exec constructs it.
+static retracesoftware_stream::ModuleState * constructed_state(PyObject * module) {
+    auto * state = (retracesoftware_stream::ModuleState *)PyModule_GetState(module);
+    return state && state->interp ? state : nullptr;
+}
+
+static int module_traverse(PyObject * module, visitproc visit, void * arg) {
+    auto * state = constructed_state(module);
+    if (!state) return 0;
+    for (const auto & entry : module_types) Py_VISIT(state->*entry.slot);
+    for (auto & [type, original] : state->freefuncs) Py_VISIT(type);
+    Py_VISIT(state->pickle_dumps);
+    Py_VISIT(state->enum_meta);
+    Py_VISIT(state->base_reduce);
+    Py_VISIT(state->oserror_reduce);
+    Py_VISIT(state->numpy_ndarray);
+    return 0;
+}
+
+static int module_clear(PyObject * module) {
+    auto * state = constructed_state(module);
+    if (!state) return 0;
+    for (const auto & entry : module_types) Py_CLEAR(state->*entry.slot);
+    retracesoftware_stream::unpatch_frees(state);
+    Py_CLEAR(state->pickle_dumps);
+    Py_CLEAR(state->enum_meta);
+    Py_CLEAR(state->base_reduce);
+    Py_CLEAR(state->oserror_reduce);
+    Py_CLEAR(state->numpy_ndarray);
+    return 0;
+}
+
+static void module_free(void * module) {
+    using namespace retracesoftware_stream;
+
+    auto * state = constructed_state((PyObject *)module);
+    if (!state) return;
+    module_clear((PyObject *)module);
+    remove_module_state(state);
+    state->~ModuleState();
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, (void *)module_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    // Each interpreter gets its own types and state; what the interpreters
+    // do share (module_states, static types' freefuncs, the worker pool)
+    // is locked.
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, nullptr}
+};
+
 // Module definition
 static PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
     STR(MODULE_NAME),
     "TODO",
-    0,
-    module_methods
+    sizeof(retracesoftware_stream::ModuleState),
+    module_methods,
+    module_slots,
+    module_traverse,
+    module_clear,
+    module_free,
 };
 
-PyMODINIT_FUNC CONCAT(PyInit_, MODULE_NAME)(void) {
-    PyObject* module = PyModule_Create(&moduledef);
+namespace retracesoftware_stream {
 
-    if (!module) {
-        return NULL;
+    ModuleState * module_state_of(PyTypeObject * type) {
+        PyObject * module = PyType_GetModuleByDef(type, &moduledef);
+        return module ? (ModuleState *)PyModule_GetState(module) : nullptr;
     }
+}
 
-    for (int i = 0; hidden_types[i]; i++) {
-        if (PyType_Ready(hidden_types[i]) < 0) {
-            Py_DECREF(module);
-            return nullptr;
-        }
-    }
-
-    for (int i = 0; exposed_types[i]; i++) {
-        if (PyType_Ready(exposed_types[i]) < 0) {
-            Py_DECREF(module);
-            return nullptr;
-        }
-        // Find the last dot in the string
-        const char *last_dot = strrchr(exposed_types[i]->tp_name, '.');
-
-        // If a dot is found, the substring starts after the dot
-        const char *name = (last_dot != NULL) ? (last_dot + 1) : exposed_types[i]->tp_name;
-
-        if (PyModule_AddObject(module, name, (PyObject *)exposed_types[i]) < 0) {
-            Py_DECREF(module);
-            return nullptr;
-        }
-    }
-    return module;
-}
\ No newline at end of file
+PyMODINIT_FUNC CONCAT(PyInit_, MODULE_NAME)(void) {
+    return PyModuleDef_Init(&moduledef);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Python.h>
+#include <vector>
+
+#include "stdlib_types.h"
+#include "unordered_dense.h"
+
+namespace retracesoftware_stream {
+
+struct ObjectWriter;
+
+// What the extension keeps per interpreter: the module's state under
+// multi-phase init, so each (sub)interpreter that imports it gets its own.
+// Code with no module at hand (tp_free hooks, cached lookups) finds the
+// current interpreter's through module_state().
+struct ModuleState {
+    PyInterpreterState * interp;
+    ModuleState * older = nullptr;          // an earlier import into interp
+    std::vector<ObjectWriter *> writers;    // live writers, told of patched frees
+    // This interpreter's copies of the module's types.
+    PyTypeObject * object_writer_type = nullptr;
+    PyTypeObject * stream_handle_type = nullptr;
+    PyTypeObject * object_stream_type = nullptr;
+    PyTypeObject * persister_type = nullptr;
+    PyTypeObject * framed_writer_type = nullptr;
+    PyTypeObject * deleter_type = nullptr;
+    // Heap types patch_free gave generic_free, each held with its
+    // original tp_free until the module goes and puts it back.
+    ankerl::unordered_dense::map<PyTypeObject *, freefunc> freefuncs;
+    PyObject * pickle_dumps = nullptr;
+    PyObject * enum_meta = nullptr;         // enum.EnumMeta
+    PyObject * base_reduce = nullptr;       // BaseException.__reduce__
+    PyObject * oserror_reduce = nullptr;    // OSError.__reduce__
+    PyTypeObject * numpy_ndarray = nullptr;
+    StdlibTypes stdlib;
+    bool stdlib_loaded = false;
+};
+
+// The current interpreter's state, or nullptr if the module was never
+// imported there. Needs an attached thread state. Cached per thread, so
+// repeat calls from the same interpreter are cheap. Earlier imports into
+// the same interpreter follow through older.
+ModuleState * module_state();
+
+// The state of the module that defined type (or a base of it), or nullptr
+// with TypeError set.
+ModuleState * module_state_of(PyTypeObject * type);
+
+// Puts back the tp_free of the types in state->freefuncs and lets them go;
+// defined in objectwriter.cpp with patch_free.
+void unpatch_frees(ModuleState * state);
+
+}
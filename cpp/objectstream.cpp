@@ -1,6 +1,10 @@
 #include "stream.h"
 #include "wireformat.h"
+#include "blob_store.h"
+#include "dictionary.h"
+#include "stdlib_types.h"
 #include <chrono>
+#include <cstring>
 #include <stdexcept>
 #include <utility>
 #include <thread>
@@ -20,18 +24,65 @@ namespace retracesoftware_stream {
         return file;
     }
 
+    // What a trace shared by several ObjectWriters keeps per writer (see
+    // ExtendedTypes::WRITER). The current writer's live in ObjectStream's
+    // own members; the others wait here until a WRITER record swaps them in.
+    struct WriterTables {
+        std::vector<PyObject *> handles;
+        std::vector<PyObject *> filenames;
+        std::vector<PyObject *> interned_strings;
+        std::vector<PyObject *> dict_shapes;
+        std::vector<PyObject *> struct_layouts;
+        map<int, std::vector<uint8_t>> call_templates;
+        map<int, PyObject *> bindings;
+        map<int, uint64_t> float_history;
+        int float_site = -1;
+        int binding_counter = 0;
+        uint64_t last_timestamp = 0;
+
+        void clear() {
+            for (auto list : {&handles, &filenames, &interned_strings, &dict_shapes, &struct_layouts}) {
+                for (auto elem : *list) Py_XDECREF(elem);
+                list->clear();
+            }
+            for (auto& [index, binding] : bindings) Py_XDECREF(binding);
+            bindings.clear();
+        }
+    };
+
     struct ObjectStream : public PyObject {
         FILE * file = nullptr;
         PyObject * path = nullptr;
+        BlobReader * blobs = nullptr;
+        PyObject * dictionary = nullptr;    // preset strings (dictionary.h), if given
+        uint64_t dictionary_hash_value = 0;
         size_t bytes_read = 0;
         size_t messages_read = 0;
+        uint64_t last_timestamp = 0;    // sum of TIMESTAMP deltas read so far
+        uint64_t format_version = 0;    // from CAPABILITIES; 0 before one is read
+        uint64_t capabilities = 0;      // required | optional bits declared so far
         int read_timeout = 0;
         vectorcallfunc vectorcall;
         std::vector<PyObject *> handles;
         std::vector<PyObject *> filenames;
         std::vector<PyObject *> interned_strings;
+        std::vector<PyObject *> dict_shapes;
+        std::vector<PyObject *> struct_layouts;     // (cls, field names) tuples
+        map<int, std::vector<uint8_t>> call_templates;
+        // Args of a templated call, in reverse, returned by the next calls
+        // to next() after the handle itself.
+        std::vector<PyObject *> pending_values;
+        // Containers of the LEVELS record being read, created empty by
+        // the first LEVEL_REF and filled in place by their own level.
+        std::vector<PyObject *> level_shells;
+        int level_depth = 0;
+
+        uint32_t writer_id = 0;     // from the latest WRITER record
+        map<uint32_t, WriterTables> other_writers;
 
         map<int, PyObject *> bindings;
+        map<int, uint64_t> float_history;
+        int float_site = -1;
         bool pending_bind = false;
         int binding_counter = 0;
         PyObject * create_pickled = nullptr;
@@ -56,6 +107,8 @@ namespace retracesoftware_stream {
             int read_timeout = 0;
             int verbose = 0;
             long long start_offset = 0;
+            PyObject * blob_path = Py_None;
+            PyObject * dictionary = Py_None;
 
             static const char* kwlist[] = {
                 "path", 
@@ -68,9 +121,11 @@ namespace retracesoftware_stream {
                 "on_dropped",
                 "on_heartbeat",
                 "start_offset",
+                "blob_path",
+                "dictionary",
                 nullptr};
 
-            if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!OOOOip|OOL", (char **)kwlist, 
+            if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!OOOOip|OOLOO", (char **)kwlist, 
                 &PyUnicode_Type, &path, 
                 &create_pickled,
                 &bind_singleton,
@@ -80,14 +135,52 @@ namespace retracesoftware_stream {
                 &verbose,
                 &create_dropped,
                 &create_heartbeat,
-                &start_offset)) {
+                &start_offset,
+                &blob_path,
+                &dictionary)) {
                 return -1;
             }
 
+            if (dictionary != Py_None) {
+                PyObject * strings = as_dictionary(dictionary);
+                if (!strings) return -1;
+                uint64_t hash = dictionary_hash(strings);
+                if (PyErr_Occurred()) {
+                    Py_DECREF(strings);
+                    return -1;
+                }
+                Py_XSETREF(self->dictionary, strings);
+                self->dictionary_hash_value = hash;
+            }
+
+            if (blob_path != Py_None) {
+                PyObject * encoded = nullptr;
+                if (!PyUnicode_FSConverter(blob_path, &encoded)) return -1;
+                BlobReader * blobs = new BlobReader(PyBytes_AS_STRING(encoded));
+                Py_DECREF(encoded);
+                if (!blobs->ok()) {
+                    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, blob_path);
+                    delete blobs;
+                    return -1;
+                }
+                delete self->blobs;
+                self->blobs = blobs;
+            }
+
             new (&self->handles) std::vector<PyObject *>();
             new (&self->filenames) std::vector<PyObject *>();
             new (&self->interned_strings) std::vector<PyObject *>();
+            new (&self->dict_shapes) std::vector<PyObject *>();
+            new (&self->struct_layouts) std::vector<PyObject *>();
+            new (&self->call_templates) map<int, std::vector<uint8_t>>();
+            new (&self->pending_values) std::vector<PyObject *>();
+            new (&self->level_shells) std::vector<PyObject *>();
             new (&self->bindings) map<int, PyObject *>();
+            new (&self->float_history) map<int, uint64_t>();
+            new (&self->other_writers) map<uint32_t, WriterTables>();
+            self->float_site = -1;
+            self->writer_id = 0;
+            self->level_depth = 0;
 
             self->create_pickled = Py_NewRef(create_pickled);
             self->bind_singleton = Py_NewRef(bind_singleton);
@@ -127,12 +220,25 @@ namespace retracesoftware_stream {
             self->handles.std::vector<PyObject *>::~vector();
             self->filenames.std::vector<PyObject *>::~vector();
             self->interned_strings.std::vector<PyObject *>::~vector();
+            self->dict_shapes.std::vector<PyObject *>::~vector();
+            self->struct_layouts.std::vector<PyObject *>::~vector();
+            self->call_templates.~map<int, std::vector<uint8_t>>();
+            self->pending_values.std::vector<PyObject *>::~vector();
+            self->level_shells.std::vector<PyObject *>::~vector();
             self->bindings.~map<int, PyObject *>();
+            self->float_history.~map<int, uint64_t>();
+            self->other_writers.~map<uint32_t, WriterTables>();
 
-            Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+            delete self->blobs;
+            self->blobs = nullptr;
+
+            PyTypeObject * tp = Py_TYPE(self);
+            tp->tp_free(reinterpret_cast<PyObject*>(self));
+            Py_DECREF(tp);
         }
 
         static int traverse(ObjectStream* self, visitproc visit, void* arg) {
+            Py_VISIT(Py_TYPE(self));
             Py_VISIT(self->path);
             Py_VISIT(self->create_pickled);
             Py_VISIT(self->bind_singleton);
@@ -140,6 +246,7 @@ namespace retracesoftware_stream {
             Py_VISIT(self->create_thread_switch);
             Py_VISIT(self->create_dropped);
             Py_VISIT(self->create_heartbeat);
+            Py_VISIT(self->dictionary);
 
             return 0;
         }
@@ -161,6 +268,26 @@ namespace retracesoftware_stream {
             }
             self->interned_strings.clear();
 
+            for (auto elem : self->dict_shapes) {
+                Py_XDECREF(elem);
+            }
+            self->dict_shapes.clear();
+
+            for (auto elem : self->struct_layouts) {
+                Py_XDECREF(elem);
+            }
+            self->struct_layouts.clear();
+
+            for (auto elem : self->pending_values) {
+                Py_XDECREF(elem);
+            }
+            self->pending_values.clear();
+
+            self->clear_levels();
+
+            for (auto& [id, tables] : self->other_writers) tables.clear();
+            self->other_writers.clear();
+
             Py_CLEAR(self->path);
             Py_CLEAR(self->create_pickled);
             Py_CLEAR(self->bind_singleton);
@@ -168,6 +295,7 @@ namespace retracesoftware_stream {
             Py_CLEAR(self->create_thread_switch);
             Py_CLEAR(self->create_dropped);
             Py_CLEAR(self->create_heartbeat);
+            Py_CLEAR(self->dictionary);
 
             return 0;
         }
@@ -414,6 +542,654 @@ namespace retracesoftware_stream {
             return result;
         }
 
+        // Every float decoded updates the XOR context of the current handle,
+        // mirroring MessageStream::write_float.
+        PyObject * make_float(uint64_t bits) {
+            float_history[float_site] = bits;
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            PyObject * result = PyFloat_FromDouble(d);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * make_float(double d) {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            return make_float(bits);
+        }
+
+        template <typename T>
+        static void unpack_offsets(const uint8_t * in, int64_t * out, size_t n, int64_t base) {
+            const T * values = reinterpret_cast<const T *>(in);
+            for (size_t i = 0; i < n; i++) out[i] = (int64_t)((uint64_t)base + values[i]);
+        }
+
+        PyObject * read_packed(ExtendedTypes type, size_t n) {
+            int kind = (type - ExtendedTypes::PACKED_INT_LIST) / 2;
+            bool tuple = (type - ExtendedTypes::PACKED_INT_LIST) & 1;
+
+            PyObject * result = tuple ? PyTuple_New(n) : PyList_New(n);
+            if (!result) throw nullptr;
+            PyObject ** items = PySequence_Fast_ITEMS(result);
+
+            try {
+                switch (kind) {
+                    case 0: {
+                        uint8_t width = read<uint8_t>();
+                        if (width != 1 && width != 2 && width != 4 && width != 8) {
+                            PyErr_Format(PyExc_RuntimeError, "invalid packed int width: %i", (int)width);
+                            throw nullptr;
+                        }
+                        int64_t base = read<int64_t>();
+                        std::vector<uint8_t> raw(n * width);
+                        read(raw.data(), raw.size());
+                        std::vector<int64_t> values(n);
+                        switch (width) {
+                            case 1: unpack_offsets<uint8_t>(raw.data(), values.data(), n, base); break;
+                            case 2: unpack_offsets<uint16_t>(raw.data(), values.data(), n, base); break;
+                            case 4: unpack_offsets<uint32_t>(raw.data(), values.data(), n, base); break;
+                            default: unpack_offsets<uint64_t>(raw.data(), values.data(), n, base); break;
+                        }
+                        for (size_t i = 0; i < n; i++) {
+                            if (!(items[i] = PyLong_FromLongLong(values[i]))) throw nullptr;
+                        }
+                        break;
+                    }
+                    case 1: {
+                        std::vector<double> values(n);
+                        read(reinterpret_cast<uint8_t *>(values.data()), n * sizeof(double));
+                        for (size_t i = 0; i < n; i++) {
+                            if (!(items[i] = PyFloat_FromDouble(values[i]))) throw nullptr;
+                        }
+                        break;
+                    }
+                    default: {
+                        std::vector<uint8_t> bitmap((n + 7) / 8);
+                        read(bitmap.data(), bitmap.size());
+                        for (size_t i = 0; i < n; i++)
+                            items[i] = Py_NewRef((bitmap[i >> 3] >> (i & 7)) & 1 ? Py_True : Py_False);
+                        break;
+                    }
+                }
+            } catch (...) {
+                Py_DECREF(result);
+                throw;
+            }
+            return result;
+        }
+
+        // Like read_dict, also recording the ordered keys as the next shape.
+        PyObject * read_dict_define_shape(size_t size) {
+            auto keys = PyObjectPtr(PyTuple_New(size));
+            if (!keys.get()) throw nullptr;
+
+            auto dict = PyObjectPtr(PyDict_New());
+            if (!dict.get()) throw nullptr;
+
+            // The writer numbers the shape at its header, so it takes its
+            // id before any nested dict defines one of its own; the keys
+            // are filled in as they arrive.
+            dict_shapes.push_back(Py_NewRef(keys.get()));
+
+            for (size_t i = 0; i < size; i++) {
+                PyObject * key = read();
+                PyTuple_SET_ITEM(keys.get(), i, key);
+
+                auto value = PyObjectPtr(read());
+                if (PyDict_SetItem(dict.get(), key, value.get()) == -1) throw nullptr;
+            }
+            return Py_NewRef(dict.get());
+        }
+
+        PyObject * read_dict_shape(size_t id) {
+            if (id >= dict_shapes.size()) {
+                PyErr_Format(PyExc_RuntimeError, "unknown dict shape: %zu at byte %zu", id, bytes_read);
+                throw nullptr;
+            }
+            PyObject * keys = dict_shapes[id];
+            Py_ssize_t n = PyTuple_GET_SIZE(keys);
+
+#if PY_VERSION_HEX < 0x030D0000
+            auto dict = PyObjectPtr(_PyDict_NewPresized(n));
+#else
+            auto dict = PyObjectPtr(PyDict_New());
+#endif
+            if (!dict.get()) throw nullptr;
+
+            for (Py_ssize_t i = 0; i < n; i++) {
+                auto value = PyObjectPtr(read());
+                if (PyDict_SetItem(dict.get(), PyTuple_GET_ITEM(keys, i), value.get()) == -1) throw nullptr;
+            }
+            return Py_NewRef(dict.get());
+        }
+
+        uint64_t read_varint() {
+            uint64_t result = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                uint8_t byte = read<uint8_t>();
+                result |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) break;
+            }
+            return result;
+        }
+
+        // Returns the handle; the args are queued in pending_values.
+        PyObject * read_call(size_t handle, bool define) {
+            std::vector<uint8_t>& classes = call_templates[handle];
+            if (define) {
+                classes.resize(read<uint8_t>());
+                read(classes.data(), classes.size());
+            }
+            float_site = handle;
+
+            std::vector<PyObject *> args;
+            try {
+                for (uint8_t cls : classes) {
+                    PyObject * arg;
+                    switch (cls) {
+                        case CallArgClass::CALL_ARG_NONE:
+                            arg = Py_NewRef(Py_None);
+                            break;
+                        case CallArgClass::CALL_ARG_BOOL:
+                            arg = Py_NewRef(read<uint8_t>() ? Py_True : Py_False);
+                            break;
+                        case CallArgClass::CALL_ARG_INT:
+                            arg = PyLong_FromLongLong(zigzag_decode(read_varint()));
+                            if (!arg) throw nullptr;
+                            break;
+                        default:
+                            arg = read();
+                            break;
+                    }
+                    args.push_back(arg);
+                }
+            } catch (...) {
+                for (PyObject * arg : args) Py_DECREF(arg);
+                throw;
+            }
+            pending_values.insert(pending_values.end(), args.rbegin(), args.rend());
+            return Py_NewRef(handles[handle]);
+        }
+
+        PyObject * read_blob(ExtendedTypes type, size_t size) {
+            uint64_t hash = read<uint64_t>();
+            const uint8_t * data = blobs ? blobs->find(hash, size) : nullptr;
+            if (!data) {
+                PyErr_Format(PyExc_RuntimeError,
+                    blobs ? "blob %016llx (%zu bytes) not found in blob file"
+                          : "blob %016llx (%zu bytes) referenced but no blob_path given",
+                    (unsigned long long)hash, size);
+                throw nullptr;
+            }
+
+            switch (type) {
+                case ExtendedTypes::BLOB_STR: {
+                    PyObject * str = PyUnicode_DecodeUTF8((const char *)data, size, "strict");
+                    if (!str) throw nullptr;
+                    interned_strings.push_back(Py_NewRef(str));
+                    return str;
+                }
+                case ExtendedTypes::BLOB_PICKLED: {
+                    auto bytes = PyObjectPtr(PyBytes_FromStringAndSize((const char *)data, size));
+                    if (!bytes.get()) throw nullptr;
+                    PyObject * res = PyObject_CallOneArg(create_pickled, bytes.get());
+                    if (!res) throw nullptr;
+                    return res;
+                }
+                default: {
+                    PyObject * bytes = PyBytes_FromStringAndSize((const char *)data, size);
+                    if (!bytes) throw nullptr;
+                    return bytes;
+                }
+            }
+        }
+
+        PyObject * read_enum() {
+            auto cls = PyObjectPtr(read());
+            auto value = PyObjectPtr(read());
+
+            // Flag combinations and members created after the class may be
+            // missing from the map; calling the class looks them up or
+            // builds them.
+            PyObject * members = PyObject_GetAttrString(cls.get(), "_value2member_map_");
+            if (members) {
+                PyObject * member = PyDict_Check(members) ? PyDict_GetItemWithError(members, value.get()) : nullptr;
+                Py_DECREF(members);
+                if (member) return Py_NewRef(member);
+            }
+            PyErr_Clear();
+
+            PyObject * member = PyObject_CallOneArg(cls.get(), value.get());
+            if (!member) throw nullptr;
+            return member;
+        }
+
+        static const StdlibTypes & require_stdlib_types(PyTypeObject * StdlibTypes::* type, const char * name) {
+            const StdlibTypes & types = stdlib_types();
+            if (!(types.*type)) {
+                PyErr_Format(PyExc_RuntimeError, "stream contains a %s but it can't be imported", name);
+                throw nullptr;
+            }
+            return types;
+        }
+
+        PyObject * read_complex() {
+            double real = read<double>();
+            double imag = read<double>();
+            PyObject * result = PyComplex_FromDoubles(real, imag);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_date(uint64_t packed) {
+            const StdlibTypes & types = require_stdlib_types(&StdlibTypes::date, "date");
+            PyObject * result = types.datetime_api->Date_FromDate(
+                (int)(packed >> 9), (int)((packed >> 5) & 0xF), (int)(packed & 0x1F), types.date);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_datetime(uint64_t packed) {
+            const StdlibTypes & types = require_stdlib_types(&StdlibTypes::datetime, "datetime");
+            uint64_t v = read_varint();
+            int fold = (int)(v & 1);
+            uint64_t micros = v >> 1;
+            uint64_t seconds = micros / 1000000;
+            auto tz = PyObjectPtr(read());
+
+            PyObject * result = types.datetime_api->DateTime_FromDateAndTimeAndFold(
+                (int)(packed >> 9), (int)((packed >> 5) & 0xF), (int)(packed & 0x1F),
+                (int)(seconds / 3600), (int)(seconds / 60 % 60), (int)(seconds % 60),
+                (int)(micros % 1000000), tz.get(), fold, types.datetime);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_timedelta(uint64_t days) {
+            const StdlibTypes & types = require_stdlib_types(&StdlibTypes::timedelta, "timedelta");
+            int seconds = (int)read_varint();
+            int micros = (int)read_varint();
+            PyObject * result = types.datetime_api->Delta_FromDelta(
+                (int)zigzag_decode(days), seconds, micros, 1, types.timedelta);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_timezone(size_t nargs) {
+            const StdlibTypes & types = require_stdlib_types(&StdlibTypes::timezone, "timezone");
+            auto args = PyObjectPtr(PyTuple_New(nargs));
+            if (!args.get()) throw nullptr;
+            for (size_t i = 0; i < nargs; i++) PyTuple_SET_ITEM(args.get(), i, read());
+            PyObject * result = PyObject_Call((PyObject *)types.timezone, args.get(), nullptr);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_decimal(size_t ndigits) {
+            const StdlibTypes & types = require_stdlib_types(&StdlibTypes::decimal, "Decimal");
+            uint8_t flags = read<uint8_t>();
+
+            PyObject * exponent;
+            switch (flags & DECIMAL_SPECIAL_MASK) {
+                case DECIMAL_INFINITY: exponent = PyUnicode_FromString("F"); break;
+                case DECIMAL_NAN: exponent = PyUnicode_FromString("n"); break;
+                case DECIMAL_SNAN: exponent = PyUnicode_FromString("N"); break;
+                default: exponent = PyLong_FromLongLong(zigzag_decode(read_varint())); break;
+            }
+            auto exp = PyObjectPtr(exponent);
+            if (!exponent) throw nullptr;
+
+            auto digits = PyObjectPtr(PyTuple_New(ndigits));
+            if (!digits.get()) throw nullptr;
+            uint8_t pair = 0;
+            for (size_t i = 0; i < ndigits; i++) {
+                if (!(i & 1)) pair = read<uint8_t>();
+                PyTuple_SET_ITEM(digits.get(), i, PyLong_FromLong(i & 1 ? pair & 0xF : pair >> 4));
+            }
+
+            auto parts = PyObjectPtr(Py_BuildValue("(iOO)", flags & DECIMAL_NEGATIVE, digits.get(), exp.get()));
+            if (!parts.get()) throw nullptr;
+            PyObject * result = PyObject_CallOneArg((PyObject *)types.decimal, parts.get());
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_uuid() {
+            const StdlibTypes & types = require_stdlib_types(&StdlibTypes::uuid, "UUID");
+            uint8_t raw[16];
+            read(raw, sizeof(raw));
+
+            auto bytes = PyObjectPtr(PyBytes_FromStringAndSize((const char *)raw, sizeof(raw)));
+            if (!bytes.get()) throw nullptr;
+            auto args = PyObjectPtr(PyTuple_New(0));
+            auto kwargs = PyObjectPtr(PyDict_New());
+            if (!args.get() || !kwargs.get()) throw nullptr;
+            if (PyDict_SetItemString(kwargs.get(), "bytes", bytes.get()) == -1) throw nullptr;
+            PyObject * result = PyObject_Call((PyObject *)types.uuid, args.get(), kwargs.get());
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        PyObject * read_bytearray() {
+            auto contents = PyObjectPtr(read());
+            PyObject * result = PyByteArray_FromObject(contents.get());
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        // Rebuilt the way BaseException.__reduce__ output is unpickled:
+        // cls(*args), then any OSError filenames.
+        PyObject * read_exception(size_t nvalues) {
+            auto cls = PyObjectPtr(read());
+            auto args = PyObjectPtr(read());
+            auto filenames = PyObjectPtr(nvalues > 2 ? read() : nullptr);
+
+            if (!PyTuple_Check(args.get())) {
+                PyErr_Format(PyExc_RuntimeError, "exception args are not a tuple at byte %zu", bytes_read);
+                throw nullptr;
+            }
+            auto exc = PyObjectPtr(PyObject_Call(cls.get(), args.get(), nullptr));
+            if (!exc.get()) throw nullptr;
+
+            if (filenames.get() && PyTuple_Check(filenames.get()) && PyTuple_GET_SIZE(filenames.get()) == 2) {
+                static const char * names[] = {"filename", "filename2"};
+                for (int i = 0; i < 2; i++) {
+                    PyObject * name = PyTuple_GET_ITEM(filenames.get(), i);
+                    if (name != Py_None && PyObject_SetAttrString(exc.get(), names[i], name) == -1) throw nullptr;
+                }
+            }
+            return Py_NewRef(exc.get());
+        }
+
+        // An instance is made with tp_new and its fields stored with the
+        // generic setattr, bypassing __init__ and any __setattr__ (so
+        // frozen dataclasses work too).
+        PyObject * read_struct_fields(PyObject * layout) {
+            PyObject * cls = PyTuple_GET_ITEM(layout, 0);
+            PyObject * names = PyTuple_GET_ITEM(layout, 1);
+            PyTypeObject * tp = (PyTypeObject *)cls;
+
+            auto no_args = PyObjectPtr(PyTuple_New(0));
+            if (!no_args.get()) throw nullptr;
+            auto obj = PyObjectPtr(tp->tp_new(tp, no_args.get(), nullptr));
+            if (!obj.get()) throw nullptr;
+
+            for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(names); i++) {
+                auto value = PyObjectPtr(read());
+                if (PyObject_GenericSetAttr(obj.get(), PyTuple_GET_ITEM(names, i), value.get()) == -1) throw nullptr;
+            }
+            return Py_NewRef(obj.get());
+        }
+
+        PyObject * read_struct_define(size_t size) {
+            size_t n = (size - 1) / 2;
+            auto cls = PyObjectPtr(read());
+            auto names = PyObjectPtr(PyTuple_New(n));
+            if (!names.get()) throw nullptr;
+            for (size_t i = 0; i < n; i++) PyTuple_SET_ITEM(names.get(), i, read());
+
+            if (!PyType_Check(cls.get())) {
+                PyErr_Format(PyExc_RuntimeError, "struct class is not a type at byte %zu", bytes_read);
+                throw nullptr;
+            }
+            PyObject * layout = PyTuple_Pack(2, cls.get(), names.get());
+            if (!layout) throw nullptr;
+            // Registered before the values: one may be an instance of the
+            // same class, written as a STRUCT.
+            struct_layouts.push_back(layout);
+            return read_struct_fields(layout);
+        }
+
+        PyObject * read_struct(size_t id) {
+            if (id >= struct_layouts.size()) {
+                PyErr_Format(PyExc_RuntimeError, "unknown struct layout: %zu at byte %zu", id, bytes_read);
+                throw nullptr;
+            }
+            return read_struct_fields(struct_layouts[id]);
+        }
+
+        // A numpy array is allocated with numpy.empty and the payload read
+        // straight into it; array.array is built from a bytes payload.
+        PyObject * read_buffer(size_t size) {
+            auto cls = PyObjectPtr(read());
+            auto format = PyObjectPtr(read());
+            auto shape = PyObjectPtr(read());
+
+            PyTypeObject * ndarray = numpy_ndarray();
+            if (ndarray && cls.get() == (PyObject *)ndarray) {
+                auto numpy = PyObjectPtr(PyImport_ImportModule("numpy"));
+                if (!numpy.get()) throw nullptr;
+                auto arr = PyObjectPtr(PyObject_CallMethod(numpy.get(), "empty", "OO", shape.get(), format.get()));
+                if (!arr.get()) throw nullptr;
+
+                Py_buffer view;
+                if (PyObject_GetBuffer(arr.get(), &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) == -1) throw nullptr;
+                if ((size_t)view.len != size) {
+                    PyBuffer_Release(&view);
+                    PyErr_Format(PyExc_RuntimeError, "array payload is %zu bytes, expected %zd", size, view.len);
+                    throw nullptr;
+                }
+                try {
+                    read((uint8_t *)view.buf, size);
+                } catch (...) {
+                    PyBuffer_Release(&view);
+                    throw;
+                }
+                PyBuffer_Release(&view);
+                return Py_NewRef(arr.get());
+            }
+
+            auto payload = PyObjectPtr(PyBytes_FromStringAndSize(nullptr, size));
+            if (!payload.get()) throw nullptr;
+            read((uint8_t *)PyBytes_AS_STRING(payload.get()), size);
+            PyObject * result = PyObject_CallFunctionObjArgs(cls.get(), format.get(), payload.get(), nullptr);
+            if (!result) throw nullptr;
+            return result;
+        }
+
+        static PyObject * container_copy(PyObject * obj) {
+            PyObject * copy = PyDict_Check(obj) ? PyDict_Copy(obj)
+                            : PyList_Check(obj) ? PyList_GetSlice(obj, 0, PyList_GET_SIZE(obj))
+                            : nullptr;
+            if (!copy) {
+                if (!PyErr_Occurred()) {
+                    PyErr_Format(PyExc_RuntimeError, "patch base is a %s, not a dict or list",
+                                 Py_TYPE(obj)->tp_name);
+                }
+                throw nullptr;
+            }
+            return copy;
+        }
+
+        // The handle keeps its own copy, so callers may change the result.
+        PyObject * read_patch_base() {
+            auto value = PyObjectPtr(read());
+            handles.push_back(container_copy(value.get()));
+            return Py_NewRef(value.get());
+        }
+
+        PyObject * read_patch(size_t index) {
+            auto removed = PyObjectPtr(read());
+            auto changed = PyObjectPtr(read());
+            if (index >= handles.size() || !handles[index]) {
+                PyErr_Format(PyExc_RuntimeError, "PATCH of unknown handle %zu", index);
+                throw nullptr;
+            }
+            PyObject * base = handles[index];
+            PyObject * result;
+
+            if (PyDict_Check(base)) {
+                result = removed.get() == Py_None ? PyDict_New() : PyDict_Copy(base);
+                if (!result) throw nullptr;
+                if (removed.get() != Py_None) {
+                    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(removed.get()); i++) {
+                        if (PyDict_DelItem(result, PyTuple_GET_ITEM(removed.get(), i)) < 0) {
+                            Py_DECREF(result);
+                            throw nullptr;
+                        }
+                    }
+                }
+                if (PyDict_Update(result, changed.get()) < 0) {
+                    Py_DECREF(result);
+                    throw nullptr;
+                }
+            } else {
+                Py_ssize_t keep = PyLong_AsSsize_t(removed.get());
+                if (keep < 0 && PyErr_Occurred()) throw nullptr;
+                result = PyList_GetSlice(base, 0, keep);
+                if (!result) throw nullptr;
+                if (PyList_SetSlice(result, keep, keep, changed.get()) < 0) {
+                    Py_DECREF(result);
+                    throw nullptr;
+                }
+            }
+
+            PyObject * copy;
+            try {
+                copy = container_copy(result);
+            } catch (...) {
+                Py_DECREF(result);
+                throw;
+            }
+            Py_SETREF(handles[index], copy);
+            return result;
+        }
+
+        void clear_levels() {
+            for (auto elem : level_shells) {
+                Py_XDECREF(elem);
+            }
+            level_shells.clear();
+        }
+
+        PyObject * level_shell(size_t index, bool is_list) {
+            if (index >= level_shells.size()) level_shells.resize(index + 1, nullptr);
+            if (!level_shells[index]) {
+                level_shells[index] = is_list ? PyList_New(0) : PyDict_New();
+                if (!level_shells[index]) throw nullptr;
+            } else if (is_list != (bool)PyList_Check(level_shells[index])) {
+                PyErr_Format(PyExc_RuntimeError, "LEVEL_REF %zu does not match its container", index);
+                throw nullptr;
+            }
+            return level_shells[index];
+        }
+
+        PyObject * read_level_ref(uint64_t size) {
+            if (level_depth == 0) {
+                PyErr_SetString(PyExc_RuntimeError, "LEVEL_REF outside of LEVELS");
+                throw nullptr;
+            }
+            return Py_NewRef(level_shell(size >> 1, size & 1));
+        }
+
+        // The root, then each container's single level, moved into the
+        // shell that references to it already point at.
+        PyObject * read_levels(uint64_t n) {
+            if (level_depth++ > 0) {
+                level_depth--;
+                PyErr_SetString(PyExc_RuntimeError, "nested LEVELS");
+                throw nullptr;
+            }
+            try {
+                auto root = PyObjectPtr(read());
+                for (uint64_t i = 0; i < n; i++) {
+                    auto level = PyObjectPtr(read());
+                    bool is_list = PyList_Check(level.get());
+                    if (!is_list && !PyDict_Check(level.get())) {
+                        PyErr_Format(PyExc_RuntimeError, "LEVELS container %llu is a %s",
+                                     (unsigned long long)i, Py_TYPE(level.get())->tp_name);
+                        throw nullptr;
+                    }
+                    PyObject * shell = level_shell(i, is_list);
+                    int status = is_list
+                        ? PyList_SetSlice(shell, 0, 0, level.get())
+                        : PyDict_Update(shell, level.get());
+                    if (status < 0) throw nullptr;
+                }
+                level_depth = 0;
+                clear_levels();
+                return Py_NewRef(root.get());
+            } catch (...) {
+                level_depth = 0;
+                clear_levels();
+                throw;
+            }
+        }
+
+        PyObject * read_extended(ExtendedTypes type, uint64_t size) {
+            switch (type) {
+                case ExtendedTypes::FLOAT_INT:
+                    return make_float((double)zigzag_decode(size));
+                case ExtendedTypes::FLOAT32: {
+                    uint32_t bits32 = (uint32_t)size;
+                    float f;
+                    memcpy(&f, &bits32, sizeof(f));
+                    return make_float((double)f);
+                }
+                case ExtendedTypes::FLOAT_XOR:
+                    return make_float(float_history[float_site] ^ size);
+                case ExtendedTypes::PACKED_INT_LIST:
+                case ExtendedTypes::PACKED_INT_TUPLE:
+                case ExtendedTypes::PACKED_FLOAT_LIST:
+                case ExtendedTypes::PACKED_FLOAT_TUPLE:
+                case ExtendedTypes::PACKED_BOOL_LIST:
+                case ExtendedTypes::PACKED_BOOL_TUPLE:
+                    return read_packed(type, size);
+                case ExtendedTypes::DICT_DEFINE_SHAPE:
+                    return read_dict_define_shape(size);
+                case ExtendedTypes::DICT_SHAPE:
+                    return read_dict_shape(size);
+                case ExtendedTypes::CALL_TEMPLATE_DEFINE:
+                    return read_call(size, true);
+                case ExtendedTypes::CALL_TEMPLATE:
+                    return read_call(size, false);
+                case ExtendedTypes::BLOB_BYTES:
+                case ExtendedTypes::BLOB_STR:
+                case ExtendedTypes::BLOB_PICKLED:
+                    return read_blob(type, size);
+                case ExtendedTypes::ENUM:
+                    return read_enum();
+                case ExtendedTypes::COMPLEX:
+                    return read_complex();
+                case ExtendedTypes::DATE:
+                    return read_date(size);
+                case ExtendedTypes::DATETIME:
+                    return read_datetime(size);
+                case ExtendedTypes::TIMEDELTA:
+                    return read_timedelta(size);
+                case ExtendedTypes::TIMEZONE:
+                    return read_timezone(size);
+                case ExtendedTypes::DECIMAL:
+                    return read_decimal(size);
+                case ExtendedTypes::UUID:
+                    return read_uuid();
+                case ExtendedTypes::BYTEARRAY:
+                    return read_bytearray();
+                case ExtendedTypes::EXCEPTION:
+                    return read_exception(size);
+                case ExtendedTypes::STRUCT_DEFINE:
+                    return read_struct_define(size);
+                case ExtendedTypes::STRUCT:
+                    return read_struct(size);
+                case ExtendedTypes::BUFFER:
+                    return read_buffer(size);
+                case ExtendedTypes::PATCH_BASE:
+                    return read_patch_base();
+                case ExtendedTypes::PATCH:
+                    return read_patch(size);
+                case ExtendedTypes::LEVELS:
+                    return read_levels(size);
+                case ExtendedTypes::LEVEL_REF:
+                    return read_level_ref(size);
+                default:
+                    PyErr_Format(PyExc_RuntimeError,
+                        "unknown extended type: %i at byte %zu, message %zu",
+                        (int)type, bytes_read, messages_read);
+                    throw nullptr;
+            }
+        }
+
         PyObject * read_sized(Control control) {
 
             size_t size = read_unsigned_number(control);
@@ -424,7 +1200,13 @@ namespace retracesoftware_stream {
                     if (!result) throw nullptr;
                     return result;
                 }
+                case SizedTypes::SINT: {
+                    PyObject * result = PyLong_FromLongLong(zigzag_decode(size));
+                    if (!result) throw nullptr;
+                    return result;
+                }
                 case SizedTypes::HANDLE:
+                    float_site = size;
                     return Py_NewRef(handles[size]);
                 case SizedTypes::BINDING:
                     return Py_NewRef(bindings[size]);
@@ -443,6 +1225,8 @@ namespace retracesoftware_stream {
                     return Py_NewRef(interned_strings[size]);
                 case SizedTypes::PICKLED: return read_pickled(size);
                 case SizedTypes::BIGINT: return read_bigint(size);
+                case SizedTypes::EXTENDED:
+                    return read_extended((ExtendedTypes)read<uint8_t>(), size);
                 default:
                     PyErr_Format(PyExc_RuntimeError, "unknown sized type: %i", control.Sized.type);
                     throw nullptr;
@@ -509,13 +1293,19 @@ namespace retracesoftware_stream {
                     return PyLong_FromLong(-1);
                 // case FixedSizeTypes::BIND: return Py_NewRef(bind_singleton);
                 case FixedSizeTypes::FLOAT:
-                    return PyFloat_FromDouble(read<double>());
+                    return make_float(read<double>());
                 case FixedSizeTypes::INT64:
                     return PyLong_FromLongLong(read<int64_t>());
 
                 case FixedSizeTypes::SERIALIZE_ERROR:
                     return read();
 
+                // A value promoted to a handle inside a container: define
+                // the handle, then read the value that refers to it.
+                case FixedSizeTypes::NEW_HANDLE:
+                    handles.push_back(read());
+                    return read();
+
                 default:
                     const char * name = FixedSizeTypes_Name(static_cast<FixedSizeTypes>(type));
 
@@ -576,7 +1366,80 @@ namespace retracesoftware_stream {
             return instance;
         }
 
-        Control consume(size_t & start) {
+        // Handles root-only records until a message starts. An EXTENDED
+        // header other than TIMESTAMP has been read by the time it is seen,
+        // so it comes back through extended_type/extended_size.
+        // Checks the trace needs nothing this reader lacks, before any
+        // record that would depend on it.
+        void read_capabilities(uint64_t version) {
+            uint64_t required = read_varint();
+            uint64_t optional = read_varint();
+
+            if (verbose) printf("Retrace - ObjectStream - CAPABILITIES(v%llu, required 0x%llx, optional 0x%llx)\n",
+                                (unsigned long long)version, (unsigned long long)required, (unsigned long long)optional);
+
+            if (version > FORMAT_VERSION) {
+                PyErr_Format(PyExc_RuntimeError,
+                    "trace uses format version %llu, this reader supports up to %llu",
+                    (unsigned long long)version, (unsigned long long)FORMAT_VERSION);
+                throw nullptr;
+            }
+            if (required & ~KNOWN_REQUIRED_CAPABILITIES) {
+                PyErr_Format(PyExc_RuntimeError,
+                    "trace requires unsupported capabilities 0x%llx",
+                    (unsigned long long)(required & ~KNOWN_REQUIRED_CAPABILITIES));
+                throw nullptr;
+            }
+            if ((required & CAP_BLOBS) && !blobs) {
+                PyErr_SetString(PyExc_RuntimeError,
+                    "trace keeps large payloads in a blob file; pass blob_path to the reader");
+                throw nullptr;
+            }
+            if (required & CAP_DICTIONARY) {
+                uint64_t hash = read<uint64_t>();
+                uint64_t count = read_varint();
+                if (!dictionary || hash != dictionary_hash_value ||
+                    count != (uint64_t)PyTuple_GET_SIZE(dictionary)) {
+                    PyErr_Format(PyExc_RuntimeError,
+                        "trace was written with preset dictionary %016llx (%llu strings); "
+                        "pass the same strings as dictionary to the reader",
+                        (unsigned long long)hash, (unsigned long long)count);
+                    throw nullptr;
+                }
+                for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(dictionary); i++) {
+                    interned_strings.push_back(Py_NewRef(PyTuple_GET_ITEM(dictionary, i)));
+                }
+            }
+            format_version = version;
+            capabilities |= required | optional;
+        }
+
+        // Puts the current writer's tables away and takes out (or starts
+        // empty) those of writer id.
+        void switch_writer(uint32_t id) {
+            if (id == writer_id) return;
+
+            auto swap_tables = [this](WriterTables & tables) {
+                std::swap(handles, tables.handles);
+                std::swap(filenames, tables.filenames);
+                std::swap(interned_strings, tables.interned_strings);
+                std::swap(dict_shapes, tables.dict_shapes);
+                std::swap(struct_layouts, tables.struct_layouts);
+                std::swap(call_templates, tables.call_templates);
+                std::swap(bindings, tables.bindings);
+                std::swap(float_history, tables.float_history);
+                std::swap(float_site, tables.float_site);
+                std::swap(binding_counter, tables.binding_counter);
+                std::swap(last_timestamp, tables.last_timestamp);
+            };
+            swap_tables(other_writers[writer_id]);
+            swap_tables(other_writers[id]);
+            other_writers.erase(id);
+            writer_id = id;
+        }
+
+        Control consume(size_t & start, int & extended_type, size_t & extended_size) {
+            extended_type = -1;
             while (true) {
                 start = bytes_read;
                 Control control = read_control();
@@ -612,6 +1475,28 @@ namespace retracesoftware_stream {
                     if (verbose) printf("Retrace - ObjectStream[%lu, %lu] - Consumed EXT_BIND\n", messages_read, start);
                     bindings[binding_counter++] = read_ext_bind();
                     messages_read++;
+                } else if (control.Sized.type == SizedTypes::EXTENDED) {
+                    size_t size = read_unsigned_number(control);
+                    ExtendedTypes type = (ExtendedTypes)read<uint8_t>();
+                    if (type == ExtendedTypes::CAPABILITIES) {
+                        read_capabilities(size);
+                        messages_read++;
+                        continue;
+                    }
+                    if (type == ExtendedTypes::WRITER) {
+                        if (verbose) printf("Retrace - ObjectStream[%lu, %lu] - Consumed WRITER(%zu)\n", messages_read, start, size);
+                        switch_writer((uint32_t)size);
+                        messages_read++;
+                        continue;
+                    }
+                    if (type != ExtendedTypes::TIMESTAMP) {
+                        extended_type = type;
+                        extended_size = size;
+                        return control;
+                    }
+                    if (verbose) printf("Retrace - ObjectStream[%lu, %lu] - Consumed TIMESTAMP(+%zu)\n", messages_read, start, size);
+                    last_timestamp += size;
+                    messages_read++;
                 } else {
                     return control;
                 }
@@ -685,8 +1570,17 @@ namespace retracesoftware_stream {
                 return nullptr;
             }
 
+            if (!pending_values.empty()) {
+                PyObject * result = pending_values.back();
+                pending_values.pop_back();
+                messages_read++;
+                return result;
+            }
+
             size_t start;
-            Control control = consume(start);
+            int extended_type;
+            size_t extended_size;
+            Control control = consume(start, extended_type, extended_size);
 
             if (control == Stack) {
                 int to_drop = read_expected_int();
@@ -757,7 +1651,9 @@ namespace retracesoftware_stream {
                 return Py_NewRef(bind_singleton);
             }
             else {
-                PyObject * result = read(control);
+                PyObject * result = extended_type >= 0
+                    ? read_extended((ExtendedTypes)extended_type, extended_size)
+                    : read(control);
 
                 if (verbose) {
                     PyObject * s = PyObject_Str(result);
@@ -787,6 +1683,7 @@ namespace retracesoftware_stream {
     };
 
     static PyMemberDef members[] = {
+        {"__vectorcalloffset__", T_PYSSIZET, OFFSET_OF_MEMBER(ObjectStream, vectorcall), READONLY},
         // {"bytes_read", T_ULONGLONG, OFFSET_OF_MEMBER(ObjectReader, bytes_read), READONLY, "TODO"},
         // {"messages_read", T_ULONGLONG, OFFSET_OF_MEMBER(ObjectReader, messages_read), READONLY, "TODO"},
         // {"stacktraces", T_OBJECT, OFFSET_OF_MEMBER(ObjectReader, stacktraces), READONLY, "TODO"},
@@ -797,6 +1694,14 @@ namespace retracesoftware_stream {
         {"read_timeout", T_INT, OFFSET_OF_MEMBER(ObjectStream, read_timeout), 0, "TODO"},
         {"bytes_read", T_ULONG, OFFSET_OF_MEMBER(ObjectStream, bytes_read), READONLY, "TODO"},
         {"messages_read", T_ULONG, OFFSET_OF_MEMBER(ObjectStream, messages_read), READONLY, "TODO"},
+        {"format_version", T_ULONGLONG, OFFSET_OF_MEMBER(ObjectStream, format_version), READONLY,
+         "Format version declared by the trace, or 0 if it has no CAPABILITIES record yet"},
+        {"capabilities", T_ULONGLONG, OFFSET_OF_MEMBER(ObjectStream, capabilities), READONLY,
+         "Capability bits (see CAP_*) declared by the trace so far"},
+        {"last_timestamp", T_ULONGLONG, OFFSET_OF_MEMBER(ObjectStream, last_timestamp), READONLY,
+         "Microseconds from the writer's start to the latest message, if it recorded timestamps"},
+        {"writer_id", T_UINT, OFFSET_OF_MEMBER(ObjectStream, writer_id), READONLY,
+         "Which of the ObjectWriters sharing the trace wrote the latest message (0 if only one did)"},
         {"pending_bind", T_BOOL, OFFSET_OF_MEMBER(ObjectStream, pending_bind), READONLY, "TODO"},
         {"verbose", T_BOOL, OFFSET_OF_MEMBER(ObjectStream, verbose), 0, "TODO"},
         {NULL}  /* Sentinel */
@@ -820,22 +1725,25 @@ namespace retracesoftware_stream {
         {NULL}  // Sentinel
     };
 
-    PyTypeObject ObjectStream_Type = {
-        .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = MODULE "ObjectStreamReader",
-        .tp_basicsize = sizeof(ObjectStream),
-        .tp_itemsize = 0,
-        .tp_dealloc = (destructor)ObjectStream::dealloc,
-        .tp_vectorcall_offset = OFFSET_OF_MEMBER(ObjectStream, vectorcall),
-        .tp_call = PyVectorcall_Call,
-        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VECTORCALL,
-        .tp_doc = "TODO",
-        .tp_traverse = (traverseproc)ObjectStream::traverse,
-        .tp_clear = (inquiry)ObjectStream::clear,
-        .tp_methods = methods,
-        .tp_members = members,
-        .tp_getset = getset,
-        .tp_init = (initproc)ObjectStream::init,
-        .tp_new = PyType_GenericNew,
+    static PyType_Slot ObjectStream_slots[] = {
+        {Py_tp_dealloc, (void *)ObjectStream::dealloc},
+        {Py_tp_call, (void *)PyVectorcall_Call},
+        {Py_tp_doc, (void *)"TODO"},
+        {Py_tp_traverse, (void *)ObjectStream::traverse},
+        {Py_tp_clear, (void *)ObjectStream::clear},
+        {Py_tp_methods, methods},
+        {Py_tp_members, members},
+        {Py_tp_getset, getset},
+        {Py_tp_init, (void *)ObjectStream::init},
+        {Py_tp_new, (void *)PyType_GenericNew},
+        {0, nullptr}
+    };
+
+    PyType_Spec ObjectStream_spec = {
+        .name = MODULE "ObjectStreamReader",
+        .basicsize = sizeof(ObjectStream),
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE |
+                 Py_TPFLAGS_HAVE_VECTORCALL | Py_TPFLAGS_IMMUTABLETYPE,
+        .slots = ObjectStream_slots,
     };
 }
\ No newline at end of file
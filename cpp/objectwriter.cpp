@@ -1,16 +1,23 @@
 #include "stream.h"
 #include "writer.h"
+#include "stdlib_types.h"
+#include "module_state.h"
+#include "dictionary.h"
 #include "queueentry.h"
 #include "vendor/SPSCQueue.h"
+#include "segmented_queue.h"
 
 #include <cstddef>
 #include <cstdint>
 #include <chrono>
+#include <ctime>
 #include <thread>
+#include <mutex>
 #include <structmember.h>
 #include "wireformat.h"
 #include <algorithm>
 #include <vector>
+#include <deque>
 #include "unordered_dense.h"
 #include "base.h"
 
@@ -24,6 +31,19 @@ using namespace ankerl::unordered_dense;
     #include <unistd.h>
 #endif
 
+// Coarse monotonic clock in microseconds: a vDSO read of the tick-updated
+// clock on Linux, a few nanoseconds per call.
+static inline uint64_t coarse_micros() {
+#if defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
 int pid() {
 #ifdef _WIN32
     return static_cast<int>(GetCurrentProcessId());
@@ -37,8 +57,6 @@ namespace retracesoftware_stream {
     struct ObjectWriter;
     struct AsyncFilePersister;
 
-    static std::vector<ObjectWriter *> writers;
-
     struct StreamHandle : public PyObject {
         int index;
         PyObject * writer;
@@ -46,6 +64,7 @@ namespace retracesoftware_stream {
         vectorcallfunc vectorcall;
         
         static int traverse(StreamHandle* self, visitproc visit, void* arg) {
+            Py_VISIT(Py_TYPE(self));
             Py_VISIT(self->writer);
             Py_VISIT(self->object);
             return 0;
@@ -74,16 +93,18 @@ namespace retracesoftware_stream {
         }
     };
 
-    static PyObject* pickle_dumps_fn() {
-        static PyObject* dumps = nullptr;
-        if (!dumps) {
-            PyObject* mod = PyImport_ImportModule("pickle");
+    // enum.EnumType (EnumMeta before 3.11); nullptr if enum won't import.
+    static PyTypeObject* enum_meta() {
+        ModuleState* state = module_state();
+        if (!state) return nullptr;
+        if (!state->enum_meta) {
+            PyObject* mod = PyImport_ImportModule("enum");
             if (!mod) { PyErr_Clear(); return nullptr; }
-            dumps = PyObject_GetAttrString(mod, "dumps");
+            state->enum_meta = PyObject_GetAttrString(mod, "EnumMeta");
             Py_DECREF(mod);
-            if (!dumps) { PyErr_Clear(); return nullptr; }
+            if (!state->enum_meta) { PyErr_Clear(); return nullptr; }
         }
-        return dumps;
+        return (PyTypeObject*)state->enum_meta;
     }
 
     static inline int64_t native_estimate(PyObject* obj) {
@@ -93,7 +114,7 @@ namespace retracesoftware_stream {
             return (int64_t)(sizeof(PyObject) + PyUnicode_GET_LENGTH(obj));
         if (tp == &PyBytes_Type)
             return (int64_t)(sizeof(PyObject) + PyBytes_GET_SIZE(obj));
-        if (tp == &StreamHandle_Type) return 64;
+        if (is_stream_handle_type(tp)) return 64;
         if (is_patched(tp->tp_free)) return 64;
         if (tp == &PyFloat_Type)  return 24;
         if (tp == &PyMemoryView_Type) {
@@ -126,7 +147,7 @@ namespace retracesoftware_stream {
 
     struct ObjectWriter : public ReaderWriterBase {
         
-        rigtorp::SPSCQueue<QEntry>* queue = nullptr;
+        SegmentedQueue<QEntry>* queue = nullptr;
         rigtorp::SPSCQueue<PyObject*>* return_queue = nullptr;
         PyObject* persister = nullptr;
 
@@ -142,16 +163,117 @@ namespace retracesoftware_stream {
         PyObject* thread;
         vectorcallfunc vectorcall;
         PyObject *weakreflist;
+        ModuleState * state;    // of the module that defined its type
+
+        // Ordered key tuples of str-keyed dicts already sent, so repeats go
+        // out as CMD_DICT_SHAPE + values. Keys are held strongly.
+        static constexpr size_t MAX_DICT_SHAPES = 1024;
+        static constexpr Py_ssize_t MAX_DICT_SHAPE_KEYS = 64;
+        map<Py_hash_t, int> dict_shape_index;
+        std::vector<PyObject *> dict_shapes;
+
+        // Adaptive promotion (off unless promote_threshold > 0): immutable
+        // values written promote_threshold times by identity become
+        // handles, evicted oldest-first once promote_budget is exceeded.
+        struct Promoted {
+            int index;
+            int64_t size;
+        };
+        static constexpr size_t MAX_PROMOTE_CANDIDATES = 65536;
+        static constexpr Py_ssize_t MIN_PROMOTE_LENGTH = 32;
+        uint32_t promote_threshold = 0;
+        int64_t promote_budget = 16LL * 1024 * 1024;
+        int64_t promoted_bytes = 0;
+        bool promoting = false;
+        map<PyObject *, std::pair<PyTypeObject *, uint32_t>> promote_counts;
+        map<PyObject *, Promoted> promoted;
+        std::deque<PyObject *> promoted_order;
+
+        // Type objects and tzinfos already sent, by handle index. The first
+        // sighting sends the serializer's reference under CMD_PROMOTE;
+        // later ones are plain handle refs. Keys are held strongly.
+        map<PyObject *, int> ref_handles;
+        static constexpr size_t MAX_REF_HANDLES = 4096;
+
+        // Field accessors for classes given to register_struct. The first
+        // instance written sends STRUCT_DEFINE (class and field names) and
+        // fixes the layout's id; later ones send CMD_STRUCT + values.
+        // Classes and names are held strongly.
+        struct StructLayout {
+            PyObject * names;                   // tuple of field names
+            std::vector<Py_ssize_t> offsets;    // slot offset, or -1 for a __dict__ key
+            int id = -1;
+        };
+        map<PyTypeObject *, StructLayout> structs;
+        int next_struct_id = 0;
+
+        // Stack capture (off unless capture_stacks): each record is preceded
+        // by the calling thread's frames, outermost first, diffed against the
+        // stack last sent for that thread. Frames are (filename index << 16)
+        // | line; a filename is normalized once and sent as ADD_FILENAME.
+        // Filename keys are held strongly.
+        static constexpr size_t MAX_STACK_DEPTH = std::min<size_t>(1024, MAX_STACK_HIGH);
+        static constexpr size_t MAX_STACK_FILENAMES = MAX_STACK_HIGH;
+        static_assert(MAX_STACK_DEPTH <= MAX_STACK_HIGH && MAX_STACK_DEPTH < (1U << STACK_COUNT_BITS),
+                      "a CMD_STACK len can't hold MAX_STACK_DEPTH");
+        static_assert(MAX_STACK_FILENAMES <= MAX_STACK_HIGH, "a CMD_STACK_FRAME len can't hold the filename index");
+        bool capture_stacks = false;
+        map<PyObject *, uint32_t> stack_filenames;
+        map<uint64_t, std::vector<uint32_t>> sent_stacks;    // by PyThreadState_GetID
+        std::vector<uint32_t> stack_scratch;
+
+        // Per-message timestamps (off unless timestamps): microseconds since
+        // the writer was created, sent as CMD_TIMESTAMP deltas only when
+        // the coarse clock has moved since the last one.
+        bool timestamps = false;
+        uint64_t timestamp_base = 0;
+        uint64_t last_timestamp = 0;
+
+        // Container deltas (off unless patch_containers): a dict or list of
+        // MIN_PATCH_SIZE+ entries is sent once as a handle-backed
+        // PATCH_BASE, and when the same object is written again only its
+        // changes against a shallow snapshot go out, as CMD_PATCH. Entries
+        // are unchanged only if they are equal immutable leaves. Bases past
+        // MAX_PATCH_BASES are released oldest-first between root values.
+        // Containers and snapshots are held strongly.
+        struct PatchBase {
+            int index;
+            PyObject * snapshot;
+        };
+        static constexpr size_t MAX_PATCH_BASES = 256;
+        static constexpr Py_ssize_t MIN_PATCH_SIZE = 16;
+        bool patch_containers = false;
+        map<PyObject *, PatchBase> patch_bases;
+        std::deque<PyObject *> patch_order;
+
+        // One-level containers (off unless one_level_containers): a root
+        // value whose dicts/lists nest or cycle goes out as CMD_LEVELS. Each
+        // distinct container is flattened once, one level deep, and every
+        // occurrence is a CMD_LEVEL_REF to it; cycles and shared sub-
+        // containers cost a reference instead of recursion. Index order is
+        // discovery order; containers are held strongly while pushed.
+        static constexpr size_t MAX_LEVELS = 65536;
+        bool one_level_containers = false;
+        bool in_levels = false;
+        map<PyObject *, uint32_t> level_index;
+        std::vector<PyObject *> level_containers;
+
+        // Bytearray slabs for push_preencoded, each SLAB_SIZE bytes.
+        std::vector<PyObject *> slabs;
 
         int64_t total_added = 0;
-        std::atomic<int64_t> total_removed{0};
+        std::atomic<int64_t>* total_removed = nullptr;    // owned by the persister
         int64_t inflight_limit = 128LL * 1024 * 1024;
         int stall_timeout_seconds = 5;
 
         inline bool is_disabled() const { return queue == nullptr; }
 
+        int64_t removed() const {
+            return total_removed ? total_removed->load(std::memory_order_relaxed) : 0;
+        }
+
         int64_t inflight() const {
-            return total_added - total_removed.load(std::memory_order_relaxed);
+            return total_added - removed();
         }
 
         void wait_for_inflight() {
@@ -161,8 +283,10 @@ namespace retracesoftware_stream {
                 auto deadline = std::chrono::steady_clock::now()
                             + std::chrono::seconds(stall_timeout_seconds);
                 while (true) {
-                    if (total_added - total_removed.load(std::memory_order_relaxed) <= inflight_limit)
+                    if (inflight() <= inflight_limit)
                         { ok = true; break; }
+                    // Another thread (close, or a stalled push) disabled us.
+                    if (is_disabled()) { ok = true; break; }
                     if (std::chrono::steady_clock::now() >= deadline) break;
                     std::this_thread::yield();
                 }
@@ -180,6 +304,7 @@ namespace retracesoftware_stream {
             auto deadline = std::chrono::steady_clock::now()
                           + std::chrono::seconds(stall_timeout_seconds);
             while (true) {
+                if (is_disabled()) { ok = true; break; }
                 if (queue->try_push(entry)) { ok = true; break; }
                 if (std::chrono::steady_clock::now() >= deadline) break;
                 std::this_thread::yield();
@@ -189,6 +314,7 @@ namespace retracesoftware_stream {
         }
 
         void push(QEntry entry) {
+            if (!queue) return;
             if (!queue->try_push(entry) && !blocking_push(entry)) {
                 fprintf(stderr, "retrace: writer queue full, disabling recording\n");
                 queue = nullptr;
@@ -297,12 +423,24 @@ namespace retracesoftware_stream {
 
             PyObject_GC_UnTrack(self);
             StreamHandle::clear(self);
-            Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+            PyTypeObject * tp = Py_TYPE(self);
+            tp->tp_free(reinterpret_cast<PyObject*>(self));
+            Py_DECREF(tp);
+        }
+
+        // One of state's types, or nullptr with an error set once the
+        // module has been cleared.
+        PyTypeObject * module_type(PyTypeObject * ModuleState::* slot) {
+            PyTypeObject * type = state ? state->*slot : nullptr;
+            if (!type) PyErr_SetString(PyExc_RuntimeError, "the stream module has been unloaded");
+            return type;
         }
 
         PyObject * stream_handle(int index, PyObject * obj) {
 
-            StreamHandle * self = (StreamHandle *)StreamHandle_Type.tp_alloc(&StreamHandle_Type, 0);
+            PyTypeObject * type = module_type(&ModuleState::stream_handle_type);
+            if (!type) return nullptr;
+            StreamHandle * self = (StreamHandle *)type->tp_alloc(type, 0);
             if (!self) return nullptr;
 
             self->writer = Py_NewRef(this);
@@ -346,6 +484,914 @@ namespace retracesoftware_stream {
 
         static constexpr int MAX_FLATTEN_DEPTH = 32;
 
+        // Shape id for dict's ordered key set, defining a new one (defined
+        // = true) while the table has room; -1 when the keys aren't all
+        // exact str or the shape is unknown and the table is full.
+        int dict_shape(PyObject * dict, Py_ssize_t n, bool& defined) {
+            Py_hash_t h = n;
+            Py_ssize_t pos = 0;
+            PyObject *key, *value;
+            while (PyDict_Next(dict, &pos, &key, &value)) {
+                if (!PyUnicode_CheckExact(key)) return -1;
+                h = (h * 1000003) ^ PyObject_Hash(key);
+            }
+
+            auto it = dict_shape_index.find(h);
+            if (it != dict_shape_index.end()) {
+                PyObject * keys = dict_shapes[it->second];
+                if (PyTuple_GET_SIZE(keys) != n) return -1;
+                pos = 0;
+                for (Py_ssize_t i = 0; PyDict_Next(dict, &pos, &key, &value); i++) {
+                    PyObject * expected = PyTuple_GET_ITEM(keys, i);
+                    if (expected != key && PyUnicode_Compare(expected, key) != 0) return -1;
+                }
+                defined = false;
+                return it->second;
+            }
+
+            if (dict_shapes.size() >= MAX_DICT_SHAPES) return -1;
+
+            PyObject * keys = PyTuple_New(n);
+            if (!keys) throw nullptr;
+            pos = 0;
+            for (Py_ssize_t i = 0; PyDict_Next(dict, &pos, &key, &value); i++) {
+                PyTuple_SET_ITEM(keys, i, Py_NewRef(key));
+            }
+            int id = (int)dict_shapes.size();
+            dict_shapes.push_back(keys);
+            dict_shape_index[h] = id;
+            defined = true;
+            return id;
+        }
+
+        // Rough retained size of a promotion candidate, or -1 if obj isn't
+        // deeply immutable (str, bytes, numbers, and tuples of those).
+        static int64_t immutable_size(PyObject * obj, int depth = 0) {
+            if (is_immortal(obj) || obj == Py_None || PyBool_Check(obj)) return 0;
+            PyTypeObject * tp = Py_TYPE(obj);
+            if (tp == &PyUnicode_Type) return estimate_unicode_size(obj);
+            if (tp == &PyBytes_Type) return estimate_bytes_size(obj);
+            if (tp == &PyLong_Type) return estimate_long_size(obj);
+            if (tp == &PyFloat_Type) return estimate_float_size(obj);
+            if (tp == &PyTuple_Type && depth < 4) {
+                int64_t total = sizeof(PyTupleObject) + PyTuple_GET_SIZE(obj) * sizeof(PyObject *);
+                for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+                    int64_t item = immutable_size(PyTuple_GET_ITEM(obj, i), depth + 1);
+                    if (item < 0) return -1;
+                    total += item;
+                }
+                return total;
+            }
+            return -1;
+        }
+
+        static bool is_promote_candidate(PyObject * obj) {
+            PyTypeObject * tp = Py_TYPE(obj);
+            if (tp == &PyTuple_Type) return PyTuple_GET_SIZE(obj) > 0;
+            if (tp == &PyUnicode_Type) return !PyUnicode_CHECK_INTERNED(obj) && PyUnicode_GET_LENGTH(obj) >= MIN_PROMOTE_LENGTH;
+            if (tp == &PyBytes_Type) return PyBytes_GET_SIZE(obj) >= MIN_PROMOTE_LENGTH;
+            return false;
+        }
+
+        // Pushes obj as a handle ref if it has been promoted, or promotes it
+        // once it has been seen promote_threshold times. Returns false if
+        // the caller should flatten obj as usual.
+        bool push_promoted(PyObject * obj, int depth) {
+            auto it = promoted.find(obj);
+            if (it != promoted.end()) {
+                push(cmd_entry(CMD_HANDLE_REF, it->second.index));
+                return true;
+            }
+
+            if (promote_counts.size() >= MAX_PROMOTE_CANDIDATES) promote_counts.clear();
+            auto& [type, count] = promote_counts[obj];
+            if (type != Py_TYPE(obj)) {
+                type = Py_TYPE(obj);
+                count = 0;
+            }
+            if (++count < promote_threshold) return false;
+
+            int64_t size = immutable_size(obj);
+            promote_counts.erase(obj);
+            if (size < 0 || size > promote_budget) return false;
+
+            int index = next_handle++;
+            promoted[Py_NewRef(obj)] = {index, size};
+            promoted_order.push_back(obj);
+            promoted_bytes += size;
+
+            // Nothing nested may be promoted meanwhile: the reader numbers
+            // handles in the order their NEW_HANDLEs complete.
+            push(cmd_entry(CMD_PROMOTE, index));
+            promoting = true;
+            try {
+                push_value(obj, depth);
+            } catch (...) {
+                promoting = false;
+                throw;
+            }
+            promoting = false;
+            return true;
+        }
+
+        // Runs between root values: a DELETE can't sit inside a container.
+        void evict_promoted() {
+            while (promoted_bytes > promote_budget && !promoted_order.empty()) {
+                PyObject * obj = promoted_order.front();
+                promoted_order.pop_front();
+                auto it = promoted.find(obj);
+                promoted_bytes -= it->second.size;
+                write_delete(it->second.index);
+                promoted.erase(it);
+                Py_DECREF(obj);
+            }
+        }
+
+        static bool is_patch_candidate(PyObject * obj) {
+            PyTypeObject * tp = Py_TYPE(obj);
+            if (tp == &PyDict_Type) return PyDict_GET_SIZE(obj) >= MIN_PATCH_SIZE;
+            if (tp == &PyList_Type) return PyList_GET_SIZE(obj) >= MIN_PATCH_SIZE;
+            return false;
+        }
+
+        // Whether a container entry can be left out of a patch: both the
+        // same immutable leaf, or equal exact str/int/float/bytes.
+        static bool unchanged_entry(PyObject * before, PyObject * after) {
+            PyTypeObject * tp = Py_TYPE(after);
+            if (tp != Py_TYPE(before)) return false;
+            if (tp != &PyUnicode_Type && tp != &PyLong_Type && tp != &PyFloat_Type &&
+                tp != &PyBytes_Type && tp != &PyBool_Type && after != Py_None) {
+                return false;
+            }
+            if (before == after) return true;
+            int eq = PyObject_RichCompareBool(before, after, Py_EQ);
+            if (eq < 0) throw nullptr;
+            return eq;
+        }
+
+        static PyObject * container_snapshot(PyObject * obj) {
+            PyObject * copy = PyDict_Check(obj) ? PyDict_Copy(obj)
+                                                : PyList_GetSlice(obj, 0, PyList_GET_SIZE(obj));
+            if (!copy) throw nullptr;
+            return copy;
+        }
+
+        void push_container(PyObject * obj, int depth) {
+            if (PyDict_Check(obj)) push_dict(obj, depth);
+            else push_list(obj, depth);
+        }
+
+        // Dict patch: the removed keys (a tuple, or None to start from
+        // empty) and a dict of new or changed entries. Returns false if
+        // that would not be smaller than sending the dict whole.
+        bool dict_patch(PyObject * obj, PyObject * snapshot, PyObject *& removed, PyObject *& changed) {
+            Py_ssize_t n = PyDict_GET_SIZE(obj);
+            auto changes = PyObjectPtr(PyDict_New());
+            auto gone = PyObjectPtr(PyList_New(0));
+            if (!changes.get() || !gone.get()) throw nullptr;
+
+            Py_ssize_t pos = 0;
+            PyObject *key, *value;
+            while (PyDict_Next(obj, &pos, &key, &value)) {
+                PyObject * before = PyDict_GetItemWithError(snapshot, key);
+                if (!before && PyErr_Occurred()) throw nullptr;
+                if (before && unchanged_entry(before, value)) continue;
+                if (PyDict_SetItem(changes.get(), key, value) < 0) throw nullptr;
+                if (2 * PyDict_GET_SIZE(changes.get()) > n) return false;
+            }
+            pos = 0;
+            while (PyDict_Next(snapshot, &pos, &key, &value)) {
+                int present = PyDict_Contains(obj, key);
+                if (present < 0) throw nullptr;
+                if (!present && PyList_Append(gone.get(), key) < 0) throw nullptr;
+            }
+            if (2 * (PyDict_GET_SIZE(changes.get()) + PyList_GET_SIZE(gone.get())) > n) return false;
+
+            removed = PyList_AsTuple(gone.get());
+            if (!removed) throw nullptr;
+            changed = Py_NewRef(changes.get());
+            return true;
+        }
+
+        // List patch: how many leading items to keep, and the items after
+        // them. Only an unchanged prefix is reused.
+        bool list_patch(PyObject * obj, PyObject * snapshot, PyObject *& removed, PyObject *& changed) {
+            Py_ssize_t n = PyList_GET_SIZE(obj);
+            Py_ssize_t keep = 0, limit = std::min(n, PyList_GET_SIZE(snapshot));
+            while (keep < limit && unchanged_entry(PyList_GET_ITEM(snapshot, keep), PyList_GET_ITEM(obj, keep)))
+                keep++;
+            if (2 * (n - keep) > n) return false;
+
+            removed = PyLong_FromSsize_t(keep);
+            if (!removed) throw nullptr;
+            changed = PyList_GetSlice(obj, keep, n);
+            if (!changed) {
+                Py_DECREF(removed);
+                throw nullptr;
+            }
+            return true;
+        }
+
+        void push_patched(PyObject * obj, int depth) {
+            auto it = patch_bases.find(obj);
+            if (it == patch_bases.end()) {
+                PyObject * snapshot = container_snapshot(obj);
+                int index = next_handle++;
+                patch_bases[Py_NewRef(obj)] = {index, snapshot};
+                patch_order.push_back(obj);
+
+                // As for CMD_PROMOTE, the reader numbers the base once it
+                // has been read, so nothing nested may take a handle.
+                push(cmd_entry(CMD_EXTENDED, extended_len(ExtendedTypes::PATCH_BASE, 1)));
+                promoting = true;
+                try {
+                    push_container(obj, depth);
+                } catch (...) {
+                    promoting = false;
+                    throw;
+                }
+                promoting = false;
+                return;
+            }
+
+            PatchBase & base = it->second;
+            PyObject * removed = nullptr;
+            PyObject * changed = nullptr;
+            bool patched = PyDict_Check(obj) ? dict_patch(obj, base.snapshot, removed, changed)
+                                             : list_patch(obj, base.snapshot, removed, changed);
+            PyObject * snapshot = container_snapshot(obj);
+            Py_SETREF(base.snapshot, snapshot);
+
+            if (!patched) {
+                // Whole: start from nothing (None, or keep no list items).
+                removed = PyDict_Check(obj) ? Py_NewRef(Py_None) : PyLong_FromLong(0);
+                if (!removed) throw nullptr;
+                changed = Py_NewRef(obj);
+            }
+            auto removed_ref = PyObjectPtr(removed);
+            auto changed_ref = PyObjectPtr(changed);
+
+            push(cmd_entry(CMD_PATCH, base.index));
+            push_value(removed, depth + 1);
+            if (PyDict_Check(changed)) {
+                // Plain CMD_DICT: a one-off key set shouldn't take a dict shape.
+                push(cmd_entry(CMD_DICT, (uint32_t)PyDict_GET_SIZE(changed)));
+                Py_ssize_t pos = 0;
+                PyObject *key, *value;
+                while (PyDict_Next(changed, &pos, &key, &value)) {
+                    push_value(key, depth + 2);
+                    push_value(value, depth + 2);
+                }
+            } else {
+                push_list(changed, depth + 1);
+            }
+        }
+
+        // Indexes the dicts and lists reachable from root through
+        // containers and tuples (keys are hashable, so never hold one).
+        // True if any container holds another (or itself), i.e.
+        // CMD_LEVELS would differ from plain flattening.
+        bool collect_levels(PyObject * root) {
+            bool nested = false;
+            std::vector<std::pair<PyObject *, bool>> pending{{root, false}};
+            while (!pending.empty()) {
+                auto [obj, inside] = pending.back();
+                pending.pop_back();
+                PyTypeObject * tp = Py_TYPE(obj);
+                if (tp == &PyDict_Type || tp == &PyList_Type) {
+                    nested |= inside;
+                    if (level_index.contains(obj)) continue;
+                    if (level_containers.size() >= MAX_LEVELS) return false;
+                    level_index[obj] = (uint32_t)level_containers.size();
+                    level_containers.push_back(Py_NewRef(obj));
+                    if (tp == &PyDict_Type) {
+                        Py_ssize_t pos = 0;
+                        PyObject *key, *value;
+                        while (PyDict_Next(obj, &pos, &key, &value))
+                            pending.push_back({value, true});
+                    } else {
+                        for (Py_ssize_t i = 0; i < PyList_GET_SIZE(obj); i++)
+                            pending.push_back({PyList_GET_ITEM(obj, i), true});
+                    }
+                } else if (tp == &PyTuple_Type) {
+                    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); i++)
+                        pending.push_back({PyTuple_GET_ITEM(obj, i), inside});
+                }
+            }
+            return nested;
+        }
+
+        void clear_levels() {
+            for (PyObject * obj : level_containers) Py_DECREF(obj);
+            level_containers.clear();
+            level_index.clear();
+        }
+
+        // CMD_LEVELS(n), the root value, then the n containers, one level
+        // each. push_value turns indexed containers into CMD_LEVEL_REF.
+        void push_levels(PyObject * root) {
+            push(cmd_entry(CMD_LEVELS, (uint32_t)level_containers.size()));
+            in_levels = true;
+            try {
+                push_value(root);
+                for (PyObject * obj : level_containers) {
+                    if (PyDict_Check(obj)) push_dict(obj, 0);
+                    else push_list(obj, 0);
+                }
+            } catch (...) {
+                in_levels = false;
+                clear_levels();
+                throw;
+            }
+            in_levels = false;
+            clear_levels();
+        }
+
+        // Runs between root values, like evict_promoted.
+        void evict_patch_bases() {
+            while (patch_bases.size() > MAX_PATCH_BASES) {
+                PyObject * obj = patch_order.front();
+                patch_order.pop_front();
+                auto it = patch_bases.find(obj);
+                write_delete(it->second.index);
+                Py_DECREF(it->second.snapshot);
+                patch_bases.erase(it);
+                Py_DECREF(obj);
+            }
+        }
+
+        void clear_patch_bases() {
+            for (auto& [obj, base] : patch_bases) {
+                Py_DECREF(obj);
+                Py_DECREF(base.snapshot);
+            }
+            patch_bases.clear();
+            patch_order.clear();
+        }
+
+        void push_pickled(PyObject * bytes) {
+            total_added += estimate_bytes_size(bytes);
+#if SIZEOF_VOID_P >= 8
+            push(pickled_entry(bytes));
+#else
+            push(cmd_entry(CMD_PICKLED));
+            push(obj_entry(bytes));
+#endif
+        }
+
+        // The serializer's reference for an object not yet sent, or nullptr
+        // (error cleared) if it fails or the table is full.
+        PyObject * serialize_reference(PyObject * obj) {
+            if (ref_handles.size() >= MAX_REF_HANDLES) return nullptr;
+            wait_for_inflight();
+            PyObject * res = PyObject_CallOneArg(serializer, obj);
+            if (!res) PyErr_Clear();
+            return res;
+        }
+
+        // Returns false, having pushed nothing, if the serializer fails;
+        // the caller's usual path then reports the error.
+        bool push_reference(PyObject * obj, int depth) {
+            auto it = ref_handles.find(obj);
+            if (it != ref_handles.end()) {
+                push(cmd_entry(CMD_HANDLE_REF, it->second));
+                return true;
+            }
+
+            PyObject * res = serialize_reference(obj);
+            if (!res) return false;
+            push_new_reference(obj, res, depth);
+            return true;
+        }
+
+        // Steals res, the serializer's reference for obj.
+        void push_new_reference(PyObject * obj, PyObject * res, int depth) {
+            int index = next_handle++;
+            ref_handles[Py_NewRef(obj)] = index;
+
+            push(cmd_entry(CMD_PROMOTE, index));
+            if (PyBytes_Check(res)) {
+                push_pickled(res);
+            } else {
+                promoting = true;
+                try {
+                    push_value(res, depth + 1);
+                } catch (...) {
+                    promoting = false;
+                    Py_DECREF(res);
+                    throw;
+                }
+                promoting = false;
+                Py_DECREF(res);
+            }
+        }
+
+        // A bytearray is mutable, so its contents are copied now.
+        void push_bytearray(PyObject * obj) {
+            PyObject * copy = PyBytes_FromStringAndSize(PyByteArray_AS_STRING(obj), PyByteArray_GET_SIZE(obj));
+            if (!copy) throw nullptr;
+            wait_for_inflight();
+            total_added += estimate_bytes_size(copy);
+            push(cmd_entry(CMD_EXTENDED, extended_len(ExtendedTypes::BYTEARRAY, 1)));
+            push(obj_entry(copy));
+        }
+
+        static constexpr int64_t STDLIB_VALUE_SIZE = 64;
+
+        // The writer thread encodes these itself, except that a datetime's
+        // tzinfo, unless None or a datetime.timezone, is pushed after it
+        // as a reference.
+        void push_stdlib_value(PyObject * obj, int depth) {
+            const StdlibTypes & types = stdlib_types();
+            if (Py_TYPE(obj) == types.datetime) {
+                PyObject * tz = PyDateTime_DATE_GET_TZINFO(obj);
+                if (tz != Py_None && Py_TYPE(tz) != types.timezone) {
+                    push(cmd_entry(CMD_DATETIME));
+                    push_obj(obj, sizeof(PyDateTime_DateTime));
+                    if (promoting || !push_reference(tz, depth + 1)) push_value(tz, depth + 1);
+                    return;
+                }
+            }
+            push_obj(obj, STDLIB_VALUE_SIZE);
+        }
+
+        // Pushes CMD_EXTENDED(type, count) and, as its first value, cls by
+        // handle. Returns false, having pushed nothing, if cls can't be
+        // serialized.
+        bool push_extended_with_class(ExtendedTypes type, uint32_t count, PyObject * cls, int depth) {
+            PyObject * res;
+            if (!class_reference(cls, res)) return false;
+
+            push(cmd_entry(CMD_EXTENDED, extended_len(type, count)));
+            push_class_reference(cls, res, depth + 1);
+            return true;
+        }
+
+        // Gets cls ready to push by handle: res is the serializer's
+        // reference if cls hasn't been sent yet, else nullptr. False if
+        // cls can't be serialized.
+        bool class_reference(PyObject * cls, PyObject *& res) {
+            res = nullptr;
+            return ref_handles.contains(cls) || (res = serialize_reference(cls));
+        }
+
+        // Steals res, as returned by class_reference.
+        void push_class_reference(PyObject * cls, PyObject * res, int depth) {
+            if (res) push_new_reference(cls, res, depth);
+            else push(cmd_entry(CMD_HANDLE_REF, ref_handles[cls]));
+        }
+
+        // array.array and numpy.ndarray go out as their class, a format
+        // (typecode or dtype string), the shape and the raw C-order bytes.
+        // A read-only contiguous export is pinned by a memoryview and
+        // written from place; anything else is copied once, here, since
+        // the owner may change it before the writer thread gets to it.
+        // Returns false, having pushed nothing, for other types, object
+        // or structured dtypes, and failed exports.
+        bool push_buffer(PyObject * obj, int depth) {
+            PyTypeObject * tp = Py_TYPE(obj);
+            PyObject * format = nullptr;
+            PyObject * shape = nullptr;
+
+            if (tp == stdlib_types().array) {
+                format = PyObject_GetAttrString(obj, "typecode");
+                shape = Py_NewRef(Py_None);
+            } else if (tp == numpy_ndarray()) {
+                PyObject * dtype = PyObject_GetAttrString(obj, "dtype");
+                if (dtype) {
+                    PyObject * hasobject = PyObject_GetAttrString(dtype, "hasobject");
+                    PyObject * names = PyObject_GetAttrString(dtype, "names");
+                    if (hasobject == Py_False && names == Py_None) {
+                        format = PyObject_GetAttrString(dtype, "str");
+                        shape = PyObject_GetAttrString(obj, "shape");
+                    }
+                    Py_XDECREF(hasobject);
+                    Py_XDECREF(names);
+                    Py_DECREF(dtype);
+                }
+            } else {
+                return false;
+            }
+
+            Py_buffer view;
+            PyObject * res = nullptr;
+            if (!format || !shape || PyObject_GetBuffer(obj, &view, PyBUF_FULL_RO) == -1) {
+                PyErr_Clear();
+                Py_XDECREF(format);
+                Py_XDECREF(shape);
+                return false;
+            }
+
+            PyObject * payload;
+            if (view.readonly && PyBuffer_IsContiguous(&view, 'C')) {
+                payload = PyMemoryView_FromObject(obj);
+            } else {
+                payload = PyBytes_FromStringAndSize(nullptr, view.len);
+                if (payload && PyBuffer_ToContiguous(PyBytes_AS_STRING(payload), &view, view.len, 'C') == -1) {
+                    Py_CLEAR(payload);
+                }
+            }
+            Py_ssize_t size = view.len;
+            PyBuffer_Release(&view);
+
+            if (!payload || !class_reference((PyObject *)tp, res)) {
+                PyErr_Clear();
+                Py_XDECREF(payload);
+                Py_DECREF(format);
+                Py_DECREF(shape);
+                return false;
+            }
+
+            wait_for_inflight();
+            total_added += size;
+            push(cmd_entry(CMD_BUFFER));
+            push(obj_entry(payload));
+            push_class_reference((PyObject *)tp, res, depth + 1);
+            try {
+                push_value(format, depth + 1);
+                push_value(shape, depth + 1);
+            } catch (...) {
+                Py_DECREF(format);
+                Py_DECREF(shape);
+                throw;
+            }
+            Py_DECREF(format);
+            Py_DECREF(shape);
+            return true;
+        }
+
+        // An exception reduces (as pickle would see it) to its class and
+        // args, plus filename and filename2 for OSError, when it has no
+        // __dict__ and its class doesn't override __reduce__.
+        static bool is_plain_exception(PyObject * obj) {
+            PyObject * dict = ((PyBaseExceptionObject *)obj)->dict;
+            if (dict && PyDict_GET_SIZE(dict)) return false;
+            if (!PyTuple_Check(((PyBaseExceptionObject *)obj)->args)) return false;
+
+            ModuleState * state = module_state();
+            if (!state) return false;
+            if (!state->base_reduce) {
+                state->base_reduce = PyObject_GetAttrString(PyExc_BaseException, "__reduce__");
+                state->oserror_reduce = PyObject_GetAttrString(PyExc_OSError, "__reduce__");
+                if (!state->base_reduce || !state->oserror_reduce) {
+                    PyErr_Clear();
+                    Py_CLEAR(state->base_reduce);
+                    Py_CLEAR(state->oserror_reduce);
+                    return false;
+                }
+            }
+            PyObject * reduce = PyObject_GetAttrString((PyObject *)Py_TYPE(obj), "__reduce__");
+            if (!reduce) {
+                PyErr_Clear();
+                return false;
+            }
+            Py_DECREF(reduce);
+            if (reduce == state->base_reduce) return true;
+            return reduce == state->oserror_reduce && PyObject_TypeCheck(obj, (PyTypeObject *)PyExc_OSError);
+        }
+
+        bool push_exception(PyObject * obj, int depth) {
+            if (!is_plain_exception(obj)) return false;
+
+            bool os_error = PyObject_TypeCheck(obj, (PyTypeObject *)PyExc_OSError);
+            if (!push_extended_with_class(ExtendedTypes::EXCEPTION, os_error ? 3 : 2,
+                                          (PyObject *)Py_TYPE(obj), depth)) return false;
+
+            push_value(((PyBaseExceptionObject *)obj)->args, depth + 1);
+            if (os_error) {
+                PyOSErrorObject * err = (PyOSErrorObject *)obj;
+                push(cmd_entry(CMD_TUPLE, 2));
+                push_value(err->filename ? err->filename : Py_None, depth + 2);
+                push_value(err->filename2 ? err->filename2 : Py_None, depth + 2);
+            }
+            return true;
+        }
+
+        // An enum member goes out as its class, by type handle, and its
+        // _value_. Returns false, having pushed nothing, if either can't
+        // be had.
+        bool push_enum(PyObject * obj, int depth) {
+            PyObject * value = PyObject_GetAttrString(obj, "_value_");
+            if (!value) {
+                PyErr_Clear();
+                return false;
+            }
+            if (!push_extended_with_class(ExtendedTypes::ENUM, 2, (PyObject *)Py_TYPE(obj), depth)) {
+                Py_DECREF(value);
+                return false;
+            }
+
+            try {
+                push_value(value, depth + 1);
+            } catch (...) {
+                Py_DECREF(value);
+                throw;
+            }
+            Py_DECREF(value);
+            return true;
+        }
+
+        void clear_promoted() {
+            for (PyObject * obj : promoted_order) Py_DECREF(obj);
+            promoted_order.clear();
+            promoted.clear();
+            promote_counts.clear();
+            promoted_bytes = 0;
+        }
+
+        void clear_structs() {
+            for (auto& [cls, layout] : structs) {
+                Py_DECREF(cls);
+                Py_DECREF(layout.names);
+            }
+            structs.clear();
+        }
+
+        // The index for a code object's filename, sending ADD_FILENAME the
+        // first time; -1 once the table is full. normalize_path failures
+        // fall back to the raw filename.
+        int stack_filename(PyObject * filename) {
+            auto it = stack_filenames.find(filename);
+            if (it != stack_filenames.end()) return (int)it->second;
+            if (stack_filenames.size() >= MAX_STACK_FILENAMES) return -1;
+
+            PyObject * normalized = nullptr;
+            if (normalize_path && normalize_path != Py_None) {
+                normalized = PyObject_CallOneArg(normalize_path, filename);
+                if (!normalized) PyErr_Clear();
+                else if (!PyUnicode_Check(normalized)) Py_CLEAR(normalized);
+            }
+            if (!normalized) normalized = Py_NewRef(filename);
+
+            uint32_t index = (uint32_t)stack_filenames.size();
+            stack_filenames[Py_NewRef(filename)] = index;
+            push(cmd_entry(CMD_ADD_FILENAME));
+            push_value(normalized);
+            Py_DECREF(normalized);
+            return (int)index;
+        }
+
+        // Sends the change in this thread's stack since its last record:
+        // frames to drop past the common prefix, then the new ones.
+        void push_stack() {
+            PyThreadState * tstate = PyThreadState_Get();
+            stack_scratch.clear();
+
+            PyFrameObject * frame = PyThreadState_GetFrame(tstate);
+            while (frame && stack_scratch.size() < MAX_STACK_DEPTH) {
+                PyCodeObject * code = PyFrame_GetCode(frame);
+                int file = stack_filename(code->co_filename);
+                Py_DECREF(code);
+                if (file < 0) {
+                    Py_DECREF(frame);
+                    return;
+                }
+                int line = std::clamp(PyFrame_GetLineNumber(frame), 0, 0xFFFF);
+                stack_scratch.push_back(((uint32_t)file << 16) | (uint32_t)line);
+
+                PyFrameObject * back = PyFrame_GetBack(frame);
+                Py_DECREF(frame);
+                frame = back;
+            }
+            Py_XDECREF(frame);
+            std::reverse(stack_scratch.begin(), stack_scratch.end());
+
+            std::vector<uint32_t> & sent = sent_stacks[PyThreadState_GetID(tstate)];
+            auto [sent_end, new_begin] = std::mismatch(sent.begin(), sent.end(),
+                                                       stack_scratch.begin(), stack_scratch.end());
+            uint32_t to_drop = (uint32_t)(sent.end() - sent_end);
+            uint32_t n = (uint32_t)(stack_scratch.end() - new_begin);
+            if (to_drop == 0 && n == 0) return;
+
+            push(cmd_entry(CMD_STACK, (to_drop << STACK_COUNT_BITS) | n));
+            for (auto it = new_begin; it != stack_scratch.end(); ++it) {
+                push(cmd_entry(CMD_STACK_FRAME, *it));
+            }
+            sent.assign(stack_scratch.begin(), stack_scratch.end());
+        }
+
+        void push_timestamp() {
+            uint64_t now = coarse_micros() - timestamp_base;
+            if (now <= last_timestamp) return;
+            uint64_t delta = now - last_timestamp;
+            last_timestamp = now;
+            for (; delta > MAX_TIMESTAMP_DELTA; delta -= MAX_TIMESTAMP_DELTA) {
+                push(cmd_entry(CMD_TIMESTAMP, MAX_TIMESTAMP_DELTA));
+            }
+            push(cmd_entry(CMD_TIMESTAMP, (uint32_t)delta));
+        }
+
+        void clear_stacks() {
+            for (auto& [filename, index] : stack_filenames) Py_DECREF(filename);
+            stack_filenames.clear();
+            sent_stacks.clear();
+        }
+
+        void register_struct(PyObject * cls, PyObject * fields) {
+            if (!PyType_Check(cls)) {
+                PyErr_Format(PyExc_TypeError, "register_struct expects a class, got %R", cls);
+                throw nullptr;
+            }
+            auto names = PyObjectPtr(PySequence_Tuple(fields));
+            if (!names.get()) throw nullptr;
+
+            Py_ssize_t n = PyTuple_GET_SIZE(names.get());
+            if (n == 0 || n > MAX_STRUCT_FIELDS) {
+                PyErr_Format(PyExc_ValueError, "register_struct needs 1 to %zd fields, got %zd", MAX_STRUCT_FIELDS, n);
+                throw nullptr;
+            }
+
+            StructLayout layout;
+            for (Py_ssize_t i = 0; i < n; i++) {
+                PyObject * name = PyTuple_GET_ITEM(names.get(), i);
+                if (!PyUnicode_CheckExact(name)) {
+                    PyErr_Format(PyExc_TypeError, "struct field names must be str, got %R", name);
+                    throw nullptr;
+                }
+                // A __slots__ entry is an object member descriptor on the
+                // class; anything else is read from the instance __dict__.
+                PyObject * attr = PyObject_GetAttr(cls, name);
+                Py_ssize_t offset = -1;
+                if (!attr) {
+                    PyErr_Clear();
+                } else {
+                    if (Py_TYPE(attr) == &PyMemberDescr_Type) {
+                        PyMemberDef * member = ((PyMemberDescrObject *)attr)->d_member;
+                        if (member->type == T_OBJECT_EX || member->type == T_OBJECT) offset = member->offset;
+                    }
+                    Py_DECREF(attr);
+                }
+                if (offset < 0 && ((PyTypeObject *)cls)->tp_dictoffset == 0
+#ifdef Py_TPFLAGS_MANAGED_DICT
+                    && !(((PyTypeObject *)cls)->tp_flags & Py_TPFLAGS_MANAGED_DICT)
+#endif
+                    ) {
+                    PyErr_Format(PyExc_TypeError, "%R has neither a slot nor a __dict__ for field %R", cls, name);
+                    throw nullptr;
+                }
+                layout.offsets.push_back(offset);
+            }
+            layout.names = Py_NewRef(names.get());
+
+            auto it = structs.find((PyTypeObject *)cls);
+            if (it != structs.end()) {
+                Py_DECREF(it->second.names);
+                it->second = layout;
+            } else {
+                structs[(PyTypeObject *)Py_NewRef(cls)] = layout;
+            }
+        }
+
+        // Returns false, having pushed nothing, if a field is unset; the
+        // instance then goes through the serializer.
+        bool push_struct(PyObject * obj, int depth) {
+            auto it = structs.find(Py_TYPE(obj));
+            if (it == structs.end()) return false;
+            StructLayout & layout = it->second;
+            Py_ssize_t n = PyTuple_GET_SIZE(layout.names);
+
+            // Held for the duration: pushing a value can run the serializer.
+            PyObject * values[MAX_STRUCT_FIELDS];
+            PyObject * dict = nullptr;
+            Py_ssize_t got = 0;
+            for (; got < n; got++) {
+                PyObject * value;
+                if (layout.offsets[got] >= 0) {
+                    value = Py_XNewRef(*(PyObject **)((char *)obj + layout.offsets[got]));
+                } else {
+                    if (!dict && !(dict = PyObject_GenericGetDict(obj, nullptr))) break;
+                    value = Py_XNewRef(PyDict_GetItemWithError(dict, PyTuple_GET_ITEM(layout.names, got)));
+                }
+                if (!value) break;
+                values[got] = value;
+            }
+            Py_XDECREF(dict);
+
+            if (got < n) {
+                PyErr_Clear();
+                for (Py_ssize_t i = 0; i < got; i++) Py_DECREF(values[i]);
+                return false;
+            }
+
+            try {
+                if (layout.id < 0) {
+                    if (!push_extended_with_class(ExtendedTypes::STRUCT_DEFINE, 1 + 2 * (uint32_t)n,
+                                                  (PyObject *)Py_TYPE(obj), depth)) {
+                        for (Py_ssize_t i = 0; i < n; i++) Py_DECREF(values[i]);
+                        return false;
+                    }
+                    layout.id = next_struct_id++;
+                    for (Py_ssize_t i = 0; i < n; i++) push_value(PyTuple_GET_ITEM(layout.names, i), depth + 1);
+                    for (Py_ssize_t i = 0; i < n; i++) push_value(values[i], depth + 1);
+                } else {
+                    push(cmd_entry(CMD_STRUCT, ((uint32_t)layout.id << STRUCT_SIZE_BITS) | (uint32_t)n));
+                    for (Py_ssize_t i = 0; i < n; i++) push_value(values[i], depth + 1);
+                }
+            } catch (...) {
+                for (Py_ssize_t i = 0; i < n; i++) Py_DECREF(values[i]);
+                throw;
+            }
+            for (Py_ssize_t i = 0; i < n; i++) Py_DECREF(values[i]);
+            return true;
+        }
+
+        void clear_dict_shapes() {
+            for (PyObject * keys : dict_shapes) Py_DECREF(keys);
+            dict_shapes.clear();
+            dict_shape_index.clear();
+        }
+        static constexpr Py_ssize_t PACKED_MIN_LENGTH = 16;
+
+        // A list/tuple whose items are all exact int (fitting int64), float
+        // or bool is snapshotted into one bytes object instead of one queue
+        // entry per item; the writer thread packs it. Returns false, having
+        // pushed nothing, when the items are not homogeneous.
+        bool push_packed(PyObject ** items, Py_ssize_t n, bool tuple) {
+            PyTypeObject * tp = Py_TYPE(items[0]);
+            uint32_t kind;
+
+            if (tp == &PyLong_Type) kind = PACKED_INT;
+            else if (tp == &PyFloat_Type) kind = PACKED_FLOAT;
+            else if (tp == &PyBool_Type) kind = PACKED_BOOL;
+            else return false;
+
+            for (Py_ssize_t i = 1; i < n; i++) {
+                if (Py_TYPE(items[i]) != tp) return false;
+            }
+
+            Py_ssize_t width = kind == PACKED_BOOL ? 1 : 8;
+            PyObject * bytes = PyBytes_FromStringAndSize(nullptr, n * width);
+            if (!bytes) throw nullptr;
+            char * out = PyBytes_AS_STRING(bytes);
+
+            switch (kind) {
+                case PACKED_INT:
+                    for (Py_ssize_t i = 0; i < n; i++) {
+                        int overflow;
+                        long long v = PyLong_AsLongLongAndOverflow(items[i], &overflow);
+                        if (overflow) {
+                            Py_DECREF(bytes);
+                            return false;
+                        }
+                        memcpy(out + i * 8, &v, 8);
+                    }
+                    break;
+                case PACKED_FLOAT:
+                    for (Py_ssize_t i = 0; i < n; i++) {
+                        double d = PyFloat_AS_DOUBLE(items[i]);
+                        memcpy(out + i * 8, &d, 8);
+                    }
+                    break;
+                case PACKED_BOOL:
+                    for (Py_ssize_t i = 0; i < n; i++) out[i] = items[i] == Py_True;
+                    break;
+            }
+
+            wait_for_inflight();
+            total_added += estimate_bytes_size(bytes);
+            push(cmd_entry(CMD_PACKED, kind | (tuple ? PACKED_TUPLE : 0)));
+            push(obj_entry(bytes));
+            return true;
+        }
+
+        static constexpr Py_ssize_t PREENCODE_MIN_LENGTH = 32;
+        static constexpr Py_ssize_t SLAB_SIZE = 64 * 1024;
+        static constexpr size_t MAX_SLABS = 32;
+
+        // A slab only the pool refers to: the writer thread has written its
+        // last use and the return thread has dropped its reference. Both
+        // happen under the GIL, so the reference count is the free flag.
+        PyObject * free_slab() {
+            for (PyObject * slab : slabs) {
+                if (Py_REFCNT(slab) == 1) return slab;
+            }
+            if (slabs.size() >= MAX_SLABS) return nullptr;
+            PyObject * slab = PyByteArray_FromStringAndSize(nullptr, SLAB_SIZE);
+            if (!slab) throw nullptr;
+            slabs.push_back(slab);
+            return slab;
+        }
+
+        // A list/dict of scalars that packing cannot take (mixed types,
+        // None, short non-interned ASCII str) is encoded here, straight into
+        // a pooled slab, and pushed as one CMD_PREENCODED entry. Returns
+        // false, having pushed nothing, if an element is not a scalar, the
+        // value outgrows a slab, or every slab is still in flight.
+        bool push_preencoded(PyObject * obj) {
+            PyObject * slab = free_slab();
+            if (!slab) return false;
+            size_t used = Preencoder((uint8_t *)PyByteArray_AS_STRING(slab), SLAB_SIZE).encode(obj);
+            if (!used) return false;
+
+            // Taken before waiting, which may let another thread write.
+            Py_INCREF(slab);
+            wait_for_inflight();
+            total_added += estimate_size(slab);
+            push(cmd_entry(CMD_PREENCODED, (uint32_t)used));
+            push(obj_entry(slab));
+            return true;
+        }
+
         void push_obj(PyObject* obj, int64_t size) {
             wait_for_inflight();
             total_added += size;
@@ -353,6 +1399,39 @@ namespace retracesoftware_stream {
             push(obj_entry(obj));
         }
 
+        void push_list(PyObject * obj, int depth) {
+            assert (depth < MAX_FLATTEN_DEPTH);
+            Py_ssize_t n = PyList_GET_SIZE(obj);
+            if (n < PACKED_MIN_LENGTH || !push_packed(PySequence_Fast_ITEMS(obj), n, false)) {
+                if (n >= PREENCODE_MIN_LENGTH && push_preencoded(obj)) return;
+                push(cmd_entry(CMD_LIST, (uint32_t)n));
+                for (Py_ssize_t i = 0; i < n; i++)
+                    push_value(PyList_GET_ITEM(obj, i), depth + 1);
+            }
+        }
+
+        void push_dict(PyObject * obj, int depth) {
+            assert (depth < MAX_FLATTEN_DEPTH);
+            Py_ssize_t n = PyDict_Size(obj);
+            // Shaped dicts already skip their keys; larger ones may preencode.
+            if (n > MAX_DICT_SHAPE_KEYS && push_preencoded(obj)) return;
+            bool defined = false;
+            int shape = n > 0 && n <= MAX_DICT_SHAPE_KEYS ? dict_shape(obj, n, defined) : -1;
+            Py_ssize_t pos = 0;
+            PyObject *key, *value;
+            if (shape >= 0 && !defined) {
+                push(cmd_entry(CMD_DICT_SHAPE, ((uint32_t)shape << DICT_SHAPE_SIZE_BITS) | (uint32_t)n));
+                while (PyDict_Next(obj, &pos, &key, &value))
+                    push_value(value, depth + 1);
+            } else {
+                push(cmd_entry(shape >= 0 ? CMD_DICT_DEFINE_SHAPE : CMD_DICT, (uint32_t)n));
+                while (PyDict_Next(obj, &pos, &key, &value)) {
+                    push_value(key, depth + 1);
+                    push_value(value, depth + 1);
+                }
+            }
+        }
+
         void push_value(PyObject* obj, int depth = 0) {
 
             if (is_immortal(obj)) {
@@ -360,43 +1439,55 @@ namespace retracesoftware_stream {
             } else {
                 PyTypeObject* tp = Py_TYPE(obj);
 
-                if (tp == &PyLong_Type) {
+                if (in_levels && (tp == &PyDict_Type || tp == &PyList_Type) &&
+                    level_index.contains(obj)) {
+                    push(cmd_entry(CMD_LEVEL_REF, (level_index[obj] << 1) | (tp == &PyList_Type)));
+                } else if (promote_threshold && !promoting && is_promote_candidate(obj) &&
+                    push_promoted(obj, depth)) {
+                    return;
+                } else if (tp == &PyLong_Type) {
                     push_obj(obj, estimate_long_size(obj));
                 } else if (tp == &PyUnicode_Type) {
                     push_obj(obj, estimate_unicode_size(obj));
                 } else if (tp == &PyBytes_Type) {
                     push_obj(obj, estimate_bytes_size(obj));
-                } else if (tp == &StreamHandle_Type) {
+                } else if (is_stream_handle_type(tp)) {
                     push_obj(obj, estimate_stream_handle_size(obj));
                 } else if (is_patched(tp->tp_free)) {
                     push_obj(obj, 64);
+                } else if (patch_containers && !promoting && is_patch_candidate(obj)) {
+                    push_patched(obj, depth);
                 } else if (tp == &PyList_Type) {
-                    assert (depth < MAX_FLATTEN_DEPTH);
-                    Py_ssize_t n = PyList_GET_SIZE(obj);
-                    push(cmd_entry(CMD_LIST, (uint32_t)n));
-                    for (Py_ssize_t i = 0; i < n; i++)
-                        push_value(PyList_GET_ITEM(obj, i), depth + 1);
-
+                    push_list(obj, depth);
                 } else if (tp == &PyTuple_Type) {
                     assert (depth < MAX_FLATTEN_DEPTH);
                     Py_ssize_t n = PyTuple_GET_SIZE(obj);
-                    push(cmd_entry(CMD_TUPLE, (uint32_t)n));
-                    for (Py_ssize_t i = 0; i < n; i++)
-                        push_value(PyTuple_GET_ITEM(obj, i), depth + 1);
-                } else if (tp == &PyDict_Type) {
-                    assert (depth < MAX_FLATTEN_DEPTH);
-                    Py_ssize_t n = PyDict_Size(obj);
-                    push(cmd_entry(CMD_DICT, (uint32_t)n));
-                    Py_ssize_t pos = 0;
-                    PyObject *key, *value;
-                    while (PyDict_Next(obj, &pos, &key, &value)) {
-                        push_value(key, depth + 1);
-                        push_value(value, depth + 1);
+                    if (n < PACKED_MIN_LENGTH || !push_packed(PySequence_Fast_ITEMS(obj), n, true)) {
+                        push(cmd_entry(CMD_TUPLE, (uint32_t)n));
+                        for (Py_ssize_t i = 0; i < n; i++)
+                            push_value(PyTuple_GET_ITEM(obj, i), depth + 1);
                     }
+                } else if (tp == &PyDict_Type) {
+                    push_dict(obj, depth);
                 } else if (tp == &PyFloat_Type) {
                     push_obj(obj, estimate_float_size(obj));
                 } else if (tp == &PyMemoryView_Type) {
                     push_obj(obj, estimate_memory_view_size(obj));
+                } else if (tp == &PyByteArray_Type) {
+                    push_bytearray(obj);
+                } else if (is_stdlib_value(tp)) {
+                    push_stdlib_value(obj, depth);
+                } else if (PyType_Check(obj) && !promoting && push_reference(obj, depth)) {
+                    return;
+                } else if (!structs.empty() && !promoting && push_struct(obj, depth)) {
+                    return;
+                } else if (tp->tp_as_buffer && !promoting && push_buffer(obj, depth)) {
+                    return;
+                } else if (PyExceptionInstance_Check(obj) && !promoting && push_exception(obj, depth)) {
+                    return;
+                } else if (!promoting && enum_meta() && PyObject_TypeCheck((PyObject *)tp, enum_meta())
+                           && push_enum(obj, depth)) {
+                    return;
                 } else {
                     wait_for_inflight();
                     // Try the full serializer (type_serializer + pickle fallback)
@@ -404,13 +1495,7 @@ namespace retracesoftware_stream {
                     if (res) {
                         if (PyBytes_Check(res)) {
                             // Serializer returned pickled bytes
-                            total_added += estimate_bytes_size(res);
-#if SIZEOF_VOID_P >= 8
-                            push(pickled_entry(res));
-#else
-                            push(cmd_entry(CMD_PICKLED));
-                            push(obj_entry(res));
-#endif
+                            push_pickled(res);
                         } else {
                             // Serializer returned a converted object (e.g. Stack → tuple)
                             push_value(res, depth + 1);
@@ -464,24 +1549,72 @@ namespace retracesoftware_stream {
                 printf("%s\n", debugstr(obj));
             }
 
-            push_value(obj);
+            evict();
+            PyTypeObject * tp = Py_TYPE(obj);
+            if (one_level_containers &&
+                (tp == &PyDict_Type || tp == &PyList_Type || tp == &PyTuple_Type)) {
+                if (collect_levels(obj)) push_levels(obj);
+                else {
+                    clear_levels();
+                    push_value(obj);
+                }
+            } else {
+                push_value(obj);
+            }
             messages_written++;
         }
 
+        // Runs between root values, where a HANDLE_DELETE may go.
+        void evict() {
+            if (promoted_bytes > promote_budget) evict_promoted();
+            if (patch_bases.size() > MAX_PATCH_BASES) evict_patch_bases();
+        }
+
         void object_freed(PyObject * obj) {
             if (is_disabled()) return;
             push(delete_entry(obj));
         }
 
+        // Args that push_value sends as exactly one TAG_OBJECT entry. With
+        // promotion on, a long str or bytes may go out as a HANDLE_REF or
+        // a PROMOTE instead.
+        bool is_call_leaf(PyObject * obj) const {
+            PyTypeObject * tp = Py_TYPE(obj);
+            if (is_immortal(obj)) return true;
+            if (promote_threshold && is_promote_candidate(obj)) return false;
+            return tp == &PyLong_Type ||
+                   tp == &PyFloat_Type || tp == &PyUnicode_Type ||
+                   tp == &PyBytes_Type || is_stream_handle_type(tp);
+        }
+
         void write_all(StreamHandle * self, PyObject *const * args, size_t nargs) {
             if (!is_disabled()) {
                 send_thread();
+                if (capture_stacks) push_stack();
+                if (timestamps) push_timestamp();
 
                 Writing w;
 
-                write_root(self);
-                for (size_t i = 0; i < nargs; i++) {
-                    write_root(args[i]);
+                if (nargs > 0 && nargs <= MAX_CALL_ARGS &&
+                    std::all_of(args, args + nargs, [this](PyObject * arg) { return is_call_leaf(arg); })) {
+                    // Nothing may come between CMD_CALL and its entries, so
+                    // evict up front and push the args without write_root.
+                    evict();
+                    push(cmd_entry(CMD_CALL, (uint32_t)nargs));
+                    write_root(self);
+                    for (size_t i = 0; i < nargs; i++) {
+                        if (verbose) {
+                            debug_prefix();
+                            printf("%s\n", debugstr(args[i]));
+                        }
+                        push_value(args[i]);
+                        messages_written++;
+                    }
+                } else {
+                    write_root(self);
+                    for (size_t i = 0; i < nargs; i++) {
+                        write_root(args[i]);
+                    }
                 }
             }
         }
@@ -490,6 +1623,8 @@ namespace retracesoftware_stream {
 
             if (!is_disabled()) {
                 send_thread();
+                if (capture_stacks) push_stack();
+                if (timestamps) push_timestamp();
 
                 Writing w;
 
@@ -589,6 +1724,19 @@ namespace retracesoftware_stream {
             }
         }
 
+        static PyObject * py_register_struct(ObjectWriter * self, PyObject * const * args, Py_ssize_t nargs) {
+            if (nargs != 2) {
+                PyErr_SetString(PyExc_TypeError, "register_struct(cls, fields) takes exactly 2 arguments");
+                return nullptr;
+            }
+            try {
+                self->register_struct(args[0], args[1]);
+                Py_RETURN_NONE;
+            } catch (...) {
+                return nullptr;
+            }
+        }
+
         static PyObject * py_ext_bind(ObjectWriter * self, PyObject* obj);
         // defined after Deleter
 
@@ -606,6 +1754,13 @@ namespace retracesoftware_stream {
             int stall_timeout_arg = 5;
             Py_ssize_t queue_capacity_arg = 65536;
             Py_ssize_t return_queue_capacity_arg = 131072;
+            Py_ssize_t promote_threshold_arg = 0;
+            long long promote_budget_arg = 16LL * 1024 * 1024;
+            int capture_stacks = 0;
+            int timestamps = 0;
+            PyObject * dictionary_arg = Py_None;
+            int patch_containers = 0;
+            int one_level_containers = 0;
 
             static const char* kwlist[] = {
                 "output",
@@ -619,16 +1774,35 @@ namespace retracesoftware_stream {
                 "return_queue_capacity",
                 "quit_on_error",
                 "serialize_errors",
+                "promote_threshold",
+                "promote_budget",
+                "capture_stacks",
+                "timestamps",
+                "dictionary",
+                "patch_containers",
+                "one_level_containers",
                 nullptr};
 
-            if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OpOLinnpp", (char **)kwlist,
+            if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OpOLinnppnLppOpp", (char **)kwlist,
                 &output, &serializer, &thread, &verbose, &normalize_path,
                 &inflight_limit_arg, &stall_timeout_arg,
                 &queue_capacity_arg, &return_queue_capacity_arg,
-                &quit_on_error, &serialize_errors)) {
+                &quit_on_error, &serialize_errors,
+                &promote_threshold_arg, &promote_budget_arg,
+                &capture_stacks, &timestamps, &dictionary_arg,
+                &patch_containers, &one_level_containers)) {
                 return -1;
             }
 
+            self->state = module_state_of(Py_TYPE(self));
+            if (!self->state) return -1;
+
+            PyObject * dictionary = nullptr;
+            if (dictionary_arg != Py_None) {
+                dictionary = as_dictionary(dictionary_arg);
+                if (!dictionary) return -1;
+            }
+
             self->verbose = verbose;
             self->quit_on_error = quit_on_error;
             self->serialize_errors = serialize_errors;
@@ -639,6 +1813,34 @@ namespace retracesoftware_stream {
 
             self->messages_written = 0;
             self->next_handle = 0;
+
+            new (&self->dict_shape_index) map<Py_hash_t, int>();
+            new (&self->dict_shapes) std::vector<PyObject *>();
+            new (&self->promote_counts) map<PyObject *, std::pair<PyTypeObject *, uint32_t>>();
+            new (&self->promoted) map<PyObject *, Promoted>();
+            new (&self->promoted_order) std::deque<PyObject *>();
+            self->promote_threshold = (uint32_t)std::max<Py_ssize_t>(promote_threshold_arg, 0);
+            self->promote_budget = promote_budget_arg;
+            self->promoted_bytes = 0;
+            self->promoting = false;
+            new (&self->ref_handles) map<PyObject *, int>();
+            new (&self->structs) map<PyTypeObject *, StructLayout>();
+            self->next_struct_id = 0;
+            self->capture_stacks = capture_stacks;
+            new (&self->stack_filenames) map<PyObject *, uint32_t>();
+            new (&self->sent_stacks) map<uint64_t, std::vector<uint32_t>>();
+            new (&self->stack_scratch) std::vector<uint32_t>();
+            self->timestamps = timestamps;
+            self->timestamp_base = coarse_micros();
+            self->last_timestamp = 0;
+            self->patch_containers = patch_containers;
+            new (&self->patch_bases) map<PyObject *, PatchBase>();
+            new (&self->patch_order) std::deque<PyObject *>();
+            self->one_level_containers = one_level_containers;
+            self->in_levels = false;
+            new (&self->level_index) map<PyObject *, uint32_t>();
+            new (&self->level_containers) std::vector<PyObject *>();
+            new (&self->slabs) std::vector<PyObject *>();
             
             self->vectorcall = reinterpret_cast<vectorcallfunc>(ObjectWriter::py_vectorcall);
 
@@ -649,24 +1851,39 @@ namespace retracesoftware_stream {
             self->return_queue = nullptr;
             self->persister = nullptr;
             self->total_added = 0;
-            self->total_removed.store(0, std::memory_order_relaxed);
+            self->total_removed = nullptr;
             self->inflight_limit = inflight_limit_arg;
             self->stall_timeout_seconds = stall_timeout_arg;
 
-            if (output != Py_None && Py_TYPE(output) == &AsyncFilePersister_Type) {
+            if (output != Py_None && is_persister(output)) {
                 SetupResult r = AsyncFilePersister_setup(output, serializer,
                                                          (size_t)queue_capacity_arg,
+                                                         std::max((size_t)queue_capacity_arg,
+                                                                  (size_t)std::max<long long>(inflight_limit_arg, 0) / sizeof(QEntry)),
                                                          (size_t)return_queue_capacity_arg,
-                                                         &self->total_removed,
                                                          self->thread,
                                                          self->quit_on_error);
-                if (!r.forward_queue) return -1;
-                self->queue = (rigtorp::SPSCQueue<QEntry>*)r.forward_queue;
+                if (!r.forward_queue) {
+                    Py_XDECREF(dictionary);
+                    return -1;
+                }
+                self->queue = (SegmentedQueue<QEntry>*)r.forward_queue;
                 self->return_queue = (rigtorp::SPSCQueue<PyObject*>*)r.return_queue;
+                self->total_removed = r.total_removed;
                 self->persister = Py_NewRef(output);
+
+                uint32_t declared = (capture_stacks ? CAP_STACKS : 0) |
+                                    (timestamps ? CAP_TIMESTAMPS : 0) |
+                                    (dictionary ? CAP_DICTIONARY : 0);
+                self->push(cmd_entry(CMD_CAPABILITIES, declared));
+                if (dictionary) {
+                    self->total_added += estimate_size(dictionary);
+                    self->push(obj_entry(Py_NewRef(dictionary)));
+                }
             }
+            Py_XDECREF(dictionary);
 
-            writers.push_back(self);
+            self->state->writers.push_back(self);
 
             return 0;
         }
@@ -677,6 +1894,7 @@ namespace retracesoftware_stream {
         }
 
         static int traverse(ObjectWriter* self, visitproc visit, void* arg) {
+            Py_VISIT(Py_TYPE(self));
             Py_VISIT(self->persister);
             Py_VISIT(self->serializer);
             Py_VISIT(self->thread);
@@ -707,12 +1925,42 @@ namespace retracesoftware_stream {
             PyObject_GC_UnTrack(self);
             clear(self);
 
-            Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+            self->clear_dict_shapes();
+            self->dict_shape_index.~map<Py_hash_t, int>();
+            self->dict_shapes.std::vector<PyObject *>::~vector();
 
-            auto it = std::find(writers.begin(), writers.end(), self);
-            if (it != writers.end()) {
-                writers.erase(it);
-            }
+            self->clear_promoted();
+            self->promote_counts.~map<PyObject *, std::pair<PyTypeObject *, uint32_t>>();
+            self->promoted.~map<PyObject *, Promoted>();
+            self->promoted_order.std::deque<PyObject *>::~deque();
+
+            for (auto& [cls, index] : self->ref_handles) Py_DECREF(cls);
+            self->ref_handles.~map<PyObject *, int>();
+
+            self->clear_structs();
+            self->structs.~map<PyTypeObject *, StructLayout>();
+
+            self->clear_stacks();
+            self->stack_filenames.~map<PyObject *, uint32_t>();
+            self->sent_stacks.~map<uint64_t, std::vector<uint32_t>>();
+            self->stack_scratch.std::vector<uint32_t>::~vector();
+
+            self->clear_patch_bases();
+            self->patch_bases.~map<PyObject *, PatchBase>();
+            self->patch_order.std::deque<PyObject *>::~deque();
+
+            self->clear_levels();
+            self->level_index.~map<PyObject *, uint32_t>();
+            self->level_containers.std::vector<PyObject *>::~vector();
+
+            for (PyObject * slab : self->slabs) Py_DECREF(slab);
+            self->slabs.std::vector<PyObject *>::~vector();
+
+            if (self->state) std::erase(self->state->writers, self);
+
+            PyTypeObject * tp = Py_TYPE(self);
+            tp->tp_free(reinterpret_cast<PyObject*>(self));
+            Py_DECREF(tp);
         }
 
         static PyObject * path_getter(ObjectWriter *self, void *closure) {
@@ -799,10 +2047,13 @@ namespace retracesoftware_stream {
         static void dealloc(Deleter* self) {
             PyObject_GC_UnTrack(self);
             Py_CLEAR(self->writer);
-            Py_TYPE(self)->tp_free((PyObject*)self);
+            PyTypeObject * tp = Py_TYPE(self);
+            tp->tp_free((PyObject*)self);
+            Py_DECREF(tp);
         }
 
         static int traverse(Deleter* self, visitproc visit, void* arg) {
+            Py_VISIT(Py_TYPE(self));
             Py_VISIT(self->writer);
             return 0;
         }
@@ -813,25 +2064,35 @@ namespace retracesoftware_stream {
         }
     };
 
-    PyTypeObject Deleter_Type = {
-        .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = MODULE "Deleter",
-        .tp_basicsize = sizeof(Deleter),
-        .tp_itemsize = 0,
-        .tp_dealloc = (destructor)Deleter::dealloc,
-        .tp_vectorcall_offset = OFFSET_OF_MEMBER(Deleter, vectorcall),
-        .tp_call = PyVectorcall_Call,
-        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_VECTORCALL,
-        .tp_traverse = (traverseproc)Deleter::traverse,
-        .tp_clear = (inquiry)Deleter::clear,
+    static PyMemberDef Deleter_members[] = {
+        {"__vectorcalloffset__", T_PYSSIZET, OFFSET_OF_MEMBER(Deleter, vectorcall), READONLY},
+        {NULL}
+    };
+
+    static PyType_Slot Deleter_slots[] = {
+        {Py_tp_dealloc, (void *)Deleter::dealloc},
+        {Py_tp_call, (void *)PyVectorcall_Call},
+        {Py_tp_traverse, (void *)Deleter::traverse},
+        {Py_tp_clear, (void *)Deleter::clear},
+        {Py_tp_members, Deleter_members},
+        {0, nullptr}
+    };
+
+    PyType_Spec Deleter_spec = {
+        .name = MODULE "Deleter",
+        .basicsize = sizeof(Deleter),
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_VECTORCALL |
+                 Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+        .slots = Deleter_slots,
     };
 
     PyObject* ObjectWriter::py_ext_bind(ObjectWriter* self, PyObject* obj) {
         try {
             self->bind(obj, true);
 
-            auto* d = reinterpret_cast<Deleter*>(
-                Deleter_Type.tp_alloc(&Deleter_Type, 0));
+            PyTypeObject* type = self->module_type(&ModuleState::deleter_type);
+            if (!type) return nullptr;
+            auto* d = reinterpret_cast<Deleter*>(type->tp_alloc(type, 0));
             if (!d) return nullptr;
 
             d->writer = Py_NewRef((PyObject*)self);
@@ -844,19 +2105,39 @@ namespace retracesoftware_stream {
         }
     }
 
-    static map<PyTypeObject *, freefunc> freefuncs;
+    // A heap type belongs to one interpreter, so its original tp_free is
+    // kept in that interpreter's ModuleState. Static types are shared by
+    // every interpreter, and so is their entry here.
+    static std::mutex static_freefuncs_lock;
+    static map<PyTypeObject *, freefunc> static_freefuncs;
 
+    // The patched tp_free slots may be shared, but only the writers of the
+    // interpreter freeing the object hear about it.
     void on_free(void * obj) {
-        for (ObjectWriter * writer : writers) {
-            writer->object_freed((PyObject *)obj);
+        for (ModuleState * state = module_state(); state; state = state->older) {
+            for (ObjectWriter * writer : state->writers) {
+                writer->object_freed((PyObject *)obj);
+            }
+        }
+    }
+
+    static freefunc original_free(PyTypeObject * cls) {
+        if (!(cls->tp_flags & Py_TPFLAGS_HEAPTYPE)) {
+            std::lock_guard<std::mutex> guard(static_freefuncs_lock);
+            auto it = static_freefuncs.find(cls);
+            return it != static_freefuncs.end() ? it->second : nullptr;
+        }
+        for (ModuleState * state = module_state(); state; state = state->older) {
+            auto it = state->freefuncs.find(cls);
+            if (it != state->freefuncs.end()) return it->second;
         }
+        return nullptr;
     }
 
     void generic_free(void * obj) {
-        auto it = freefuncs.find(Py_TYPE(obj));
-        if (it != freefuncs.end()) {
+        if (freefunc original = original_free(Py_TYPE(obj))) {
             on_free(obj);
-            it->second(obj);
+            original(obj);
         } else {
             // bad situation, a memory leak! Maybe print a bad warning
         }
@@ -884,14 +2165,28 @@ namespace retracesoftware_stream {
             cls->tp_free = PyObject_Free_Wrapper;
         } else if (cls->tp_free == PyObject_GC_Del) {
             cls->tp_free = PyObject_GC_Del_Wrapper;
-        } else {
-            freefuncs[cls] = cls->tp_free;
+        } else if (!(cls->tp_flags & Py_TPFLAGS_HEAPTYPE)) {
+            std::lock_guard<std::mutex> guard(static_freefuncs_lock);
+            static_freefuncs[cls] = cls->tp_free;
+            cls->tp_free = generic_free;
+        } else if (ModuleState * state = module_state()) {
+            state->freefuncs[(PyTypeObject *)Py_NewRef(cls)] = cls->tp_free;
             cls->tp_free = generic_free;
         }
     }
 
+    void unpatch_frees(ModuleState * state) {
+        auto freefuncs = std::move(state->freefuncs);
+        state->freefuncs.clear();
+        for (auto & [cls, original] : freefuncs) {
+            if (cls->tp_free == generic_free) cls->tp_free = original;
+            Py_DECREF(cls);
+        }
+    }
+
     PyMemberDef StreamHandle_members[] = {
         {"index", T_ULONGLONG, OFFSET_OF_MEMBER(StreamHandle, index), READONLY, "TODO"},
+        {"__vectorcalloffset__", T_PYSSIZET, OFFSET_OF_MEMBER(StreamHandle, vectorcall), READONLY},
         {NULL}
     };
 
@@ -901,19 +2196,26 @@ namespace retracesoftware_stream {
 
     // --- StreamHandle type ---
 
-    PyTypeObject StreamHandle_Type = {
-        .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = MODULE "StreamHandle",
-        .tp_basicsize = sizeof(StreamHandle),
-        .tp_itemsize = 0,
-        .tp_dealloc = (destructor)ObjectWriter::StreamHandle_dealloc,
-        .tp_vectorcall_offset = OFFSET_OF_MEMBER(StreamHandle, vectorcall),
-        .tp_call = PyVectorcall_Call,
-        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_VECTORCALL,
-        .tp_doc = "TODO",
-        .tp_traverse = (traverseproc)StreamHandle::traverse,
-        .tp_clear = (inquiry)StreamHandle::clear,
-        .tp_members = StreamHandle_members,
+    void StreamHandle_dealloc(PyObject * self) {
+        ObjectWriter::StreamHandle_dealloc(reinterpret_cast<StreamHandle *>(self));
+    }
+
+    static PyType_Slot StreamHandle_slots[] = {
+        {Py_tp_dealloc, (void *)StreamHandle_dealloc},
+        {Py_tp_call, (void *)PyVectorcall_Call},
+        {Py_tp_doc, (void *)"TODO"},
+        {Py_tp_traverse, (void *)StreamHandle::traverse},
+        {Py_tp_clear, (void *)StreamHandle::clear},
+        {Py_tp_members, StreamHandle_members},
+        {0, nullptr}
+    };
+
+    PyType_Spec StreamHandle_spec = {
+        .name = MODULE "StreamHandle",
+        .basicsize = sizeof(StreamHandle),
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_VECTORCALL |
+                 Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+        .slots = StreamHandle_slots,
     };
 
     // --- ObjectWriter type ---
@@ -925,10 +2227,14 @@ namespace retracesoftware_stream {
         {"heartbeat", (PyCFunction)ObjectWriter::py_heartbeat, METH_O, "Push heartbeat payload dict and flush"},
         {"bind", (PyCFunction)ObjectWriter::py_bind, METH_O, "TODO"},
         {"ext_bind", (PyCFunction)ObjectWriter::py_ext_bind, METH_O, "TODO"},
+        {"register_struct", (PyCFunction)ObjectWriter::py_register_struct, METH_FASTCALL,
+         "register_struct(cls, fields): write exact instances of cls as their class and the named fields"},
         {NULL}
     };
 
     static PyMemberDef members[] = {
+        {"__vectorcalloffset__", T_PYSSIZET, OFFSET_OF_MEMBER(ObjectWriter, vectorcall), READONLY},
+        {"__weaklistoffset__", T_PYSSIZET, OFFSET_OF_MEMBER(ObjectWriter, weakreflist), READONLY},
         {"messages_written", T_ULONGLONG, OFFSET_OF_MEMBER(ObjectWriter, messages_written), READONLY, "TODO"},
         {"verbose", T_BOOL, OFFSET_OF_MEMBER(ObjectWriter, verbose), 0, "TODO"},
         {"buffer_writes", T_BOOL, OFFSET_OF_MEMBER(ObjectWriter, buffer_writes), 0, "When false, flush after every write"},
@@ -948,24 +2254,26 @@ namespace retracesoftware_stream {
         {NULL}
     };
 
-    PyTypeObject ObjectWriter_Type = {
-        .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = MODULE "ObjectWriter",
-        .tp_basicsize = sizeof(ObjectWriter),
-        .tp_itemsize = 0,
-        .tp_dealloc = (destructor)ObjectWriter::dealloc,
-        .tp_vectorcall_offset = OFFSET_OF_MEMBER(ObjectWriter, vectorcall),
-        .tp_hash = (hashfunc)_Py_HashPointer,
-        .tp_call = PyVectorcall_Call,
-        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VECTORCALL,
-        .tp_doc = "TODO",
-        .tp_traverse = (traverseproc)ObjectWriter::traverse,
-        .tp_clear = (inquiry)ObjectWriter::clear,
-        .tp_weaklistoffset = OFFSET_OF_MEMBER(ObjectWriter, weakreflist),
-        .tp_methods = methods,
-        .tp_members = members,
-        .tp_getset = getset,
-        .tp_init = (initproc)ObjectWriter::init,
-        .tp_new = PyType_GenericNew,
+    static PyType_Slot ObjectWriter_slots[] = {
+        {Py_tp_dealloc, (void *)ObjectWriter::dealloc},
+        {Py_tp_hash, (void *)_Py_HashPointer},
+        {Py_tp_call, (void *)PyVectorcall_Call},
+        {Py_tp_doc, (void *)"TODO"},
+        {Py_tp_traverse, (void *)ObjectWriter::traverse},
+        {Py_tp_clear, (void *)ObjectWriter::clear},
+        {Py_tp_methods, methods},
+        {Py_tp_members, members},
+        {Py_tp_getset, getset},
+        {Py_tp_init, (void *)ObjectWriter::init},
+        {Py_tp_new, (void *)PyType_GenericNew},
+        {0, nullptr}
+    };
+
+    PyType_Spec ObjectWriter_spec = {
+        .name = MODULE "ObjectWriter",
+        .basicsize = sizeof(ObjectWriter),
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE |
+                 Py_TPFLAGS_HAVE_VECTORCALL | Py_TPFLAGS_IMMUTABLETYPE,
+        .slots = ObjectWriter_slots,
     };
 }
@@ -3,9 +3,15 @@
 #include "framed_writer.h"
 #include "queueentry.h"
 #include "vendor/SPSCQueue.h"
+#include "segmented_queue.h"
 #include <structmember.h>
 #include <thread>
 #include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <cerrno>
 #include <cstring>
 #include <string>
@@ -19,6 +25,13 @@
     #include <sys/socket.h>
     #include <sys/un.h>
     #include <limits.h>
+    #include <pthread.h>
+#endif
+
+#ifdef __linux__
+    #include <sched.h>
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
 #endif
 
 namespace retracesoftware_stream {
@@ -35,10 +48,197 @@ namespace retracesoftware_stream {
         PyErr_Clear();
     }
 
+    // CMD_PACKED flags (kind + tuple bit) to the wire type.
+    static ExtendedTypes packed_type(uint32_t flags) {
+        return (ExtendedTypes)(ExtendedTypes::PACKED_INT_LIST
+            + (flags & PACKED_KIND_MASK) * 2
+            + ((flags & PACKED_TUPLE) ? 1 : 0));
+    }
+
+    // One ObjectWriter feeding a persister: its pair of queues and the
+    // MessageStream whose handle, string and shape tables its entries
+    // refer to. Owned by the persister and freed on close, so the drain
+    // thread can keep crediting total_removed after the writer is gone.
+    struct Producer {
+        uint32_t id;                  // WRITER id in the stream
+        SegmentedQueue<QEntry>* queue;
+        rigtorp::SPSCQueue<PyObject*>* return_queue;
+        MessageStream* stream;
+        std::atomic<int64_t> total_removed{0};
+        PyObject* writer_key;
+        PyThreadState* last_tstate = nullptr;
+        std::unordered_map<PyThreadState*, PyObject*> thread_cache;
+        bool retired = false;         // CMD_SHUTDOWN seen; nothing follows
+    };
+
+    static constexpr size_t MAX_PRODUCERS = 64;
+    static constexpr int MAX_POOL_THREADS = 64;
+
+    // Root entries the writer thread takes from one producer before
+    // looking at the next.
+    static constexpr size_t PRODUCER_TURN = 1024;
+
+    // A background thread takes the GIL for the interpreter that owns the
+    // persister it is serving. PyGILState_Ensure only knows the main
+    // interpreter, so each thread keeps a thread state per interpreter it
+    // works for, deleted when it is done with that interpreter or exits.
+    class ThreadStates {
+        std::vector<std::pair<PyInterpreterState*, PyThreadState*>> states;
+
+    public:
+        PyThreadState* get(PyInterpreterState* interp) {
+            for (auto& [owner, tstate] : states) {
+                if (owner == interp) return tstate;
+            }
+            PyThreadState* tstate = PyThreadState_New(interp);
+            states.emplace_back(interp, tstate);
+            return tstate;
+        }
+
+        // Called without the GIL.
+        void drop(PyInterpreterState* interp) {
+            for (auto it = states.begin(); it != states.end(); ++it) {
+                if (it->first != interp) continue;
+                PyEval_RestoreThread(it->second);
+                PyThreadState_Clear(it->second);
+                PyThreadState_DeleteCurrent();
+                states.erase(it);
+                return;
+            }
+        }
+
+        // Once the runtime is finalizing, taking the GIL would end this
+        // thread from inside a destructor; the states are left to it.
+        ~ThreadStates() {
+            if (_Py_IsFinalizing()) return;
+            while (!states.empty()) drop(states.back().first);
+        }
+    };
+
+    static thread_local ThreadStates thread_states;
+
+    static void acquire_interpreter(PyInterpreterState* interp) {
+        PyEval_RestoreThread(thread_states.get(interp));
+    }
+
+    static void release_interpreter() {
+        PyEval_SaveThread();
+    }
+
+    // Where and how eagerly a persister's background threads run. Each
+    // thread applies them to itself as it starts, so a resumed persister
+    // gets them again. Affinity and scheduling class are Linux only.
+    struct ThreadOptions {
+        std::vector<int> cpus;        // empty: wherever the process may run
+        int policy = -1;              // SCHED_IDLE or SCHED_BATCH; -1 leaves it
+        int nice = 0;
+        bool set_nice = false;
+        std::string name = "retrace"; // prefix of each thread's name
+
+        bool operator==(const ThreadOptions&) const = default;
+
+        // False with a Python error set.
+        bool parse(PyObject* cpus_obj, PyObject* sched_obj, PyObject* nice_obj, PyObject* name_obj) {
+#ifndef __linux__
+            if (cpus_obj != Py_None || sched_obj != Py_None || nice_obj != Py_None) {
+                PyErr_SetString(PyExc_NotImplementedError,
+                                "cpus, sched and nice are only supported on Linux");
+                return false;
+            }
+#else
+            if (cpus_obj != Py_None) {
+                PyObject* iter = PyObject_GetIter(cpus_obj);
+                if (!iter) return false;
+                while (PyObject* item = PyIter_Next(iter)) {
+                    long cpu = PyLong_AsLong(item);
+                    Py_DECREF(item);
+                    if (cpu == -1 && PyErr_Occurred()) break;
+                    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                        PyErr_Format(PyExc_ValueError, "cpu %ld is out of range", cpu);
+                        break;
+                    }
+                    cpus.push_back((int)cpu);
+                }
+                Py_DECREF(iter);
+                if (PyErr_Occurred()) return false;
+                if (cpus.empty()) {
+                    PyErr_SetString(PyExc_ValueError, "cpus must not be empty");
+                    return false;
+                }
+            }
+            if (sched_obj != Py_None) {
+                const char* sched = PyUnicode_Check(sched_obj) ? PyUnicode_AsUTF8(sched_obj) : nullptr;
+                if (sched && !strcmp(sched, "idle")) policy = SCHED_IDLE;
+                else if (sched && !strcmp(sched, "batch")) policy = SCHED_BATCH;
+                else {
+                    PyErr_Clear();
+                    PyErr_SetString(PyExc_ValueError, "sched must be 'idle' or 'batch'");
+                    return false;
+                }
+            }
+            if (nice_obj != Py_None) {
+                long value = PyLong_AsLong(nice_obj);
+                if (value == -1 && PyErr_Occurred()) return false;
+                if (value < -20 || value > 19) {
+                    PyErr_SetString(PyExc_ValueError, "nice must be between -20 and 19");
+                    return false;
+                }
+                nice = (int)value;
+                set_nice = true;
+            }
+#endif
+            if (name_obj != Py_None) {
+                const char* prefix = PyUnicode_Check(name_obj) ? PyUnicode_AsUTF8(name_obj) : nullptr;
+                if (!prefix) {
+                    if (!PyErr_Occurred()) PyErr_SetString(PyExc_TypeError, "thread_name must be a str");
+                    return false;
+                }
+                name = prefix;
+            }
+            return true;
+        }
+
+        // Called by the thread itself. Failures are reported, not fatal:
+        // the thread still records, just not where it was asked to.
+        void apply(const std::string& role) const {
+#ifdef __linux__
+            // The kernel keeps 15 characters.
+            std::string full = (name + "-" + role).substr(0, 15);
+
+            if (!cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : cpus) CPU_SET(cpu, &set);
+                if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+                    fprintf(stderr, "retrace: cannot pin %s to the given cpus: %s\n", full.c_str(), strerror(err));
+            }
+            if (policy != -1) {
+                sched_param param{};
+                if (sched_setscheduler(0, policy, &param) != 0)
+                    fprintf(stderr, "retrace: cannot set the scheduling class of %s: %s\n", full.c_str(), strerror(errno));
+            }
+            // Per thread on Linux, given the thread id.
+            if (set_nice && setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0)
+                fprintf(stderr, "retrace: cannot set the nice value of %s: %s\n", full.c_str(), strerror(errno));
+            // Last, so a thread that shows its name has the rest applied.
+            pthread_setname_np(pthread_self(), full.c_str());
+#elif defined(__APPLE__)
+            pthread_setname_np((name + "-" + role).c_str());
+#endif
+        }
+    };
+
+    struct AsyncFilePersister;
+
+    // See the worker pool below.
+    static bool pool_accepts(size_t threads, const ThreadOptions& options);
+    static void pool_attach(AsyncFilePersister* persister);
+
     // ── AsyncFilePersister ───────────────────────────────────────
     //
-    // Owns the SPSC queue consumer side, a MessageStream for
-    // serialization, and a background thread that processes entries.
+    // Owns the consumer side of each ObjectWriter's SPSC queue, a
+    // MessageStream per writer for serialization, and a background
+    // thread that processes entries, taking turns across writers.
     // ObjectWriter pushes tagged QEntry values; the persister
     // thread deserializes objects and writes PID-framed output
     // via the FramedWriter received on construction.
@@ -46,20 +246,37 @@ namespace retracesoftware_stream {
     struct AsyncFilePersister : PyObject {
         PyObject* framed_writer_obj;  // strong ref to PyFramedWriter
         FramedWriter* fw;             // borrowed pointer into framed_writer_obj
+        BlobWriter* blobs;            // owned; null unless blob_path was given
         std::thread writer_thread;
         std::thread return_thread;
         std::atomic<bool> shutdown_flag;
         std::atomic<bool> return_shutdown;
+        PyInterpreterState* interp;   // whose GIL the threads take
         bool closed;
         bool thread_started;
         bool quit_on_error;
-
-        rigtorp::SPSCQueue<QEntry>* queue;
+        ThreadOptions thread_options;
+
+        // Nonzero: served by the shared worker pool of this many
+        // serializer threads rather than writer_thread/return_thread.
+        // The pool sets the flags once it has let go of the persister.
+        size_t pool_threads;
+        std::atomic<bool> writer_released;
+        std::atomic<bool> returns_released;
+
+        // Registered by setup(); slots below producer_count are never
+        // changed until close, so the threads read them without a lock.
+        Producer* producers[MAX_PRODUCERS];
+        std::atomic<size_t> producer_count;
+        uint32_t wire_writer;         // writer the stream's records are from
+        size_t next_producer;         // round-robin cursor for next_ready
+
+        // The producer being processed (see use()), and its parts.
+        Producer* current;
+        SegmentedQueue<QEntry>* queue;
         rigtorp::SPSCQueue<PyObject*>* return_queue;
         MessageStream* stream;
-        std::atomic<int64_t>* total_removed_ptr;
         PyObject* writer_key;
-        PyThreadState* last_tstate;
         std::unordered_map<PyThreadState*, PyObject*>* thread_cache;
 
         std::atomic<uint64_t> processed_cursor{0};
@@ -70,8 +287,16 @@ namespace retracesoftware_stream {
                 // Queue empty while mid-compound-value: release the GIL so the
                 // return thread can drain its queue and update total_removed,
                 // which in turn unblocks the producer's wait_for_inflight().
+                // A producer disabled mid-value never finishes it, so once
+                // close() asks for shutdown the rest is padded with None.
                 PyThreadState* _save = PyEval_SaveThread();
-                while (!(ep = queue->front())) std::this_thread::yield();
+                while (!(ep = queue->front())) {
+                    if (shutdown_flag.load(std::memory_order_acquire)) {
+                        PyEval_RestoreThread(_save);
+                        return obj_entry(Py_None);
+                    }
+                    std::this_thread::yield();
+                }
                 PyEval_RestoreThread(_save);
             }
             QEntry v = *ep;
@@ -91,7 +316,11 @@ namespace retracesoftware_stream {
         }
 
         void consume_and_write_value() {
-            QEntry e = consume_next();
+            write_value(consume_next());
+        }
+
+        // Writes one value entry, consuming whatever follows it.
+        void write_value(QEntry e) {
             switch (tag_of(e)) {
                 case TAG_OBJECT: {
                     PyObject* obj = as_ptr(e);
@@ -109,6 +338,14 @@ namespace retracesoftware_stream {
 #endif
                 case TAG_COMMAND:
                     switch (cmd_of(e)) {
+                        case CMD_HANDLE_REF:
+                            try { stream->write_handle_ref_by_index(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                            break;
+                        case CMD_PROMOTE:
+                            try { stream->write_new_handle_header(); } catch (...) { handle_write_error(quit_on_error); }
+                            consume_and_write_value();
+                            try { stream->write_handle_ref_by_index(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                            break;
                         case CMD_LIST: {
                             uint32_t n = len_of(e);
                             try { stream->write_list_header(n); } catch (...) { handle_write_error(quit_on_error); }
@@ -140,6 +377,68 @@ namespace retracesoftware_stream {
                             try { stream->write_control(SerializeError); } catch (...) { handle_write_error(quit_on_error); }
                             consume_and_write_value();
                             break;
+                        case CMD_DICT_DEFINE_SHAPE: {
+                            uint32_t n = len_of(e);
+                            try { stream->write_dict_define_shape(n); } catch (...) { handle_write_error(quit_on_error); }
+                            for (uint32_t i = 0; i < n; i++) {
+                                consume_and_write_value();
+                                consume_and_write_value();
+                            }
+                            break;
+                        }
+                        case CMD_DICT_SHAPE: {
+                            uint32_t n = len_of(e) & ((1U << DICT_SHAPE_SIZE_BITS) - 1);
+                            try { stream->write_dict_shape(len_of(e) >> DICT_SHAPE_SIZE_BITS); } catch (...) { handle_write_error(quit_on_error); }
+                            for (uint32_t i = 0; i < n; i++) consume_and_write_value();
+                            break;
+                        }
+                        case CMD_PACKED: {
+                            PyObject* obj = consume_ptr();
+                            try { stream->write_packed(packed_type(len_of(e)), obj); } catch (...) { handle_write_error(quit_on_error); }
+                            return_obj(obj);
+                            break;
+                        }
+                        case CMD_EXTENDED: {
+                            uint32_t n = len_of(e) >> EXTENDED_TYPE_BITS;
+                            try { stream->write_extended_header((ExtendedTypes)(len_of(e) & 0xFF), n); } catch (...) { handle_write_error(quit_on_error); }
+                            for (uint32_t i = 0; i < n; i++) consume_and_write_value();
+                            break;
+                        }
+                        case CMD_STRUCT: {
+                            uint32_t n = len_of(e) & ((1U << STRUCT_SIZE_BITS) - 1);
+                            try { stream->write_struct(len_of(e) >> STRUCT_SIZE_BITS); } catch (...) { handle_write_error(quit_on_error); }
+                            for (uint32_t i = 0; i < n; i++) consume_and_write_value();
+                            break;
+                        }
+                        case CMD_PATCH:
+                            try { stream->write_extended_header(ExtendedTypes::PATCH, len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                            consume_and_write_value();
+                            consume_and_write_value();
+                            break;
+                        case CMD_LEVEL_REF:
+                            try { stream->write_extended_header(ExtendedTypes::LEVEL_REF, len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                            break;
+                        case CMD_PREENCODED: {
+                            PyObject* slab = consume_ptr();
+                            try { stream->write_preencoded((const uint8_t *)PyByteArray_AS_STRING(slab), len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                            return_obj(slab);
+                            break;
+                        }
+                        case CMD_BUFFER: {
+                            PyObject* payload = consume_ptr();
+                            try { stream->write_buffer_header(payload); } catch (...) { handle_write_error(quit_on_error); }
+                            for (int i = 0; i < 3; i++) consume_and_write_value();
+                            try { stream->write_buffer_payload(payload); } catch (...) { handle_write_error(quit_on_error); }
+                            return_obj(payload);
+                            break;
+                        }
+                        case CMD_DATETIME: {
+                            PyObject* obj = consume_ptr();
+                            try { stream->write_datetime_header(obj); } catch (...) { handle_write_error(quit_on_error); }
+                            return_obj(obj);
+                            consume_and_write_value();
+                            break;
+                        }
                         default: break;
                     }
                     break;
@@ -147,224 +446,477 @@ namespace retracesoftware_stream {
             }
         }
 
-        static void writer_loop(AsyncFilePersister* self) {
-            bool quit_on_error = self->quit_on_error;
-            while (true) {
-                QEntry* ep;
-                while (!(ep = self->queue->front())) {
-                    if (self->shutdown_flag.load(std::memory_order_acquire)) return;
-                    std::this_thread::yield();
+        void use(Producer* p) {
+            current = p;
+            queue = p->queue;
+            return_queue = p->return_queue;
+            stream = p->stream;
+            writer_key = p->writer_key;
+            thread_cache = &p->thread_cache;
+        }
+
+        // The next producer after `next` with entries waiting, round robin.
+        Producer* next_ready(size_t& next) {
+            size_t n = producer_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                Producer* p = producers[(next + i) % n];
+                if (!p->retired && p->queue->front()) {
+                    next = (next + i + 1) % n;
+                    return p;
                 }
+            }
+            return nullptr;
+        }
 
-                PyGILState_STATE gstate = PyGILState_Ensure();
+        // One turn of producer p under the GIL: its entries up to
+        // PRODUCER_TURN, then a flush.
+        static void serve(AsyncFilePersister* self, Producer* p) {
+            bool quit_on_error = self->quit_on_error;
+            acquire_interpreter(self->interp);
+
+            self->use(p);
+            if (p->id != self->wire_writer) {
+                try { self->stream->write_writer_switch(p->id); } catch (...) { handle_write_error(quit_on_error); }
+                self->wire_writer = p->id;
+                // The reader follows one current thread, whichever writer
+                // named it last, so restate this writer's. Its turn may
+                // also resume between a thread stamp and what it covers.
+                auto it = p->thread_cache.find(p->last_tstate);
+                if (it != p->thread_cache.end()) {
+                    try { self->stream->write_thread_switch(it->second); }
+                    catch (...) { handle_write_error(quit_on_error); }
+                }
+            }
 
-                while ((ep = self->queue->front())) {
-                    QEntry e = *ep;
-                    self->queue->pop();
+            // A lone writer on a thread of its own keeps it until its
+            // queue is empty.
+            size_t turn = self->pool_threads || self->producer_count.load(std::memory_order_acquire) > 1
+                ? PRODUCER_TURN : SIZE_MAX;
+            QEntry* ep;
+            while (turn && (ep = self->queue->front())) {
+                turn--;
+                QEntry e = *ep;
+                self->queue->pop();
 
-                    switch (tag_of(e)) {
-                        case TAG_OBJECT: {
-                            PyObject* obj = as_ptr(e);
-                            try { self->stream->write(obj); } catch (...) { handle_write_error(quit_on_error); }
-                            self->return_obj(obj);
-                            break;
-                        }
+                switch (tag_of(e)) {
+                    case TAG_OBJECT: {
+                        PyObject* obj = as_ptr(e);
+                        try { self->stream->write(obj); } catch (...) { handle_write_error(quit_on_error); }
+                        self->return_obj(obj);
+                        break;
+                    }
 #if SIZEOF_VOID_P >= 8
-                        case TAG_PICKLED: {
-                            PyObject* obj = as_ptr(e);
-                            try { self->stream->write_pre_pickled(obj); } catch (...) { handle_write_error(quit_on_error); }
-                            self->return_obj(obj);
-                            break;
-                        }
-                        case TAG_NEW_HANDLE: {
-                            PyObject* obj = as_ptr(e);
-                            try { self->stream->write_new_handle(obj); } catch (...) { handle_write_error(quit_on_error); }
-                            self->return_obj(obj);
-                            break;
-                        }
-                        case TAG_BIND: {
-                            PyObject* obj = as_ptr(e);
-                            try { self->stream->bind(obj, false); } catch (...) { handle_write_error(quit_on_error); }
-                            self->return_obj(obj);
-                            break;
-                        }
-                        case TAG_EXT_BIND: {
-                            PyObject* obj = as_ptr(e);
-                            try { self->stream->bind(obj, true); } catch (...) { handle_write_error(quit_on_error); }
-                            self->return_obj(obj);
-                            break;
-                        }
+                    case TAG_PICKLED: {
+                        PyObject* obj = as_ptr(e);
+                        try { self->stream->write_pre_pickled(obj); } catch (...) { handle_write_error(quit_on_error); }
+                        self->return_obj(obj);
+                        break;
+                    }
+                    case TAG_NEW_HANDLE: {
+                        PyObject* obj = as_ptr(e);
+                        try { self->stream->write_new_handle(obj); } catch (...) { handle_write_error(quit_on_error); }
+                        self->return_obj(obj);
+                        break;
+                    }
+                    case TAG_BIND: {
+                        PyObject* obj = as_ptr(e);
+                        try { self->stream->bind(obj, false); } catch (...) { handle_write_error(quit_on_error); }
+                        self->return_obj(obj);
+                        break;
+                    }
+                    case TAG_EXT_BIND: {
+                        PyObject* obj = as_ptr(e);
+                        try { self->stream->bind(obj, true); } catch (...) { handle_write_error(quit_on_error); }
+                        self->return_obj(obj);
+                        break;
+                    }
 #endif
-                        case TAG_DELETE: {
-                            try { self->stream->object_freed(as_ptr(e)); } catch (...) { handle_write_error(quit_on_error); }
-                            break;
-                        }
-                        case TAG_THREAD: {
-                            PyThreadState* tstate = as_tstate(e);
-                            if (tstate != self->last_tstate) {
-                                self->last_tstate = tstate;
-                                auto& cache = *self->thread_cache;
-                                auto it = cache.find(tstate);
-                                PyObject* handle;
-                                if (it != cache.end()) {
-                                    handle = it->second;
-                                } else {
-                                    handle = tstate->dict
-                                        ? PyDict_GetItem(tstate->dict, self->writer_key)
-                                        : nullptr;
-                                    if (handle) {
-                                        Py_INCREF(handle);
-                                        cache[tstate] = handle;
-                                    }
-                                }
+                    case TAG_DELETE: {
+                        try { self->stream->object_freed(as_ptr(e)); } catch (...) { handle_write_error(quit_on_error); }
+                        break;
+                    }
+                    case TAG_THREAD: {
+                        PyThreadState* tstate = as_tstate(e);
+                        if (tstate != self->current->last_tstate) {
+                            self->current->last_tstate = tstate;
+                            auto& cache = *self->thread_cache;
+                            auto it = cache.find(tstate);
+                            PyObject* handle;
+                            if (it != cache.end()) {
+                                handle = it->second;
+                            } else {
+                                handle = tstate->dict
+                                    ? PyDict_GetItem(tstate->dict, self->writer_key)
+                                    : nullptr;
                                 if (handle) {
-                                    try { self->stream->write_thread_switch(handle); }
-                                    catch (...) { handle_write_error(quit_on_error); }
+                                    Py_INCREF(handle);
+                                    cache[tstate] = handle;
                                 }
                             }
-                            break;
+                            if (handle) {
+                                try { self->stream->write_thread_switch(handle); }
+                                catch (...) { handle_write_error(quit_on_error); }
+                            }
                         }
-                        case TAG_COMMAND: {
-                            switch (cmd_of(e)) {
-                                case CMD_HANDLE_REF:
-                                    try { self->stream->write_handle_ref_by_index(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
-                                    break;
-                                case CMD_HANDLE_DELETE:
-                                    try { self->stream->write_handle_delete(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
-                                    break;
-                                case CMD_FLUSH:
-                                    try { self->stream->flush(); } catch (...) { handle_write_error(quit_on_error); }
-                                    break;
-                                case CMD_LIST: {
-                                    uint32_t n = len_of(e);
-                                    try { self->stream->write_list_header(n); } catch (...) { handle_write_error(quit_on_error); }
-                                    for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
-                                    break;
-                                }
-                                case CMD_TUPLE: {
-                                    uint32_t n = len_of(e);
-                                    try { self->stream->write_tuple_header(n); } catch (...) { handle_write_error(quit_on_error); }
-                                    for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
-                                    break;
-                                }
-                                case CMD_DICT: {
-                                    uint32_t n = len_of(e);
-                                    try { self->stream->write_dict_header(n); } catch (...) { handle_write_error(quit_on_error); }
-                                    for (uint32_t i = 0; i < n; i++) {
-                                        self->consume_and_write_value();
-                                        self->consume_and_write_value();
-                                    }
-                                    break;
-                                }
-                                case CMD_HEARTBEAT:
-                                    try { self->stream->write_control(Heartbeat); } catch (...) { handle_write_error(quit_on_error); }
+                        break;
+                    }
+                    case TAG_COMMAND: {
+                        switch (cmd_of(e)) {
+                            case CMD_HANDLE_REF:
+                                try { self->stream->write_handle_ref_by_index(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                break;
+                            case CMD_HANDLE_DELETE:
+                                try { self->stream->write_handle_delete(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                break;
+                            case CMD_FLUSH:
+                                try { self->stream->flush(); } catch (...) { handle_write_error(quit_on_error); }
+                                break;
+                            case CMD_LIST: {
+                                uint32_t n = len_of(e);
+                                try { self->stream->write_list_header(n); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
+                                break;
+                            }
+                            case CMD_TUPLE: {
+                                uint32_t n = len_of(e);
+                                try { self->stream->write_tuple_header(n); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
+                                break;
+                            }
+                            case CMD_DICT: {
+                                uint32_t n = len_of(e);
+                                try { self->stream->write_dict_header(n); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) {
                                     self->consume_and_write_value();
-                                    break;
-                                case CMD_SERIALIZE_ERROR:
-                                    try { self->stream->write_control(SerializeError); } catch (...) { handle_write_error(quit_on_error); }
                                     self->consume_and_write_value();
-                                    break;
-                                case CMD_PICKLED: {
-                                    PyObject* obj = self->consume_ptr();
-                                    try { self->stream->write_pre_pickled(obj); } catch (...) { handle_write_error(quit_on_error); }
-                                    self->return_obj(obj);
-                                    break;
                                 }
-                                case CMD_NEW_HANDLE: {
-                                    PyObject* obj = self->consume_ptr();
-                                    try { self->stream->write_new_handle(obj); } catch (...) { handle_write_error(quit_on_error); }
-                                    self->return_obj(obj);
-                                    break;
+                                break;
+                            }
+                            case CMD_PROMOTE:
+                                try { self->stream->write_new_handle_header(); } catch (...) { handle_write_error(quit_on_error); }
+                                self->consume_and_write_value();
+                                try { self->stream->write_handle_ref_by_index(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                break;
+                            case CMD_CALL: {
+                                uint32_t nargs = len_of(e);
+                                int handle = len_of(self->consume_next());
+                                PyObject* args[MAX_CALL_ARGS];
+                                uint32_t leaves = 0;
+                                QEntry arg = 0;
+                                while (leaves < nargs && tag_of(arg = self->consume_next()) == TAG_OBJECT)
+                                    args[leaves++] = as_ptr(arg);
+                                if (leaves == nargs) {
+                                    try { self->stream->write_call(handle, args, nargs); } catch (...) { handle_write_error(quit_on_error); }
+                                } else {
+                                    // An argument that isn't one object: write the
+                                    // call as a handle ref followed by plain values.
+                                    try {
+                                        self->stream->write_handle_ref_by_index(handle);
+                                        for (uint32_t i = 0; i < leaves; i++) self->stream->write(args[i]);
+                                    } catch (...) { handle_write_error(quit_on_error); }
+                                    self->write_value(arg);
+                                    for (uint32_t i = leaves + 1; i < nargs; i++) self->consume_and_write_value();
                                 }
-                                case CMD_BIND: {
-                                    PyObject* obj = self->consume_ptr();
-                                    try { self->stream->bind(obj, false); } catch (...) { handle_write_error(quit_on_error); }
-                                    self->return_obj(obj);
-                                    break;
+                                for (uint32_t i = 0; i < leaves; i++) self->return_obj(args[i]);
+                                break;
+                            }
+                            case CMD_DICT_DEFINE_SHAPE: {
+                                uint32_t n = len_of(e);
+                                try { self->stream->write_dict_define_shape(n); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) {
+                                    self->consume_and_write_value();
+                                    self->consume_and_write_value();
                                 }
-                                case CMD_EXT_BIND: {
-                                    PyObject* obj = self->consume_ptr();
-                                    try { self->stream->bind(obj, true); } catch (...) { handle_write_error(quit_on_error); }
-                                    self->return_obj(obj);
-                                    break;
+                                break;
+                            }
+                            case CMD_DICT_SHAPE: {
+                                uint32_t n = len_of(e) & ((1U << DICT_SHAPE_SIZE_BITS) - 1);
+                                try { self->stream->write_dict_shape(len_of(e) >> DICT_SHAPE_SIZE_BITS); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
+                                break;
+                            }
+                            case CMD_EXTENDED: {
+                                uint32_t n = len_of(e) >> EXTENDED_TYPE_BITS;
+                                try { self->stream->write_extended_header((ExtendedTypes)(len_of(e) & 0xFF), n); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
+                                break;
+                            }
+                            case CMD_STRUCT: {
+                                uint32_t n = len_of(e) & ((1U << STRUCT_SIZE_BITS) - 1);
+                                try { self->stream->write_struct(len_of(e) >> STRUCT_SIZE_BITS); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) self->consume_and_write_value();
+                                break;
+                            }
+                            case CMD_PATCH:
+                                try { self->stream->write_extended_header(ExtendedTypes::PATCH, len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                self->consume_and_write_value();
+                                self->consume_and_write_value();
+                                break;
+                            case CMD_LEVELS:
+                                try { self->stream->write_extended_header(ExtendedTypes::LEVELS, len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i <= len_of(e); i++) self->consume_and_write_value();
+                                break;
+                            case CMD_PREENCODED: {
+                                PyObject* slab = self->consume_ptr();
+                                try { self->stream->write_preencoded((const uint8_t *)PyByteArray_AS_STRING(slab), len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(slab);
+                                break;
+                            }
+                            case CMD_BUFFER: {
+                                PyObject* payload = self->consume_ptr();
+                                try { self->stream->write_buffer_header(payload); } catch (...) { handle_write_error(quit_on_error); }
+                                for (int i = 0; i < 3; i++) self->consume_and_write_value();
+                                try { self->stream->write_buffer_payload(payload); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(payload);
+                                break;
+                            }
+                            case CMD_DATETIME: {
+                                PyObject* obj = self->consume_ptr();
+                                try { self->stream->write_datetime_header(obj); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(obj);
+                                self->consume_and_write_value();
+                                break;
+                            }
+                            case CMD_CAPABILITIES: {
+                                PyObject* dictionary = (len_of(e) & CAP_DICTIONARY) ? self->consume_ptr() : nullptr;
+                                try { self->stream->write_capabilities(len_of(e), dictionary); } catch (...) { handle_write_error(quit_on_error); }
+                                if (dictionary) self->return_obj(dictionary);
+                                break;
+                            }
+                            case CMD_TIMESTAMP:
+                                try { self->stream->write_timestamp(len_of(e)); } catch (...) { handle_write_error(quit_on_error); }
+                                break;
+                            case CMD_ADD_FILENAME:
+                                try { self->stream->write_add_filename_header(); } catch (...) { handle_write_error(quit_on_error); }
+                                self->consume_and_write_value();
+                                break;
+                            case CMD_STACK: {
+                                uint32_t n = len_of(e) & ((1U << STACK_COUNT_BITS) - 1);
+                                try { self->stream->write_stack_header(len_of(e) >> STACK_COUNT_BITS, n); } catch (...) { handle_write_error(quit_on_error); }
+                                for (uint32_t i = 0; i < n; i++) {
+                                    uint32_t frame = len_of(self->consume_next());
+                                    try { self->stream->write_stack_frame(frame); } catch (...) { handle_write_error(quit_on_error); }
                                 }
-                                case CMD_SHUTDOWN:
-                                    try { self->stream->flush(); } catch (...) { handle_write_error(quit_on_error); }
-                                    self->processed_cursor.fetch_add(1, std::memory_order_release);
-                                    PyGILState_Release(gstate);
-                                    return;
+                                break;
                             }
-                            break;
+                            case CMD_HEARTBEAT:
+                                try { self->stream->write_control(Heartbeat); } catch (...) { handle_write_error(quit_on_error); }
+                                self->consume_and_write_value();
+                                break;
+                            case CMD_SERIALIZE_ERROR:
+                                try { self->stream->write_control(SerializeError); } catch (...) { handle_write_error(quit_on_error); }
+                                self->consume_and_write_value();
+                                break;
+                            case CMD_PICKLED: {
+                                PyObject* obj = self->consume_ptr();
+                                try { self->stream->write_pre_pickled(obj); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(obj);
+                                break;
+                            }
+                            case CMD_PACKED: {
+                                PyObject* obj = self->consume_ptr();
+                                try { self->stream->write_packed(packed_type(len_of(e)), obj); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(obj);
+                                break;
+                            }
+                            case CMD_NEW_HANDLE: {
+                                PyObject* obj = self->consume_ptr();
+                                try { self->stream->write_new_handle(obj); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(obj);
+                                break;
+                            }
+                            case CMD_BIND: {
+                                PyObject* obj = self->consume_ptr();
+                                try { self->stream->bind(obj, false); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(obj);
+                                break;
+                            }
+                            case CMD_EXT_BIND: {
+                                PyObject* obj = self->consume_ptr();
+                                try { self->stream->bind(obj, true); } catch (...) { handle_write_error(quit_on_error); }
+                                self->return_obj(obj);
+                                break;
+                            }
+                            case CMD_SHUTDOWN:
+                                // Only this writer is done; the others,
+                                // and any that register later, go on.
+                                try { self->stream->flush(); } catch (...) { handle_write_error(quit_on_error); }
+                                p->retired = true;
+                                turn = 0;
+                                break;
                         }
+                        break;
                     }
-
-                    self->processed_cursor.fetch_add(1, std::memory_order_release);
                 }
 
-                try { self->stream->flush(); } catch (...) { handle_write_error(quit_on_error); }
-
-                PyGILState_Release(gstate);
+                self->processed_cursor.fetch_add(1, std::memory_order_release);
             }
+
+            try { self->stream->flush(); } catch (...) { handle_write_error(quit_on_error); }
+
+            release_interpreter();
         }
 
-        static void drain_loop(AsyncFilePersister* self) {
+        static void writer_loop(AsyncFilePersister* self) {
+            self->thread_options.apply("writer");
             while (true) {
-                PyObject** ep;
-                while (!(ep = self->return_queue->front())) {
-                    if (self->return_shutdown.load(std::memory_order_acquire))
-                        return;
+                Producer* p;
+                while (!(p = self->next_ready(self->next_producer))) {
+                    if (self->shutdown_flag.load(std::memory_order_acquire)) return;
                     std::this_thread::yield();
                 }
+                serve(self, p);
+            }
+        }
+
+        bool returns_pending() {
+            size_t n = producer_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                if (producers[i]->return_queue->front()) return true;
+            }
+            return false;
+        }
 
-                PyGILState_STATE gstate = PyGILState_Ensure();
-                auto batch_start = std::chrono::steady_clock::now();
-                int deallocs = 0;
+        // Hands back every object waiting in the return queues, under
+        // the GIL, yielding it every 100 µs while deallocations pile up.
+        static void drain_returns(AsyncFilePersister* self) {
+            acquire_interpreter(self->interp);
+            auto batch_start = std::chrono::steady_clock::now();
+            int deallocs = 0;
 
-                while ((ep = self->return_queue->front())) {
+            size_t n = self->producer_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                Producer* p = self->producers[i];
+                PyObject** ep;
+                while ((ep = p->return_queue->front())) {
                     PyObject* obj = *ep;
-                    self->return_queue->pop();
-                    if (self->total_removed_ptr)
-                        self->total_removed_ptr->fetch_add(estimate_size(obj), std::memory_order_relaxed);
+                    p->return_queue->pop();
+                    p->total_removed.fetch_add(estimate_size(obj), std::memory_order_relaxed);
                     if (Py_REFCNT(obj) == 1) deallocs++;
                     Py_DECREF(obj);
                     if (deallocs >= 32) {
                         deallocs = 0;
                         auto now = std::chrono::steady_clock::now();
                         if (now - batch_start > std::chrono::microseconds(100)) {
-                            PyGILState_Release(gstate);
+                            release_interpreter();
                             std::this_thread::yield();
-                            gstate = PyGILState_Ensure();
+                            acquire_interpreter(self->interp);
                             batch_start = std::chrono::steady_clock::now();
                         }
                     }
                 }
-
-                PyGILState_Release(gstate);
             }
+
+            release_interpreter();
         }
 
-        SetupResult setup(PyObject* serializer, size_t queue_capacity,
-                         size_t return_queue_capacity, std::atomic<int64_t>* total_removed,
-                         PyObject* wkey, bool quit_on_error_arg) {
-            if (queue) return {queue, return_queue};
-            quit_on_error = quit_on_error_arg;
+        static void drain_loop(AsyncFilePersister* self) {
+            self->thread_options.apply("drain");
+            while (true) {
+                while (!self->returns_pending()) {
+                    if (self->return_shutdown.load(std::memory_order_acquire))
+                        return;
+                    std::this_thread::yield();
+                }
+                drain_returns(self);
+            }
+        }
 
-            queue = new rigtorp::SPSCQueue<QEntry>(queue_capacity);
-            return_queue = new rigtorp::SPSCQueue<PyObject*>(return_queue_capacity);
-            total_removed_ptr = total_removed;
-            writer_key = wkey;
-            last_tstate = nullptr;
-            thread_cache = new std::unordered_map<PyThreadState*, PyObject*>();
+        // Registers one more writer. Called with the GIL held, which
+        // serializes registrations against each other and against close.
+        SetupResult setup(PyObject* serializer, size_t queue_capacity, size_t queue_limit,
+                         size_t return_queue_capacity, PyObject* wkey, bool quit_on_error_arg) {
+            if (closed) {
+                PyErr_SetString(PyExc_ValueError, "AsyncFilePersister is closed");
+                return {nullptr, nullptr, nullptr};
+            }
+            size_t n = producer_count.load(std::memory_order_relaxed);
+            if (n == MAX_PRODUCERS) {
+                PyErr_Format(PyExc_RuntimeError, "AsyncFilePersister supports at most %zu writers",
+                             MAX_PRODUCERS);
+                return {nullptr, nullptr, nullptr};
+            }
 
-            stream = new MessageStream(*fw, serializer, quit_on_error);
+            Producer* p = new Producer();
+            p->id = (uint32_t)n;
+            // Called on the writer's own thread, and the queue zero-fills
+            // its chunks as it allocates them (later ones in try_push, also
+            // on that thread), so first-touch puts the pages on the NUMA
+            // node the producer runs on, not the one serving it.
+            p->queue = new SegmentedQueue<QEntry>(queue_capacity, queue_limit);
+            p->return_queue = new rigtorp::SPSCQueue<PyObject*>(return_queue_capacity);
+            p->writer_key = wkey;
+            p->stream = new MessageStream(*fw, serializer, quit_on_error_arg);
+            p->stream->set_blob_store(blobs);
+
+            producers[n] = p;
+            producer_count.store(n + 1, std::memory_order_release);
+
+            // The threads start with the first writer and serve the rest.
+            if (n == 0) {
+                quit_on_error = quit_on_error_arg;
+                start_threads();
+            }
+            return {p->queue, p->return_queue, &p->total_removed};
+        }
 
+        void start_threads() {
             shutdown_flag.store(false, std::memory_order_release);
             return_shutdown.store(false, std::memory_order_release);
-            writer_thread = std::thread(writer_loop, this);
-            return_thread = std::thread(drain_loop, this);
+            if (pool_threads) {
+                pool_attach(this);
+            } else {
+                writer_thread = std::thread(writer_loop, this);
+                return_thread = std::thread(drain_loop, this);
+            }
             thread_started = true;
+        }
+
+        // Lets the threads finish what is queued, then stops them (or
+        // waits for the pool to let go). Called with the GIL held.
+        void stop_threads() {
+            shutdown_flag.store(true, std::memory_order_release);
 
-            return {queue, return_queue};
+            if (pool_threads) {
+                if (thread_started) {
+                    Py_BEGIN_ALLOW_THREADS
+                    while (!writer_released.load(std::memory_order_acquire)) std::this_thread::yield();
+                    return_shutdown.store(true, std::memory_order_release);
+                    while (!returns_released.load(std::memory_order_acquire)) std::this_thread::yield();
+                    Py_END_ALLOW_THREADS
+                }
+                thread_started = false;
+                return;
+            }
+
+            if (writer_thread.joinable()) {
+                Py_BEGIN_ALLOW_THREADS
+                writer_thread.join();
+                Py_END_ALLOW_THREADS
+            }
+
+            return_shutdown.store(true, std::memory_order_release);
+
+            if (return_thread.joinable()) {
+                Py_BEGIN_ALLOW_THREADS
+                return_thread.join();
+                Py_END_ALLOW_THREADS
+            }
+
+            thread_started = false;
+        }
+
+        // For the pool: shutting down with nothing left, so its
+        // serializer thread may let go of it.
+        bool writer_finished() {
+            if (!shutdown_flag.load(std::memory_order_acquire)) return false;
+            size_t cursor = next_producer;
+            return !next_ready(cursor);
+        }
+
+        // The same for the drain thread.
+        bool returns_finished() {
+            return return_shutdown.load(std::memory_order_acquire) && !returns_pending();
         }
 
         void drain_value() {
@@ -393,11 +945,47 @@ namespace retracesoftware_stream {
                         case CMD_DICT:
                             for (uint32_t i = 0, n = len_of(e) * 2; i < n; i++) drain_value();
                             break;
+                        case CMD_CALL:
+                            for (uint32_t i = 0, n = len_of(e) + 1; i < n; i++) drain_value();
+                            break;
+                        case CMD_DICT_DEFINE_SHAPE:
+                            for (uint32_t i = 0, n = len_of(e) * 2; i < n; i++) drain_value();
+                            break;
+                        case CMD_DICT_SHAPE:
+                            for (uint32_t i = 0, n = len_of(e) & ((1U << DICT_SHAPE_SIZE_BITS) - 1); i < n; i++) drain_value();
+                            break;
+                        case CMD_STRUCT:
+                            for (uint32_t i = 0, n = len_of(e) & ((1U << STRUCT_SIZE_BITS) - 1); i < n; i++) drain_value();
+                            break;
+                        case CMD_EXTENDED:
+                            for (uint32_t i = 0, n = len_of(e) >> EXTENDED_TYPE_BITS; i < n; i++) drain_value();
+                            break;
+                        case CMD_BUFFER:
+                            for (int i = 0; i < 4; i++) drain_value();
+                            break;
+                        case CMD_DATETIME:
+                        case CMD_PATCH:
+                            drain_value();
+                            drain_value();
+                            break;
+                        case CMD_CAPABILITIES:
+                            if (len_of(e) & CAP_DICTIONARY) drain_value();
+                            break;
+                        case CMD_LEVELS:
+                            for (uint32_t i = 0; i <= len_of(e); i++) drain_value();
+                            break;
+                        case CMD_STACK:
+                            for (uint32_t i = 0, n = len_of(e) & ((1U << STACK_COUNT_BITS) - 1); i < n; i++) drain_value();
+                            break;
                         case CMD_HEARTBEAT:
                         case CMD_SERIALIZE_ERROR:
+                        case CMD_PROMOTE:
+                        case CMD_ADD_FILENAME:
+                        case CMD_PREENCODED:
                             drain_value();
                             break;
                         case CMD_PICKLED:
+                        case CMD_PACKED:
                         case CMD_NEW_HANDLE:
                         case CMD_BIND:
                         case CMD_EXT_BIND:
@@ -440,11 +1028,47 @@ namespace retracesoftware_stream {
                             case CMD_DICT:
                                 for (uint32_t i = 0, n = len_of(e) * 2; i < n; i++) drain_value();
                                 break;
+                            case CMD_CALL:
+                                for (uint32_t i = 0, n = len_of(e) + 1; i < n; i++) drain_value();
+                                break;
+                            case CMD_DICT_DEFINE_SHAPE:
+                                for (uint32_t i = 0, n = len_of(e) * 2; i < n; i++) drain_value();
+                                break;
+                            case CMD_DICT_SHAPE:
+                                for (uint32_t i = 0, n = len_of(e) & ((1U << DICT_SHAPE_SIZE_BITS) - 1); i < n; i++) drain_value();
+                                break;
+                            case CMD_STRUCT:
+                                for (uint32_t i = 0, n = len_of(e) & ((1U << STRUCT_SIZE_BITS) - 1); i < n; i++) drain_value();
+                                break;
+                            case CMD_EXTENDED:
+                                for (uint32_t i = 0, n = len_of(e) >> EXTENDED_TYPE_BITS; i < n; i++) drain_value();
+                                break;
+                            case CMD_BUFFER:
+                                for (int i = 0; i < 4; i++) drain_value();
+                                break;
+                            case CMD_DATETIME:
+                            case CMD_PATCH:
+                                drain_value();
+                                drain_value();
+                                break;
+                            case CMD_CAPABILITIES:
+                                if (len_of(e) & CAP_DICTIONARY) drain_value();
+                                break;
+                            case CMD_LEVELS:
+                                for (uint32_t i = 0; i <= len_of(e); i++) drain_value();
+                                break;
+                            case CMD_STACK:
+                                for (uint32_t i = 0, n = len_of(e) & ((1U << STACK_COUNT_BITS) - 1); i < n; i++) drain_value();
+                                break;
                             case CMD_HEARTBEAT:
                             case CMD_SERIALIZE_ERROR:
+                            case CMD_PROMOTE:
+                            case CMD_ADD_FILENAME:
+                            case CMD_PREENCODED:
                                 drain_value();
                                 break;
                             case CMD_PICKLED:
+                            case CMD_PACKED:
                             case CMD_NEW_HANDLE:
                             case CMD_BIND:
                             case CMD_EXT_BIND:
@@ -458,68 +1082,59 @@ namespace retracesoftware_stream {
             }
         }
 
-        void drain_return_queue() {
-            if (!return_queue) return;
-            while (auto* ep = return_queue->front()) {
-                PyObject* obj = *ep;
-                return_queue->pop();
-                if (total_removed_ptr)
-                    total_removed_ptr->fetch_add(estimate_size(obj), std::memory_order_relaxed);
-                Py_DECREF(obj);
+        void drain_return_queues() {
+            size_t n = producer_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                Producer* p = producers[i];
+                while (auto* ep = p->return_queue->front()) {
+                    PyObject* obj = *ep;
+                    p->return_queue->pop();
+                    p->total_removed.fetch_add(estimate_size(obj), std::memory_order_relaxed);
+                    Py_DECREF(obj);
+                }
             }
         }
 
-        void clear_thread_cache() {
-            if (!thread_cache) return;
-            for (auto& kv : *thread_cache)
-                Py_DECREF(kv.second);
-            thread_cache->clear();
+        void reset_thread_caches() {
+            size_t n = producer_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                Producer* p = producers[i];
+                for (auto& kv : p->thread_cache)
+                    Py_DECREF(kv.second);
+                p->thread_cache.clear();
+                p->last_tstate = nullptr;
+            }
         }
 
         void do_close() {
             if (closed) return;
             closed = true;
 
-            shutdown_flag.store(true, std::memory_order_release);
-
-            if (writer_thread.joinable()) {
-                Py_BEGIN_ALLOW_THREADS
-                writer_thread.join();
-                Py_END_ALLOW_THREADS
-            }
-
-            return_shutdown.store(true, std::memory_order_release);
-
-            if (return_thread.joinable()) {
-                Py_BEGIN_ALLOW_THREADS
-                return_thread.join();
-                Py_END_ALLOW_THREADS
-            }
-
-            thread_started = false;
-
-            drain_return_queue();
-            drain_queue_entries();
-
-            if (stream) {
-                delete stream;
-                stream = nullptr;
-            }
-
-            clear_thread_cache();
-            if (thread_cache) {
-                delete thread_cache;
-                thread_cache = nullptr;
-            }
-
-            if (queue) {
-                delete queue;
-                queue = nullptr;
-            }
-            if (return_queue) {
-                delete return_queue;
-                return_queue = nullptr;
+            stop_threads();
+
+            drain_return_queues();
+            reset_thread_caches();
+
+            // The Producers themselves stay until dealloc: their writers
+            // may still read total_removed.
+            size_t n = producer_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                Producer* p = producers[i];
+                use(p);
+                drain_queue_entries();
+                delete p->stream;
+                delete p->queue;
+                delete p->return_queue;
+                p->stream = nullptr;
+                p->queue = nullptr;
+                p->return_queue = nullptr;
             }
+            current = nullptr;
+            queue = nullptr;
+            return_queue = nullptr;
+            stream = nullptr;
+            writer_key = nullptr;
+            thread_cache = nullptr;
         }
 
         static PyObject* py_close(AsyncFilePersister* self, PyObject* unused) {
@@ -530,39 +1145,18 @@ namespace retracesoftware_stream {
         void do_drain() {
             if (closed || !thread_started) return;
 
-            shutdown_flag.store(true, std::memory_order_release);
-
-            if (writer_thread.joinable()) {
-                Py_BEGIN_ALLOW_THREADS
-                writer_thread.join();
-                Py_END_ALLOW_THREADS
-            }
-
-            return_shutdown.store(true, std::memory_order_release);
-
-            if (return_thread.joinable()) {
-                Py_BEGIN_ALLOW_THREADS
-                return_thread.join();
-                Py_END_ALLOW_THREADS
-            }
-
-            drain_return_queue();
-            thread_started = false;
+            stop_threads();
+            drain_return_queues();
 
             shutdown_flag.store(false, std::memory_order_release);
             return_shutdown.store(false, std::memory_order_release);
         }
 
         void do_resume() {
-            if (closed || !fw || !queue) return;
+            if (closed || !fw || !producer_count.load(std::memory_order_acquire)) return;
             fw->stamp_pid();
-            last_tstate = nullptr;
-            clear_thread_cache();
-            shutdown_flag.store(false, std::memory_order_release);
-            return_shutdown.store(false, std::memory_order_release);
-            writer_thread = std::thread(writer_loop, this);
-            return_thread = std::thread(drain_loop, this);
-            thread_started = true;
+            reset_thread_caches();
+            start_threads();
         }
 
         static PyObject* py_drain(AsyncFilePersister* self, PyObject* unused) {
@@ -580,43 +1174,88 @@ namespace retracesoftware_stream {
             if (self) {
                 self->framed_writer_obj = nullptr;
                 self->fw = nullptr;
+                self->blobs = nullptr;
+                self->interp = PyInterpreterState_Get();
                 self->shutdown_flag.store(false);
                 self->return_shutdown.store(false);
                 self->closed = true;
                 self->thread_started = false;
                 self->quit_on_error = false;
+                self->pool_threads = 0;
+                self->writer_released.store(false);
+                self->returns_released.store(false);
+                self->producer_count.store(0);
+                self->wire_writer = 0;
+                self->next_producer = 0;
+                self->current = nullptr;
                 self->queue = nullptr;
                 self->return_queue = nullptr;
                 self->stream = nullptr;
-                self->total_removed_ptr = nullptr;
                 self->writer_key = nullptr;
-                self->last_tstate = nullptr;
                 self->thread_cache = nullptr;
                 self->processed_cursor.store(0);
                 new (&self->writer_thread) std::thread();
                 new (&self->return_thread) std::thread();
+                new (&self->thread_options) ThreadOptions();
             }
             return (PyObject*)self;
         }
 
         static int init(AsyncFilePersister* self, PyObject* args, PyObject* kwds) {
             PyObject* writer_obj;
+            PyObject* blob_path = Py_None;
+            Py_ssize_t blob_threshold = 4096;
+            Py_ssize_t pool_threads = 0;
+            PyObject* cpus = Py_None;
+            PyObject* sched = Py_None;
+            PyObject* nice = Py_None;
+            PyObject* thread_name = Py_None;
+
+            static const char* kwlist[] = {"writer", "blob_path", "blob_threshold", "pool_threads",
+                                           "cpus", "sched", "nice", "thread_name", nullptr};
+            if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OnnOOOO", (char**)kwlist,
+                                             &writer_obj, &blob_path, &blob_threshold, &pool_threads,
+                                             &cpus, &sched, &nice, &thread_name))
+                return -1;
+
+            ThreadOptions options;
+            if (!options.parse(cpus, sched, nice, thread_name)) return -1;
 
-            static const char* kwlist[] = {"writer", nullptr};
-            if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", (char**)kwlist, &writer_obj))
+            if (pool_threads < 0 || pool_threads > MAX_POOL_THREADS) {
+                PyErr_Format(PyExc_ValueError, "pool_threads must be between 0 and %d", MAX_POOL_THREADS);
                 return -1;
+            }
+            if (!pool_accepts((size_t)pool_threads, options)) return -1;
 
             FramedWriter* fw_ptr = FramedWriter_get(writer_obj);
             if (!fw_ptr) return -1;
 
+            if (blob_path != Py_None) {
+                PyObject* encoded = nullptr;
+                if (!PyUnicode_FSConverter(blob_path, &encoded)) return -1;
+                BlobWriter* blobs = new BlobWriter(PyBytes_AS_STRING(encoded), (size_t)blob_threshold);
+                if (!blobs->ok()) {
+                    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, blob_path);
+                    delete blobs;
+                    Py_DECREF(encoded);
+                    return -1;
+                }
+                Py_DECREF(encoded);
+                delete self->blobs;
+                self->blobs = blobs;
+            }
+
             self->framed_writer_obj = Py_NewRef(writer_obj);
             self->fw = fw_ptr;
+            self->pool_threads = (size_t)pool_threads;
+            self->thread_options = std::move(options);
             self->closed = false;
 
             return 0;
         }
 
         static int traverse(AsyncFilePersister* self, visitproc visit, void* arg) {
+            Py_VISIT(Py_TYPE(self));
             Py_VISIT(self->framed_writer_obj);
             return 0;
         }
@@ -634,11 +1273,213 @@ namespace retracesoftware_stream {
 
             self->writer_thread.~thread();
             self->return_thread.~thread();
+            self->thread_options.~ThreadOptions();
 
-            Py_TYPE(self)->tp_free((PyObject*)self);
+            for (size_t i = 0; i < self->producer_count.load(); i++) delete self->producers[i];
+            self->producer_count.store(0);
+
+            delete self->blobs;
+            self->blobs = nullptr;
+
+            PyTypeObject* tp = Py_TYPE(self);
+            tp->tp_free((PyObject*)self);
+            Py_DECREF(tp);
         }
     };
 
+    // ── Shared worker pool ───────────────────────────────────────
+    //
+    // AsyncFilePersister(pool_threads=K) hands its work to a process-wide
+    // pool instead of starting two threads of its own: K serializer
+    // threads and one drain thread, however many persisters are open. A
+    // persister stays with the serializer thread it was given (the one
+    // with the fewest), so its records keep their order. The first pooled
+    // persister sets K. A pool thread with nothing registered sleeps on
+    // its condition variable; one whose persisters are idle yields for a
+    // while and then backs off to short sleeps.
+
+    struct PoolThread {
+        std::mutex lock;
+        std::condition_variable wake;
+        std::vector<AsyncFilePersister*> persisters;    // guarded by lock
+    };
+
+    struct WorkerPool {
+        size_t size;
+        ThreadOptions options;        // also fixed by the first pooled persister
+        long pid;                     // a forked child starts a pool of its own
+        std::unique_ptr<PoolThread[]> serializers;
+        PoolThread drainer;
+    };
+
+    // Shared by every interpreter, which may each have a GIL of their own.
+    // Never freed: its threads are detached and live as long as the process.
+    static std::mutex worker_pool_lock;
+    static WorkerPool* worker_pool = nullptr;      // guarded by worker_pool_lock
+
+    static long current_pid() {
+#ifndef _WIN32
+        return (long)getpid();
+#else
+        return 0;
+#endif
+    }
+
+    static WorkerPool* live_pool() {
+        return worker_pool && worker_pool->pid == current_pid() ? worker_pool : nullptr;
+    }
+
+    static void pool_idle(unsigned& idle) {
+        if (++idle < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    // Lets go of the persisters that are finished. This thread's state
+    // for an interpreter it no longer serves is dropped before the
+    // released flag is set, so once close() returns nothing of the pool
+    // keeps that interpreter from ending.
+    template <typename Finished>
+    static void pool_release(PoolThread* t, Finished finished,
+                             std::atomic<bool> AsyncFilePersister::* released) {
+        std::vector<AsyncFilePersister*> done;
+        std::vector<PyInterpreterState*> gone;
+        {
+            std::lock_guard<std::mutex> guard(t->lock);
+            auto& list = t->persisters;
+            for (auto it = list.begin(); it != list.end();) {
+                if (finished(*it)) {
+                    done.push_back(*it);
+                    it = list.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (AsyncFilePersister* s : done) {
+                auto same = [s](AsyncFilePersister* other) { return other->interp == s->interp; };
+                if (std::none_of(list.begin(), list.end(), same) &&
+                    std::find(gone.begin(), gone.end(), s->interp) == gone.end()) {
+                    gone.push_back(s->interp);
+                }
+            }
+        }
+        // Not under t->lock: dropping a thread state takes the GIL.
+        for (PyInterpreterState* interp : gone) thread_states.drop(interp);
+        for (AsyncFilePersister* s : done) (s->*released).store(true, std::memory_order_release);
+    }
+
+    static void pool_serializer_loop(PoolThread* t, const ThreadOptions* options, std::string role) {
+        options->apply(role);
+        size_t cursor = 0;
+        unsigned idle = 0;
+        while (true) {
+            pool_release(t, [](AsyncFilePersister* s) { return s->writer_finished(); },
+                         &AsyncFilePersister::writer_released);
+
+            AsyncFilePersister* persister = nullptr;
+            Producer* p = nullptr;
+            {
+                std::unique_lock<std::mutex> guard(t->lock);
+                auto& list = t->persisters;
+                t->wake.wait(guard, [&list] { return !list.empty(); });
+                for (size_t i = 0; i < list.size() && !p; i++) {
+                    persister = list[(cursor + i) % list.size()];
+                    p = persister->next_ready(persister->next_producer);
+                }
+                cursor++;
+            }
+            // Only this thread releases the persister, so it is still
+            // open once the lock is dropped.
+            if (p) {
+                idle = 0;
+                AsyncFilePersister::serve(persister, p);
+            } else {
+                pool_idle(idle);
+            }
+        }
+    }
+
+    static void pool_drain_loop(PoolThread* t, const ThreadOptions* options) {
+        options->apply("pdrain");
+        unsigned idle = 0;
+        while (true) {
+            pool_release(t, [](AsyncFilePersister* s) { return s->returns_finished(); },
+                         &AsyncFilePersister::returns_released);
+
+            AsyncFilePersister* persister = nullptr;
+            {
+                std::unique_lock<std::mutex> guard(t->lock);
+                auto& list = t->persisters;
+                t->wake.wait(guard, [&list] { return !list.empty(); });
+                for (AsyncFilePersister* s : list) {
+                    if (s->returns_pending()) {
+                        persister = s;
+                        break;
+                    }
+                }
+            }
+            if (persister) {
+                idle = 0;
+                AsyncFilePersister::drain_returns(persister);
+            } else {
+                pool_idle(idle);
+            }
+        }
+    }
+
+    // False, with ValueError set, if a pool of a different size runs.
+    static bool pool_accepts(size_t threads, const ThreadOptions& options) {
+        std::lock_guard<std::mutex> guard(worker_pool_lock);
+        WorkerPool* pool = live_pool();
+        if (threads && pool && pool->size != threads) {
+            PyErr_Format(PyExc_ValueError,
+                         "the shared worker pool already runs %zu serializer threads, not %zu",
+                         pool->size, threads);
+            return false;
+        }
+        if (threads && pool && !(pool->options == options)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "the shared worker pool already runs with other cpus, sched, nice or thread_name");
+            return false;
+        }
+        return true;
+    }
+
+    static void pool_attach(AsyncFilePersister* persister) {
+        std::lock_guard<std::mutex> pool_guard(worker_pool_lock);
+        WorkerPool* pool = live_pool();
+        if (!pool) {
+            pool = new WorkerPool();
+            pool->size = persister->pool_threads;
+            pool->options = persister->thread_options;
+            pool->pid = current_pid();
+            pool->serializers.reset(new PoolThread[pool->size]);
+            for (size_t i = 0; i < pool->size; i++)
+                std::thread(pool_serializer_loop, &pool->serializers[i], &pool->options, "pool" + std::to_string(i)).detach();
+            std::thread(pool_drain_loop, &pool->drainer, &pool->options).detach();
+            worker_pool = pool;
+        }
+
+        persister->writer_released.store(false, std::memory_order_relaxed);
+        persister->returns_released.store(false, std::memory_order_relaxed);
+
+        PoolThread* least = nullptr;
+        size_t fewest = SIZE_MAX;
+        for (size_t i = 0; i < pool->size; i++) {
+            std::lock_guard<std::mutex> guard(pool->serializers[i].lock);
+            if (pool->serializers[i].persisters.size() < fewest) {
+                least = &pool->serializers[i];
+                fewest = least->persisters.size();
+            }
+        }
+        for (PoolThread* t : {least, &pool->drainer}) {
+            {
+                std::lock_guard<std::mutex> guard(t->lock);
+                t->persisters.push_back(persister);
+            }
+            t->wake.notify_one();
+        }
+    }
+
     static PyObject* AsyncFilePersister_path_getter(PyObject* obj, void*) {
         AsyncFilePersister* self = (AsyncFilePersister*)obj;
         if (self->framed_writer_obj) {
@@ -679,32 +1520,40 @@ namespace retracesoftware_stream {
 
     SetupResult AsyncFilePersister_setup(PyObject* persister, PyObject* serializer,
                                          size_t queue_capacity,
+                                         size_t queue_limit,
                                          size_t return_queue_capacity,
-                                         std::atomic<int64_t>* total_removed,
                                          PyObject* writer_key,
                                          bool quit_on_error) {
-        if (Py_TYPE(persister) != &AsyncFilePersister_Type) {
+        if (!is_persister(persister)) {
             PyErr_SetString(PyExc_TypeError, "expected AsyncFilePersister");
-            return {nullptr, nullptr};
+            return {nullptr, nullptr, nullptr};
         }
-        return ((AsyncFilePersister*)persister)->setup(serializer, queue_capacity,
-                                                       return_queue_capacity, total_removed,
-                                                       writer_key, quit_on_error);
+        return ((AsyncFilePersister*)persister)->setup(serializer, queue_capacity, queue_limit,
+                                                       return_queue_capacity, writer_key,
+                                                       quit_on_error);
     }
 
-    PyTypeObject AsyncFilePersister_Type = {
-        .ob_base = PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = MODULE "AsyncFilePersister",
-        .tp_basicsize = sizeof(AsyncFilePersister),
-        .tp_itemsize = 0,
-        .tp_dealloc = (destructor)AsyncFilePersister::dealloc,
-        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-        .tp_doc = "Async file persister -- serializes and writes to file on a background thread",
-        .tp_traverse = (traverseproc)AsyncFilePersister::traverse,
-        .tp_clear = (inquiry)AsyncFilePersister::clear,
-        .tp_methods = AsyncFilePersister_methods,
-        .tp_getset = AsyncFilePersister_getset,
-        .tp_init = (initproc)AsyncFilePersister::init,
-        .tp_new = AsyncFilePersister::tp_new,
+    static PyType_Slot AsyncFilePersister_slots[] = {
+        {Py_tp_dealloc, (void*)AsyncFilePersister::dealloc},
+        {Py_tp_doc, (void*)"Async file persister -- serializes and writes to file on a background thread"},
+        {Py_tp_traverse, (void*)AsyncFilePersister::traverse},
+        {Py_tp_clear, (void*)AsyncFilePersister::clear},
+        {Py_tp_methods, AsyncFilePersister_methods},
+        {Py_tp_getset, AsyncFilePersister_getset},
+        {Py_tp_init, (void*)AsyncFilePersister::init},
+        {Py_tp_new, (void*)AsyncFilePersister::tp_new},
+        {0, nullptr}
+    };
+
+    PyType_Spec AsyncFilePersister_spec = {
+        .name = MODULE "AsyncFilePersister",
+        .basicsize = sizeof(AsyncFilePersister),
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_IMMUTABLETYPE,
+        .slots = AsyncFilePersister_slots,
     };
+
+    // Not subclassable; each interpreter's copy shares tp_dealloc.
+    bool is_persister(PyObject* obj) {
+        return Py_TYPE(obj)->tp_dealloc == (destructor)AsyncFilePersister::dealloc;
+    }
 }
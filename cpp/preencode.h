@@ -0,0 +1,154 @@
+#pragma once
+
+#include <Python.h>
+#include <cstring>
+
+#include "wireformat.h"
+#include "framed_writer.h"
+
+namespace retracesoftware_stream {
+
+// Main-thread encoding of a list or dict of scalars straight to wire bytes,
+// so the writer thread copies one slab instead of consuming one queue entry
+// (and one reference) per element. The bytes are exactly what
+// MessageStream::write would emit, except that floats never use FLOAT_XOR
+// and strings are never STR_REFs; MessageStream::write_preencoded catches
+// its interning and float state up from the header.
+
+static constexpr Py_ssize_t PREENCODE_MAX_STR = 64;
+
+struct PreencodedHeader {
+    uint32_t strings;       // STR values, each taking the next interned index
+    uint32_t floats;        // nonzero if last_float is set
+    uint64_t last_float;    // bits of the last float, for FLOAT_XOR context
+};
+
+class Preencoder {
+    uint8_t * buffer;
+    uint8_t * out;
+    uint8_t * end;
+    PreencodedHeader header{};
+
+    bool room(size_t n) const { return (size_t)(end - out) >= n; }
+
+    bool byte(uint8_t b) {
+        if (!room(1)) return false;
+        *out++ = b;
+        return true;
+    }
+
+    template <typename T>
+    bool le(T v) {
+        if (!room(sizeof(T))) return false;
+        memcpy(out, &v, sizeof(T));
+        out += sizeof(T);
+        return true;
+    }
+
+    bool fixed(FixedSizeTypes type) { return byte(CreateFixedSize(type).raw); }
+
+    // As MessageStream::write_size.
+    bool size(SizedTypes type, uint64_t size) {
+        Control control;
+        control.Sized.type = type;
+        if (size <= 11) {
+            control.Sized.size = (Sizes)size;
+            return byte(control.raw);
+        }
+        if (size < UINT8_MAX) {
+            control.Sized.size = Sizes::ONE_BYTE_SIZE;
+            return byte(control.raw) && byte((uint8_t)size);
+        }
+        if (size < UINT16_MAX) {
+            control.Sized.size = Sizes::TWO_BYTE_SIZE;
+            return byte(control.raw) && le(to_le16((uint16_t)size));
+        }
+        if (size < UINT32_MAX) {
+            control.Sized.size = Sizes::FOUR_BYTE_SIZE;
+            return byte(control.raw) && le(to_le32((uint32_t)size));
+        }
+        control.Sized.size = Sizes::EIGHT_BYTE_SIZE;
+        return byte(control.raw) && le(to_le64(size));
+    }
+
+    bool extended(ExtendedTypes type, uint64_t payload) {
+        return size(SizedTypes::EXTENDED, payload) && byte((uint8_t)type);
+    }
+
+    // As MessageStream::write_float without the XOR candidate.
+    bool float_value(double d) {
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        header.floats++;
+        header.last_float = bits;
+
+        int64_t integral;
+        uint32_t bits32;
+        bool is_integral = float_is_integral(d, integral);
+        bool is_float32 = float_is_float32(d, bits32);
+        uint64_t zz = is_integral ? zigzag_encode(integral) : 0;
+
+        if (is_integral && (!is_float32 || sized_payload_bytes(zz) <= sized_payload_bytes(bits32))) {
+            if (2 + sized_payload_bytes(zz) < 9) return extended(ExtendedTypes::FLOAT_INT, zz);
+        } else if (is_float32 && 2 + sized_payload_bytes(bits32) < 9) {
+            return extended(ExtendedTypes::FLOAT32, bits32);
+        }
+        return fixed(FixedSizeTypes::FLOAT) && le(to_le64(bits));
+    }
+
+    // False, with no error set, for anything but an eligible scalar.
+    bool scalar(PyObject * obj) {
+        PyTypeObject * tp = Py_TYPE(obj);
+        if (obj == Py_None) return fixed(FixedSizeTypes::NONE);
+        if (tp == &PyBool_Type) return fixed(obj == Py_True ? FixedSizeTypes::TRUE : FixedSizeTypes::FALSE);
+        if (tp == &PyLong_Type) {
+            int overflow;
+            long long l = PyLong_AsLongLongAndOverflow(obj, &overflow);
+            if (overflow) return false;
+            if (l >= 0) return size(SizedTypes::UINT, (uint64_t)l);
+            if (l == -1) return fixed(FixedSizeTypes::NEG1);
+            return size(SizedTypes::SINT, zigzag_encode(l));
+        }
+        if (tp == &PyFloat_Type) return float_value(PyFloat_AS_DOUBLE(obj));
+        if (tp == &PyUnicode_Type) {
+            // Interned strings stay on the normal path, which refers back
+            // to them by STR_REF.
+            if (!PyUnicode_IS_COMPACT_ASCII(obj) || PyUnicode_CHECK_INTERNED(obj)) return false;
+            Py_ssize_t n = PyUnicode_GET_LENGTH(obj);
+            if (n > PREENCODE_MAX_STR || !size(SizedTypes::STR, n) || !room(n)) return false;
+            memcpy(out, PyUnicode_DATA(obj), n);
+            out += n;
+            header.strings++;
+            return true;
+        }
+        return false;
+    }
+
+public:
+    // capacity must leave room for the header.
+    Preencoder(uint8_t * buffer, size_t capacity)
+        : buffer(buffer), out(buffer + sizeof(PreencodedHeader)), end(buffer + capacity) {}
+
+    // Encodes an exact list or dict: the size of the header plus wire bytes,
+    // or 0 if an element is not an eligible scalar or the buffer is full.
+    size_t encode(PyObject * obj) {
+        if (PyList_CheckExact(obj)) {
+            Py_ssize_t n = PyList_GET_SIZE(obj);
+            if (!size(SizedTypes::LIST, n)) return 0;
+            for (Py_ssize_t i = 0; i < n; i++) {
+                if (!scalar(PyList_GET_ITEM(obj, i))) return 0;
+            }
+        } else {
+            if (!size(SizedTypes::DICT, PyDict_Size(obj))) return 0;
+            Py_ssize_t pos = 0;
+            PyObject *key, *value;
+            while (PyDict_Next(obj, &pos, &key, &value)) {
+                if (!scalar(key) || !scalar(value)) return 0;
+            }
+        }
+        memcpy(buffer, &header, sizeof(header));
+        return out - buffer;
+    }
+};
+
+}
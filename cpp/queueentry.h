@@ -1,6 +1,7 @@
 #pragma once
 #include <Python.h>
 #include <cstdint>
+#include "wireformat.h"
 
 #if PY_VERSION_HEX >= 0x030C0000
     inline bool is_immortal(PyObject* obj) { return _Py_IsImmortal(obj); }
@@ -28,7 +29,7 @@ namespace retracesoftware_stream {
     //   Tag 0b00   TAG_OBJECT      PyObject*
     //   Tag 0b01   TAG_DELETE      PyObject* identity
     //   Tag 0b10   TAG_THREAD      PyThreadState*
-    //   Tag 0b11   TAG_COMMAND     non-pointer: [len:26][cmd:4][tag:2]
+    //   Tag 0b11   TAG_COMMAND     non-pointer: [len:25][cmd:5][tag:2]
     //   PICKLED, NEW_HANDLE, BIND, EXT_BIND are encoded as
     //   CMD_* entries followed by an obj_entry pointer.
 
@@ -56,8 +57,8 @@ namespace retracesoftware_stream {
     static constexpr QEntry TAG_COMMAND = 3;
 
     static constexpr int CMD_SHIFT = 2;
-    static constexpr int CMD_BITS  = 4;
-    static constexpr int LEN_SHIFT = 6;
+    static constexpr int CMD_BITS  = 5;
+    static constexpr int LEN_SHIFT = 7;
 #else
     #error "Unsupported pointer size"
 #endif
@@ -81,6 +82,9 @@ namespace retracesoftware_stream {
         return ((QEntry)len << LEN_SHIFT) | ((QEntry)cmd << CMD_SHIFT) | TAG_COMMAND;
     }
 
+    // Bits of len a command entry carries: 32, or 25 on 32-bit.
+    static constexpr int LEN_BITS = (int)sizeof(QEntry) * 8 - LEN_SHIFT;
+
     inline uint32_t cmd_of(QEntry e) { return (uint32_t)((e >> CMD_SHIFT) & ((1U << CMD_BITS) - 1)); }
     inline uint32_t len_of(QEntry e) { return (uint32_t)(e >> LEN_SHIFT); }
 
@@ -116,7 +120,8 @@ namespace retracesoftware_stream {
         if (tp == &PyUnicode_Type) return estimate_unicode_size(obj);
         if (tp == &PyBytes_Type)   return estimate_bytes_size(obj);
         if (tp == &PyMemoryView_Type) return estimate_memory_view_size(obj);
-        if (tp == &StreamHandle_Type) return estimate_stream_handle_size(obj);
+        if (tp == &PyByteArray_Type) return (int64_t)(sizeof(PyObject) + PyByteArray_GET_SIZE(obj));
+        if (is_stream_handle_type(tp)) return estimate_stream_handle_size(obj);
         if (is_patched(tp->tp_free)) return 64;
         return -1;
     }
@@ -138,6 +143,94 @@ namespace retracesoftware_stream {
         CMD_BIND,
         CMD_EXT_BIND,
         CMD_SERIALIZE_ERROR,
+        CMD_PACKED,
+        CMD_DICT_DEFINE_SHAPE,
+        CMD_DICT_SHAPE,
+        CMD_CALL,
+        CMD_PROMOTE,
+        CMD_EXTENDED,
+        CMD_DATETIME,
+        CMD_STRUCT,
+        CMD_BUFFER,
+        CMD_ADD_FILENAME,
+        CMD_STACK,
+        CMD_STACK_FRAME,
+        CMD_TIMESTAMP,
+        CMD_CAPABILITIES,
+        CMD_PATCH,
+        CMD_LEVELS,
+        CMD_LEVEL_REF,
+        CMD_PREENCODED,
+    };
+
+    // The 32-bit layout has the narrowest command field.
+    static_assert(CMD_PREENCODED < (1u << CMD_BITS), "Cmd no longer fits in CMD_BITS");
+
+    // CMD_DICT_DEFINE_SHAPE len: n, followed by n key/value pairs like
+    // CMD_DICT. CMD_DICT_SHAPE len: (shape id << 8) | n, followed by n
+    // values in the shape's key order.
+    static constexpr uint32_t DICT_SHAPE_SIZE_BITS = 8;
+
+    // CMD_CALL len: nargs, followed by CMD_HANDLE_REF and nargs single
+    // TAG_OBJECT entries (the main thread only sends leaf args this way).
+    static constexpr size_t MAX_CALL_ARGS = 16;
+
+    // CMD_PROMOTE len: handle index, followed by the flattened value. The
+    // writer emits NEW_HANDLE(value) and then a HANDLE ref in its place.
+
+    // CMD_EXTENDED len: (value count << 8) | ExtendedTypes, followed by
+    // that many flattened values. The writer emits EXTENDED(type, count)
+    // and then the values.
+    static constexpr uint32_t EXTENDED_TYPE_BITS = 8;
+
+    static inline uint32_t extended_len(ExtendedTypes type, uint32_t count) {
+        return (count << EXTENDED_TYPE_BITS) | (uint32_t)type;
+    }
+
+    // CMD_STRUCT len: (layout id << 8) | n, followed by the n field values.
+    static constexpr uint32_t STRUCT_SIZE_BITS = 8;
+    static constexpr Py_ssize_t MAX_STRUCT_FIELDS = (1 << STRUCT_SIZE_BITS) - 1;
+
+    // CMD_BUFFER: followed by the payload (bytes, or a memoryview pinning a
+    // read-only export), then the class, format and shape as values.
+
+    // CMD_DATETIME: followed by a datetime and then its tzinfo as a value.
+
+    // CMD_ADD_FILENAME: followed by the (normalized) filename as a value.
+    // CMD_STACK len: (frames to drop << 16) | n, followed by n
+    // CMD_STACK_FRAME whose len is (filename index << 16) | line. Root level
+    // only. The frames to drop and the filename index get what is left of
+    // len above the low 16 bits.
+    static constexpr uint32_t STACK_COUNT_BITS = 16;
+    static constexpr uint32_t MAX_STACK_HIGH = (1U << (LEN_BITS - STACK_COUNT_BITS)) - 1;
+
+    // CMD_TIMESTAMP len: microseconds since the previous CMD_TIMESTAMP. A
+    // longer gap is sent as several entries of at most MAX_TIMESTAMP_DELTA.
+    static constexpr uint32_t MAX_TIMESTAMP_DELTA = (uint32_t)(~(QEntry)0 >> LEN_SHIFT);
+
+    // CMD_PATCH len: base handle index, followed by the removed part (a
+    // tuple of keys or None for dicts, a kept-prefix length for lists) and
+    // the changed entries as values.
+
+    // CMD_LEVELS len: n, followed by the root value and then n container
+    // values, each one level deep. Root level only. CMD_LEVEL_REF len:
+    // (container index << 1) | 1 for a list; no payload.
+
+    // CMD_PREENCODED len: bytes used, followed by a pooled bytearray slab
+    // holding a PreencodedHeader and then that value's wire bytes.
+
+    // CMD_CAPABILITIES len: the Capability bits the ObjectWriter knows of,
+    // followed by the dictionary tuple if CAP_DICTIONARY is among them. The
+    // writer thread adds CAP_BLOBS itself.
+
+    // CMD_PACKED len: element kind, plus PACKED_TUPLE for tuples. The next
+    // entry is a bytes snapshot: int64s, float64s, or one 0/1 byte per bool.
+    enum PackedKind : uint32_t {
+        PACKED_INT,
+        PACKED_FLOAT,
+        PACKED_BOOL,
     };
+    static constexpr uint32_t PACKED_KIND_MASK = 0x3;
+    static constexpr uint32_t PACKED_TUPLE = 0x4;
 
 }
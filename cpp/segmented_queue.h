@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+namespace retracesoftware_stream {
+
+// Single-producer single-consumer queue built from a linked list of
+// fixed-size chunks, so a burst grows the queue instead of stalling the
+// producer on a full ring. Chunks the consumer has drained go onto a free
+// list that the producer takes from before allocating; try_push fails only
+// once max_entries worth of chunks exist and none is free. The interface is
+// the subset of rigtorp::SPSCQueue the writer uses: try_push on the
+// producer side, front/pop on the consumer side.
+template <typename T, size_t ChunkSize = 4096>
+class SegmentedQueue {
+    static_assert(std::is_trivially_copyable<T>::value, "entries are copied raw");
+
+    static constexpr size_t kCacheLineSize = 64;
+
+    struct Chunk {
+        // Entries written so far; the producer publishes each with release.
+        std::atomic<size_t> committed{0};
+        std::atomic<Chunk *> next{nullptr};
+        Chunk * free_next = nullptr;
+        T slots[ChunkSize];
+    };
+
+    size_t max_chunks;
+
+    // Free list: pushed by the consumer, popped by the producer. With only
+    // one popper, a chunk can't reappear at the top while a pop is pending.
+    alignas(kCacheLineSize) std::atomic<Chunk *> free_chunks{nullptr};
+
+    // Producer side.
+    alignas(kCacheLineSize) Chunk * tail;
+    size_t tail_pos = 0;
+    size_t allocated = 0;
+
+    // Consumer side.
+    alignas(kCacheLineSize) Chunk * head;
+    size_t head_pos = 0;
+
+    Chunk * take_free() {
+        Chunk * chunk = free_chunks.load(std::memory_order_acquire);
+        while (chunk && !free_chunks.compare_exchange_weak(chunk, chunk->free_next,
+                                                           std::memory_order_acquire,
+                                                           std::memory_order_acquire)) {}
+        return chunk;
+    }
+
+    void recycle(Chunk * chunk) {
+        Chunk * top = free_chunks.load(std::memory_order_relaxed);
+        do {
+            chunk->free_next = top;
+        } while (!free_chunks.compare_exchange_weak(top, chunk,
+                                                    std::memory_order_release,
+                                                    std::memory_order_relaxed));
+    }
+
+    Chunk * new_chunk() {
+        Chunk * chunk = take_free();
+        if (!chunk) {
+            if (allocated >= max_chunks) return nullptr;
+            chunk = new (std::nothrow) Chunk();
+            if (!chunk) return nullptr;
+            allocated++;
+        }
+        chunk->committed.store(0, std::memory_order_relaxed);
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+        return chunk;
+    }
+
+public:
+    // initial_entries are allocated up front; max_entries caps the total.
+    SegmentedQueue(size_t initial_entries, size_t max_entries)
+        : max_chunks(std::max<size_t>(2, (max_entries + ChunkSize - 1) / ChunkSize)) {
+        tail = head = new Chunk();
+        allocated = 1;
+        size_t initial_chunks = std::min(max_chunks, (initial_entries + ChunkSize - 1) / ChunkSize);
+        for (; allocated < initial_chunks; allocated++) recycle(new Chunk());
+    }
+
+    ~SegmentedQueue() {
+        for (Chunk * chunk = head; chunk;) {
+            Chunk * next = chunk->next.load(std::memory_order_relaxed);
+            delete chunk;
+            chunk = next;
+        }
+        for (Chunk * chunk = free_chunks.load(std::memory_order_relaxed); chunk;) {
+            Chunk * next = chunk->free_next;
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    SegmentedQueue(const SegmentedQueue &) = delete;
+    SegmentedQueue &operator=(const SegmentedQueue &) = delete;
+
+    bool try_push(const T & value) {
+        if (tail_pos == ChunkSize) {
+            Chunk * chunk = new_chunk();
+            if (!chunk) return false;
+            tail->next.store(chunk, std::memory_order_release);
+            tail = chunk;
+            tail_pos = 0;
+        }
+        tail->slots[tail_pos] = value;
+        tail->committed.store(++tail_pos, std::memory_order_release);
+        return true;
+    }
+
+    T * front() {
+        while (true) {
+            if (head_pos < head->committed.load(std::memory_order_acquire))
+                return &head->slots[head_pos];
+            if (head_pos < ChunkSize) return nullptr;
+            Chunk * next = head->next.load(std::memory_order_acquire);
+            if (!next) return nullptr;
+            Chunk * done = head;
+            head = next;
+            head_pos = 0;
+            recycle(done);
+        }
+    }
+
+    // Only after front() returned an entry.
+    void pop() { head_pos++; }
+};
+
+}
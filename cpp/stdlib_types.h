@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Python.h>
+// datetime.h defines a static PyDateTimeAPI in each file; ours lives in
+// StdlibTypes instead, so that copy is never read.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#endif
+#include <datetime.h>
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace retracesoftware_stream {
+
+// Stdlib value types with native encodings (EXTENDED DATE, DECIMAL, ...).
+// Only exact types match; subclasses keep going through the serializer.
+//
+// Loaded once per interpreter into its ModuleState (module_state.h). The
+// datetime C API is kept here too rather than in datetime.h's per-file
+// PyDateTimeAPI, which would pin the first interpreter's types.
+
+struct StdlibTypes {
+    PyDateTime_CAPI * datetime_api = nullptr;
+    PyTypeObject * date = nullptr;
+    PyTypeObject * datetime = nullptr;
+    PyTypeObject * timedelta = nullptr;
+    PyTypeObject * timezone = nullptr;
+    PyTypeObject * decimal = nullptr;
+    PyTypeObject * uuid = nullptr;
+    PyTypeObject * array = nullptr;     // array.array; sent as EXTENDED BUFFER
+};
+
+// The current interpreter's; defined in module.cpp.
+const StdlibTypes & stdlib_types();
+
+// numpy.ndarray once something else has imported numpy; never imports it.
+PyTypeObject * numpy_ndarray();
+
+static inline bool is_stdlib_value(PyTypeObject * tp) {
+    if (tp == &PyComplex_Type) return true;
+    const StdlibTypes & types = stdlib_types();
+    return tp == types.datetime || tp == types.date || tp == types.timedelta ||
+           tp == types.timezone || tp == types.decimal || tp == types.uuid;
+}
+
+// Packs a date into the EXTENDED size: day in bits 0-4, month 5-8, year above.
+static inline uint64_t pack_date(int year, int month, int day) {
+    return ((uint64_t)year << 9) | ((uint64_t)month << 5) | (uint64_t)day;
+}
+
+}
@@ -84,31 +84,47 @@ namespace retracesoftware_stream {
         return list.release();  // transfer ownership to caller
     }    
 
-    extern PyTypeObject ObjectWriter_Type;
-    extern PyTypeObject ObjectReader_Type;
-    extern PyTypeObject StreamHandle_Type;
-    extern PyTypeObject ObjectStream_Type;
-    extern PyTypeObject AsyncFilePersister_Type;
-    extern PyTypeObject FramedWriter_Type;
-    extern PyTypeObject Deleter_Type;
+    // Specs of the module's types. Each interpreter that imports the
+    // module creates its own from them (module_exec, in module.cpp).
+    extern PyType_Spec ObjectWriter_spec;
+    extern PyType_Spec StreamHandle_spec;
+    extern PyType_Spec ObjectStream_spec;
+    extern PyType_Spec AsyncFilePersister_spec;
+    extern PyType_Spec FramedWriter_spec;
+    extern PyType_Spec Deleter_spec;
+
+    // The interpreters' copies of a type share its slots, so a type that
+    // can't be subclassed is known by its tp_dealloc.
+    void StreamHandle_dealloc(PyObject * self);
+
+    inline bool is_stream_handle_type(PyTypeObject * tp) {
+        return tp->tp_dealloc == StreamHandle_dealloc;
+    }
+
+    bool is_persister(PyObject * obj);
 
     class FramedWriter;
     FramedWriter* FramedWriter_get(PyObject* obj);
 
     struct SetupResult {
-        void* forward_queue;    // SPSCQueue<QEntry>*
+        void* forward_queue;    // SegmentedQueue<QEntry>*
         void* return_queue;     // SPSCQueue<PyObject*>*
+        // Bytes the drain thread has handed back; owned by the persister,
+        // so it outlives the ObjectWriter.
+        std::atomic<int64_t>* total_removed;
     };
 
     // Defined in persister.cpp — called by ObjectWriter during init.
+    // Each call registers a new writer with its own queues and stream
+    // state; several ObjectWriters may share one persister.
     // writer_key is the ObjectWriter* cast to PyObject*, used as a dict
     // key to look up thread handles from PyThreadState.dict.
-    // total_removed points to the ObjectWriter's atomic counter that the
-    // drain thread increments as objects are returned.
+    // The forward queue starts with queue_capacity entries and grows to
+    // at most queue_limit.
     SetupResult AsyncFilePersister_setup(PyObject* persister, PyObject* serializer,
                                          size_t queue_capacity,
+                                         size_t queue_limit,
                                          size_t return_queue_capacity,
-                                         std::atomic<int64_t>* total_removed,
                                          PyObject* writer_key,
                                          bool quit_on_error);
 
@@ -1,5 +1,8 @@
 #pragma once
 #include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
 
 namespace retracesoftware_stream {
     // first bit encodes if its a sized type
@@ -27,8 +30,8 @@ namespace retracesoftware_stream {
         
         HANDLE,
         BIGINT,
-        SET,
-        FROZENSET,
+        SINT,       // Zigzag-encoded signed int, same size classes as UINT
+        EXTENDED,   // Size as usual, then one ExtendedTypes byte
 
         BINDING,
         BINDING_DELETE,
@@ -95,6 +98,124 @@ namespace retracesoftware_stream {
     //     RootOnlyTypes__LAST__,
     // };
 
+    // Types behind the EXTENDED escape. The control byte carries the
+    // size class as for any sized type; the byte following the size
+    // selects one of these, so the meaning of the size is per type.
+    enum ExtendedTypes : uint8_t {
+        FLOAT_INT,      // size: zigzag of an integral float's value
+        FLOAT32,        // size: bits of a float exactly representable as float32
+        FLOAT_XOR,      // size: bits XOR the previous float in the same handle context
+        // size: element count. INT is followed by a width byte (1/2/4/8),
+        // the minimum as int64, then each value minus the minimum at that
+        // width; FLOAT by raw float64s; BOOL by a bitmap, LSB first.
+        PACKED_INT_LIST,
+        PACKED_INT_TUPLE,
+        PACKED_FLOAT_LIST,
+        PACKED_FLOAT_TUPLE,
+        PACKED_BOOL_LIST,
+        PACKED_BOOL_TUPLE,
+        DICT_DEFINE_SHAPE,  // size: n; n key/value pairs, keys become the next shape
+        DICT_SHAPE,         // size: shape id; one value per key of that shape
+        // size: handle. DEFINE is followed by an arg count byte and one
+        // CallArgClass byte per arg, which become the handle's template;
+        // then one payload per arg, per the template.
+        CALL_TEMPLATE_DEFINE,
+        CALL_TEMPLATE,
+        // size: payload length; followed by the 8-byte blob hash. The
+        // payload itself is in the blob file (see blob_store.h).
+        BLOB_BYTES,
+        BLOB_STR,
+        BLOB_PICKLED,
+        // size: 2; the enum class (normally a HANDLE) and the member's
+        // value. Read back via the class's _value2member_map_.
+        ENUM,
+        COMPLEX,    // size: 0; real and imag as float64
+        DATE,       // size: year << 9 | month << 5 | day
+        // size: as DATE; a varint of (microseconds into the day << 1 | fold),
+        // then the tzinfo as a value.
+        DATETIME,
+        TIMEDELTA,  // size: zigzag days; varints of seconds and microseconds
+        TIMEZONE,   // size: arg count; the timezone(...) args as values
+        // size: digit count; a DecimalFlags byte, the zigzag varint
+        // exponent unless special, then the digits as BCD, high nibble first.
+        DECIMAL,
+        UUID,       // size: 0; the 16 UUID bytes
+        BYTEARRAY,  // size: 1; the contents as a BYTES (or BLOB_BYTES) value
+        // size: 2, or 3 for OSError; the class (normally a HANDLE), the args
+        // tuple, and for OSError a (filename, filename2) tuple.
+        EXCEPTION,
+        // size: 1 + 2n; the class, n field names, then n values. The names
+        // become the next struct layout.
+        STRUCT_DEFINE,
+        STRUCT,     // size: layout id; one value per field of that layout
+        // size: payload bytes; the class, format and shape as values, then
+        // the payload in C order.
+        BUFFER,
+        // size: microseconds since the previous TIMESTAMP (or the writer's
+        // start); root only, consumed by the reader ahead of the next message.
+        TIMESTAMP,
+        // size: format version; varints of the required and then the
+        // optional Capability bits. Root only, written ahead of the first
+        // message by each ObjectWriter.
+        CAPABILITIES,
+        // size: 1; a dict or list, which the reader also keeps (as a copy)
+        // as the next handle.
+        PATCH_BASE,
+        // size: handle of a PATCH_BASE; the removed part and the changes.
+        // Dicts: a tuple of keys to delete (None: start empty), then a dict
+        // of entries to set. Lists: how many leading items to keep, then
+        // a list to append. The result replaces the handle.
+        PATCH,
+        // size: n; the root value and then n dicts/lists whose nested
+        // containers are LEVEL_REFs. Container i fills the i-th shell.
+        LEVELS,
+        // size: (container index << 1) | 1 for a list; the shell the
+        // enclosing LEVELS fills in.
+        LEVEL_REF,
+        // size: writer id; root only. The records that follow, up to the
+        // next WRITER, come from that writer and use its own handle,
+        // string and shape tables. Written only once a persister has more
+        // than one ObjectWriter; until the first one, the id is 0.
+        WRITER,
+        ExtendedTypes__LAST__,
+    };
+
+    // Version of the encoding as a whole, declared by CAPABILITIES and in
+    // the JSON preamble. Bumped for changes a reader cannot detect from
+    // capability bits.
+    static constexpr uint64_t FORMAT_VERSION = 2;
+
+    // What a trace needs from its reader. A reader refuses a trace with a
+    // required bit it does not know; optional bits only describe records
+    // it may meet, and unknown ones are ignored.
+    enum Capability : uint64_t {
+        CAP_BLOBS = 1 << 0,         // required: BLOB_* payloads are in a blob file
+        CAP_TIMESTAMPS = 1 << 1,    // optional: TIMESTAMP records precede messages
+        CAP_STACKS = 1 << 2,        // optional: STACK and ADD_FILENAME records
+        // required: a preset string dictionary; CAPABILITIES goes on with
+        // its 8-byte hash and a varint entry count (see dictionary.h).
+        CAP_DICTIONARY = 1 << 3,
+    };
+    static constexpr uint64_t KNOWN_REQUIRED_CAPABILITIES = CAP_BLOBS | CAP_DICTIONARY;
+
+    // Flags byte of EXTENDED DECIMAL: the sign, and which special value
+    // (if any) in place of an exponent.
+    enum DecimalFlags : uint8_t {
+        DECIMAL_NEGATIVE = 0x1,
+        DECIMAL_INFINITY = 0x2,
+        DECIMAL_NAN = 0x4,
+        DECIMAL_SNAN = 0x6,
+        DECIMAL_SPECIAL_MASK = 0x6,
+    };
+
+    // Per-argument payloads of a call template.
+    enum CallArgClass : uint8_t {
+        CALL_ARG_NONE,      // no payload
+        CALL_ARG_BOOL,      // one byte, 0 or 1
+        CALL_ARG_INT,       // LEB128 varint of the zigzag value
+        CALL_ARG_VALUE,     // an ordinary encoded value
+    };
+
     union Control {
         struct {
             SizedTypes type : 4;  // Lower 4 bits
@@ -155,6 +276,45 @@ namespace retracesoftware_stream {
         return control.Sized.type == SizedTypes::DELETE;
     }
 
+    // Zigzag maps signed to unsigned so small magnitudes of either sign
+    // stay small: 0, -1, 1, -2, 2 ... -> 0, 1, 2, 3, 4 ...
+    constexpr uint64_t zigzag_encode(int64_t v) {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    constexpr int64_t zigzag_decode(uint64_t v) {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    // Number of bytes following the control byte for a sized value.
+    constexpr int sized_payload_bytes(uint64_t size) {
+        return size <= 11 ? 0
+             : size < UINT8_MAX ? 1
+             : size < UINT16_MAX ? 2
+             : size < UINT32_MAX ? 4
+             : 8;
+    }
+
+    // FLOAT_INT payload, when d is an integer.
+    inline bool float_is_integral(double d, int64_t& out) {
+        // Limited to the range where every integer is a double, and
+        // -0.0 must keep its sign so it stays on the raw path.
+        if (!(d >= -9007199254740992.0 && d <= 9007199254740992.0)) return false;
+        if (d == 0.0 && std::signbit(d)) return false;
+        out = (int64_t)d;
+        return (double)out == d;
+    }
+
+    // FLOAT32 payload, when d survives the round trip through float.
+    inline bool float_is_float32(double d, uint32_t& out) {
+        if (std::isnan(d)) return false;
+        if (!std::isinf(d) && std::fabs(d) > FLT_MAX) return false;
+        float f = (float)d;
+        if ((double)f != d) return false;
+        memcpy(&out, &f, sizeof(out));
+        return true;
+    }
+
     // static FixedSizeTypes fixed_size_type(Control control) {
     //     return control.Fixed.SizedTypes_FIXED_SIZE == FIXED_SIZE ? control.Fixed.type : FixedSizeTypes__LAST__;
     // }
@@ -233,6 +393,48 @@ namespace retracesoftware_stream {
         }
     }
 
+    constexpr const char * ExtendedTypes_Name(enum ExtendedTypes type) {
+        switch (type) {
+            case ExtendedTypes::FLOAT_INT: return "FLOAT_INT";
+            case ExtendedTypes::FLOAT32: return "FLOAT32";
+            case ExtendedTypes::FLOAT_XOR: return "FLOAT_XOR";
+            case ExtendedTypes::PACKED_INT_LIST: return "PACKED_INT_LIST";
+            case ExtendedTypes::PACKED_INT_TUPLE: return "PACKED_INT_TUPLE";
+            case ExtendedTypes::PACKED_FLOAT_LIST: return "PACKED_FLOAT_LIST";
+            case ExtendedTypes::PACKED_FLOAT_TUPLE: return "PACKED_FLOAT_TUPLE";
+            case ExtendedTypes::PACKED_BOOL_LIST: return "PACKED_BOOL_LIST";
+            case ExtendedTypes::PACKED_BOOL_TUPLE: return "PACKED_BOOL_TUPLE";
+            case ExtendedTypes::DICT_DEFINE_SHAPE: return "DICT_DEFINE_SHAPE";
+            case ExtendedTypes::DICT_SHAPE: return "DICT_SHAPE";
+            case ExtendedTypes::CALL_TEMPLATE_DEFINE: return "CALL_TEMPLATE_DEFINE";
+            case ExtendedTypes::CALL_TEMPLATE: return "CALL_TEMPLATE";
+            case ExtendedTypes::BLOB_BYTES: return "BLOB_BYTES";
+            case ExtendedTypes::BLOB_STR: return "BLOB_STR";
+            case ExtendedTypes::BLOB_PICKLED: return "BLOB_PICKLED";
+            case ExtendedTypes::ENUM: return "ENUM";
+            case ExtendedTypes::COMPLEX: return "COMPLEX";
+            case ExtendedTypes::DATE: return "DATE";
+            case ExtendedTypes::DATETIME: return "DATETIME";
+            case ExtendedTypes::TIMEDELTA: return "TIMEDELTA";
+            case ExtendedTypes::TIMEZONE: return "TIMEZONE";
+            case ExtendedTypes::DECIMAL: return "DECIMAL";
+            case ExtendedTypes::UUID: return "UUID";
+            case ExtendedTypes::BYTEARRAY: return "BYTEARRAY";
+            case ExtendedTypes::EXCEPTION: return "EXCEPTION";
+            case ExtendedTypes::STRUCT_DEFINE: return "STRUCT_DEFINE";
+            case ExtendedTypes::STRUCT: return "STRUCT";
+            case ExtendedTypes::BUFFER: return "BUFFER";
+            case ExtendedTypes::TIMESTAMP: return "TIMESTAMP";
+            case ExtendedTypes::CAPABILITIES: return "CAPABILITIES";
+            case ExtendedTypes::PATCH_BASE: return "PATCH_BASE";
+            case ExtendedTypes::PATCH: return "PATCH";
+            case ExtendedTypes::LEVELS: return "LEVELS";
+            case ExtendedTypes::LEVEL_REF: return "LEVEL_REF";
+            case ExtendedTypes::WRITER: return "WRITER";
+            default: return nullptr;
+        }
+    }
+
     // const char * SizedTypes_Name(enum SizedTypes root);
 
     constexpr const char * SizedTypes_Name(enum SizedTypes root) {
@@ -249,8 +451,8 @@ namespace retracesoftware_stream {
             
             case SizedTypes::HANDLE: return "HANDLE";
             case SizedTypes::BIGINT: return "BIGINT";
-            case SizedTypes::SET: return "SET";
-            case SizedTypes::FROZENSET: return "FROZENSET";
+            case SizedTypes::SINT: return "SINT";
+            case SizedTypes::EXTENDED: return "EXTENDED";
 
             case SizedTypes::BINDING: return "BINDING";
             case SizedTypes::BINDING_DELETE: return "BINDING_DELETE";
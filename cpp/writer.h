@@ -1,8 +1,15 @@
 #include "stream.h"
 #include "wireformat.h"
 #include "framed_writer.h"
+#include "blob_store.h"
+#include "dictionary.h"
+#include "preencode.h"
+#include "stdlib_types.h"
+#include "module_state.h"
 #include <vector>
 #include <cstring>
+#include <cmath>
+#include <cfloat>
 #include <chrono>
 #include <cerrno>
 
@@ -23,6 +30,7 @@ namespace retracesoftware_stream {
 
     class MessageStream {
         FramedWriter& writer;
+        BlobWriter * blobs = nullptr;     // borrowed from the persister
         PyObject * serializer;
         map<PyObject *, int> bindings;
         int binding_counter = 0;
@@ -33,6 +41,18 @@ namespace retracesoftware_stream {
         map<PyObject *, uint16_t> interned_index;
         uint16_t interned_counter = 0;
 
+        // Float XOR context: the bits of the last float written after each
+        // handle reference, so repeated calls through the same handle delta
+        // against each other. The reader mirrors this exactly.
+        map<int, uint64_t> float_history;
+        int float_site = -1;
+
+        std::vector<uint8_t> packed_scratch;
+
+        // Arg classes of the last call through each handle.
+        map<int, std::vector<uint8_t>> call_templates;
+        std::vector<uint8_t> call_classes;
+
         static constexpr int MAX_WRITE_DEPTH = 64;
         int write_depth = 0;
 
@@ -43,14 +63,15 @@ namespace retracesoftware_stream {
         };
 
         static PyObject* pickle_dumps() {
-            static PyObject* dumps = nullptr;
-            if (!dumps) {
+            ModuleState* state = module_state();
+            if (!state) return nullptr;
+            if (!state->pickle_dumps) {
                 PyObject* mod = PyImport_ImportModule("pickle");
                 if (!mod) return nullptr;
-                dumps = PyObject_GetAttrString(mod, "dumps");
+                state->pickle_dumps = PyObject_GetAttrString(mod, "dumps");
                 Py_DECREF(mod);
             }
-            return dumps;
+            return state->pickle_dumps;
         }
 
         // --- Primitive write helpers (delegate to FramedWriter) ---
@@ -87,7 +108,7 @@ namespace retracesoftware_stream {
             write_size(type, l);
         }
 
-        void write_size(SizedTypes type, Py_ssize_t size) {
+        void write_size(SizedTypes type, uint64_t size) {
             assert(type < 16);
 
             if (verbose) {
@@ -121,8 +142,17 @@ namespace retracesoftware_stream {
             }
         }
 
+        void write_extended(ExtendedTypes type, uint64_t size) {
+            write_size(SizedTypes::EXTENDED, size);
+            if (verbose) {
+                printf("%s ", ExtendedTypes_Name(type));
+            }
+            emit((uint8_t)type);
+        }
+
         void write_handle_ref(int handle) {
             write_unsigned_number(SizedTypes::HANDLE, handle);
+            float_site = handle;
         }
 
         void write_lookup(int ref) {
@@ -163,9 +193,22 @@ namespace retracesoftware_stream {
             }
         }
 
+        // Payloads at or above the blob threshold go to the blob file and
+        // the stream carries only their length and hash.
+        bool write_blob(ExtendedTypes type, const uint8_t * data, size_t size) {
+            if (!blobs || size < blobs->threshold()) return false;
+            uint64_t hash;
+            if (!blobs->put(data, size, hash)) return false;
+            write_extended(type, size);
+            emit(hash);
+            return true;
+        }
+
         void write_str_value(PyObject * obj) {
             Py_ssize_t size;
             const char * utf8 = PyUnicode_AsUTF8AndSize(obj, &size);
+            if (!utf8) throw nullptr;
+            if (write_blob(ExtendedTypes::BLOB_STR, (const uint8_t *)utf8, size)) return;
             write_size(SizedTypes::STR, (int)size);
             emit_bytes((const uint8_t *)utf8, size);
         }
@@ -193,9 +236,45 @@ namespace retracesoftware_stream {
             }
         }
 
+        // Pick the smallest of: raw FLOAT, integral, float32, or XOR against
+        // the previous float in this handle context.
+        void write_float(double d) {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+
+            uint64_t& previous = float_history[float_site];
+            uint64_t delta = bits ^ previous;
+            previous = bits;
+
+            ExtendedTypes best_type = ExtendedTypes::FLOAT_XOR;
+            uint64_t best_size = delta;
+
+            int64_t integral;
+            if (float_is_integral(d, integral)) {
+                uint64_t zz = zigzag_encode(integral);
+                if (sized_payload_bytes(zz) < sized_payload_bytes(best_size)) {
+                    best_type = ExtendedTypes::FLOAT_INT;
+                    best_size = zz;
+                }
+            }
+            uint32_t bits32;
+            if (float_is_float32(d, bits32) &&
+                sized_payload_bytes(bits32) < sized_payload_bytes(best_size)) {
+                best_type = ExtendedTypes::FLOAT32;
+                best_size = bits32;
+            }
+
+            // extended costs control + type byte + payload; raw costs 9
+            if (2 + sized_payload_bytes(best_size) < 9) {
+                write_extended(best_type, best_size);
+            } else {
+                emit(FixedSizeTypes::FLOAT);
+                emit(d);
+            }
+        }
+
         void write_float_value(PyObject * obj) {
-            emit(FixedSizeTypes::FLOAT);
-            emit(PyFloat_AsDouble(obj));
+            write_float(PyFloat_AS_DOUBLE(obj));
         }
 
         void write_bytes_header(PyObject * obj) {
@@ -207,11 +286,15 @@ namespace retracesoftware_stream {
         }
 
         void write_bytes_value(PyObject * obj) {
+            if (write_blob(ExtendedTypes::BLOB_BYTES,
+                           (const uint8_t *)PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj))) return;
             write_bytes_header(obj);
             write_bytes_data(obj);
         }
 
         void write_pickled_value(PyObject * bytes) {
+            if (write_blob(ExtendedTypes::BLOB_PICKLED,
+                           (const uint8_t *)PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes))) return;
             write_size(SizedTypes::PICKLED, PyBytes_GET_SIZE(bytes));
             write_bytes_data(bytes);
         }
@@ -223,18 +306,140 @@ namespace retracesoftware_stream {
         void write_memory_view(PyObject * obj) {
             Py_buffer *view = PyMemoryView_GET_BUFFER(obj);
             assert(view->readonly);
+            if (write_blob(ExtendedTypes::BLOB_BYTES, (const uint8_t *)view->buf, view->len)) return;
             write_size(SizedTypes::BYTES, view->len);
             emit_bytes((const uint8_t *)view->buf, view->len);
         }
 
+        void write_complex(PyObject * obj) {
+            Py_complex c = PyComplex_AsCComplex(obj);
+            write_extended(ExtendedTypes::COMPLEX, 0);
+            emit(c.real);
+            emit(c.imag);
+        }
+
+        void write_date(PyObject * obj) {
+            write_extended(ExtendedTypes::DATE,
+                pack_date(PyDateTime_GET_YEAR(obj), PyDateTime_GET_MONTH(obj), PyDateTime_GET_DAY(obj)));
+        }
+
+        // The datetime without its tzinfo, which follows as a value.
+        void write_datetime_fields(PyObject * obj) {
+            write_extended(ExtendedTypes::DATETIME,
+                pack_date(PyDateTime_GET_YEAR(obj), PyDateTime_GET_MONTH(obj), PyDateTime_GET_DAY(obj)));
+            uint64_t seconds = PyDateTime_DATE_GET_HOUR(obj) * 3600 +
+                               PyDateTime_DATE_GET_MINUTE(obj) * 60 +
+                               PyDateTime_DATE_GET_SECOND(obj);
+            uint64_t micros = seconds * 1000000 + PyDateTime_DATE_GET_MICROSECOND(obj);
+            write_varint((micros << 1) | PyDateTime_DATE_GET_FOLD(obj));
+        }
+
+        void write_timedelta(PyObject * obj) {
+            write_extended(ExtendedTypes::TIMEDELTA, zigzag_encode(PyDateTime_DELTA_GET_DAYS(obj)));
+            write_varint(PyDateTime_DELTA_GET_SECONDS(obj));
+            write_varint(PyDateTime_DELTA_GET_MICROSECONDS(obj));
+        }
+
+        void write_timezone(PyObject * obj) {
+            PyObject * args = PyObject_CallMethod(obj, "__getinitargs__", nullptr);
+            if (!args) throw nullptr;
+            if (!PyTuple_Check(args)) {
+                Py_DECREF(args);
+                PyErr_SetString(PyExc_TypeError, "timezone.__getinitargs__ did not return a tuple");
+                throw nullptr;
+            }
+            try {
+                write_extended(ExtendedTypes::TIMEZONE, PyTuple_GET_SIZE(args));
+                for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) write(PyTuple_GET_ITEM(args, i));
+            } catch (...) {
+                Py_DECREF(args);
+                throw;
+            }
+            Py_DECREF(args);
+        }
+
+        // Decimal.as_tuple(): one flags byte (sign, and the kind of special
+        // value), the exponent for finite values, then the digits as BCD.
+        void write_decimal(PyObject * obj) {
+            PyObject * parts = PyObject_CallMethod(obj, "as_tuple", nullptr);
+            if (!parts) throw nullptr;
+
+            PyObject * digits = PyTuple_GET_ITEM(parts, 1);
+            PyObject * exponent = PyTuple_GET_ITEM(parts, 2);
+            uint8_t flags = PyObject_IsTrue(PyTuple_GET_ITEM(parts, 0)) ? DECIMAL_NEGATIVE : 0;
+            int64_t exp = 0;
+
+            if (PyLong_Check(exponent)) {
+                exp = PyLong_AsLongLong(exponent);
+            } else {
+                const char * kind = PyUnicode_AsUTF8(exponent);
+                flags |= !kind ? 0
+                       : kind[0] == 'F' ? DECIMAL_INFINITY
+                       : kind[0] == 'n' ? DECIMAL_NAN
+                       : DECIMAL_SNAN;
+            }
+            if (PyErr_Occurred()) {
+                Py_DECREF(parts);
+                throw nullptr;
+            }
+
+            Py_ssize_t n = PyTuple_GET_SIZE(digits);
+            write_extended(ExtendedTypes::DECIMAL, n);
+            emit(flags);
+            if (!(flags & DECIMAL_SPECIAL_MASK)) write_varint(zigzag_encode(exp));
+            for (Py_ssize_t i = 0; i < n; i += 2) {
+                uint8_t hi = (uint8_t)PyLong_AsLong(PyTuple_GET_ITEM(digits, i));
+                uint8_t lo = i + 1 < n ? (uint8_t)PyLong_AsLong(PyTuple_GET_ITEM(digits, i + 1)) : 0;
+                emit((uint8_t)((hi << 4) | lo));
+            }
+            Py_DECREF(parts);
+        }
+
+        void write_uuid(PyObject * obj) {
+            PyObject * bytes = PyObject_GetAttrString(obj, "bytes");
+            if (!bytes) throw nullptr;
+            if (!PyBytes_Check(bytes) || PyBytes_GET_SIZE(bytes) != 16) {
+                Py_DECREF(bytes);
+                PyErr_SetString(PyExc_TypeError, "UUID.bytes is not 16 bytes");
+                throw nullptr;
+            }
+            write_extended(ExtendedTypes::UUID, 0);
+            emit_bytes((const uint8_t *)PyBytes_AS_STRING(bytes), 16);
+            Py_DECREF(bytes);
+        }
+
+        void write_stdlib_value(PyObject * obj) {
+            PyTypeObject * tp = Py_TYPE(obj);
+            const StdlibTypes & types = stdlib_types();
+
+            if (tp == &PyComplex_Type) write_complex(obj);
+            else if (tp == types.datetime) {
+                write_datetime_fields(obj);
+                write(PyDateTime_DATE_GET_TZINFO(obj));
+            }
+            else if (tp == types.date) write_date(obj);
+            else if (tp == types.timedelta) write_timedelta(obj);
+            else if (tp == types.timezone) write_timezone(obj);
+            else if (tp == types.decimal) write_decimal(obj);
+            else write_uuid(obj);
+        }
+
+        void write_bytearray(PyObject * obj) {
+            write_extended(ExtendedTypes::BYTEARRAY, 1);
+            const uint8_t * data = (const uint8_t *)PyByteArray_AS_STRING(obj);
+            Py_ssize_t size = PyByteArray_GET_SIZE(obj);
+            if (write_blob(ExtendedTypes::BLOB_BYTES, data, size)) return;
+            write_size(SizedTypes::BYTES, size);
+            emit_bytes(data, size);
+        }
+
         void write_sized_int(int64_t l) {
             if (l >= 0) {
                 write_unsigned_number(SizedTypes::UINT, l);
             } else if (l == -1) {
                 emit_control(CreateFixedSize(FixedSizeTypes::NEG1));
             } else {
-                emit_control(CreateFixedSize(FixedSizeTypes::INT64));
-                emit(l);
+                write_unsigned_number(SizedTypes::SINT, zigzag_encode(l));
             }
         }
 
@@ -340,6 +545,8 @@ namespace retracesoftware_stream {
             }
         }
 
+        void set_blob_store(BlobWriter * store) { blobs = store; }
+
         void traverse(visitproc visit, void* arg) {
             if (serializer) visit(serializer, arg);
             for (auto& [key, value] : interned_index) {
@@ -371,13 +578,15 @@ namespace retracesoftware_stream {
             write_handle_ref(index);
         }
 
+        void write_new_handle_header() { emit(NewHandle); }
+
         void write_new_handle(PyObject * obj) {
-            emit(NewHandle);
+            write_new_handle_header();
             write(obj);
         }
 
         void write_stream_handle(PyObject * obj) {
-            assert(Py_TYPE(obj) == &StreamHandle_Type);
+            assert(is_stream_handle_type(Py_TYPE(obj)));
             write_handle_ref(StreamHandle_index(obj));
         }
 
@@ -401,7 +610,7 @@ namespace retracesoftware_stream {
 
             if (obj == Py_None) emit(FixedSizeTypes::NONE);
 
-            else if (Py_TYPE(obj) == &StreamHandle_Type) write_stream_handle(obj);
+            else if (is_stream_handle_type(Py_TYPE(obj))) write_stream_handle(obj);
             else if (Py_TYPE(obj) == &PyUnicode_Type) write_string(obj);
             else if (Py_TYPE(obj) == &PyLong_Type) write_int_value(obj);
 
@@ -417,6 +626,9 @@ namespace retracesoftware_stream {
 
             else if (Py_TYPE(obj) == &PyMemoryView_Type) write_memory_view(obj);
 
+            else if (is_stdlib_value(Py_TYPE(obj))) write_stdlib_value(obj);
+            else if (Py_TYPE(obj) == &PyByteArray_Type) write_bytearray(obj);
+
             else write_serialized(obj);
         }
 
@@ -456,6 +668,35 @@ namespace retracesoftware_stream {
             write(thread_handle);
         }
 
+        // One byte, or 255 followed by a uint64 (the reader's read_expected_int).
+        void write_expected_int(uint64_t value) {
+            if (value < 255) {
+                emit((uint8_t)value);
+            } else {
+                emit((uint8_t)255);
+                emit(value);
+            }
+        }
+
+        void write_add_filename_header() {
+            if (verbose) printf("ADD_FILENAME ");
+            emit(AddFilename);
+        }
+
+        // STACK: frames to drop from the innermost end, then n new frames
+        // as (filename index, line) uint16 pairs via write_stack_frame.
+        void write_stack_header(uint32_t to_drop, uint32_t n) {
+            if (verbose) printf("STACK(drop=%u, new=%u) ", to_drop, n);
+            emit(Stack);
+            write_expected_int(to_drop);
+            write_expected_int(n);
+        }
+
+        void write_stack_frame(uint32_t frame) {
+            emit((uint16_t)(frame >> 16));
+            emit((uint16_t)(frame & 0xFFFF));
+        }
+
         inline size_t get_bytes_written() const { return bytes_written; }
 
         bool is_closed() const { return writer.is_closed(); }
@@ -469,6 +710,172 @@ namespace retracesoftware_stream {
             write_pickled_value(bytes_obj);
         }
 
+        template <typename T>
+        void pack_offsets(const int64_t * values, size_t n, int64_t base) {
+            packed_scratch.resize(n * sizeof(T));
+            T * out = reinterpret_cast<T *>(packed_scratch.data());
+            for (size_t i = 0; i < n; i++) out[i] = (T)((uint64_t)values[i] - (uint64_t)base);
+        }
+
+        // Slab from ObjectWriter::push_preencoded: copy the bytes, then take
+        // the interned indexes and float context they used.
+        void write_preencoded(const uint8_t * data, size_t size) {
+            PreencodedHeader header;
+            memcpy(&header, data, sizeof(header));
+            emit_bytes(data + sizeof(header), size - sizeof(header));
+            interned_counter += header.strings;
+            if (header.floats) float_history[float_site] = header.last_float;
+        }
+
+        // Bytes snapshot from ObjectWriter::push_packed. The loops here are
+        // plain enough for the compiler to vectorize.
+        void write_packed(ExtendedTypes type, PyObject * bytes) {
+            const uint8_t * data = (const uint8_t *)PyBytes_AS_STRING(bytes);
+            size_t len = PyBytes_GET_SIZE(bytes);
+
+            switch (type) {
+                case ExtendedTypes::PACKED_INT_LIST:
+                case ExtendedTypes::PACKED_INT_TUPLE: {
+                    size_t n = len / 8;
+                    const int64_t * values = reinterpret_cast<const int64_t *>(data);
+                    int64_t lo = values[0], hi = values[0];
+                    for (size_t i = 1; i < n; i++) {
+                        lo = values[i] < lo ? values[i] : lo;
+                        hi = values[i] > hi ? values[i] : hi;
+                    }
+
+                    uint64_t range = (uint64_t)hi - (uint64_t)lo;
+                    uint8_t width = range <= UINT8_MAX ? 1 : range <= UINT16_MAX ? 2 : range <= UINT32_MAX ? 4 : 8;
+                    switch (width) {
+                        case 1: pack_offsets<uint8_t>(values, n, lo); break;
+                        case 2: pack_offsets<uint16_t>(values, n, lo); break;
+                        case 4: pack_offsets<uint32_t>(values, n, lo); break;
+                        default: pack_offsets<uint64_t>(values, n, lo); break;
+                    }
+                    write_extended(type, n);
+                    emit(width);
+                    emit(lo);
+                    emit_bytes(packed_scratch.data(), packed_scratch.size());
+                    break;
+                }
+                case ExtendedTypes::PACKED_FLOAT_LIST:
+                case ExtendedTypes::PACKED_FLOAT_TUPLE:
+                    write_extended(type, len / 8);
+                    emit_bytes(data, len);
+                    break;
+                default: {
+                    packed_scratch.assign((len + 7) / 8, 0);
+                    for (size_t i = 0; i < len; i++)
+                        packed_scratch[i >> 3] |= (uint8_t)(data[i] << (i & 7));
+                    write_extended(type, len);
+                    emit_bytes(packed_scratch.data(), packed_scratch.size());
+                    break;
+                }
+            }
+        }
+
+        void write_varint(uint64_t v) {
+            while (v >= 0x80) {
+                emit((uint8_t)(v | 0x80));
+                v >>= 7;
+            }
+            emit((uint8_t)v);
+        }
+
+        static CallArgClass call_arg_class(PyObject * obj) {
+            if (obj == Py_None) return CallArgClass::CALL_ARG_NONE;
+            if (obj == Py_True || obj == Py_False) return CallArgClass::CALL_ARG_BOOL;
+            if (Py_TYPE(obj) == &PyLong_Type) {
+                int overflow;
+                PyLong_AsLongLongAndOverflow(obj, &overflow);
+                if (!overflow) return CallArgClass::CALL_ARG_INT;
+            }
+            return CallArgClass::CALL_ARG_VALUE;
+        }
+
+        // A call through handle: the handle and its args in one record,
+        // learning the handle's arg classes so repeats skip the per-arg
+        // control bytes.
+        void write_call(int handle, PyObject * const * args, size_t nargs) {
+            call_classes.resize(nargs);
+            for (size_t i = 0; i < nargs; i++) call_classes[i] = call_arg_class(args[i]);
+
+            std::vector<uint8_t>& known = call_templates[handle];
+            if (known == call_classes) {
+                write_extended(ExtendedTypes::CALL_TEMPLATE, handle);
+            } else {
+                write_extended(ExtendedTypes::CALL_TEMPLATE_DEFINE, handle);
+                emit((uint8_t)nargs);
+                emit_bytes(call_classes.data(), nargs);
+                known = call_classes;
+            }
+            float_site = handle;
+
+            for (size_t i = 0; i < nargs; i++) {
+                switch (call_classes[i]) {
+                    case CallArgClass::CALL_ARG_NONE:
+                        break;
+                    case CallArgClass::CALL_ARG_BOOL:
+                        emit((uint8_t)(args[i] == Py_True));
+                        break;
+                    case CallArgClass::CALL_ARG_INT:
+                        write_varint(zigzag_encode(PyLong_AsLongLong(args[i])));
+                        break;
+                    default:
+                        write(args[i]);
+                        break;
+                }
+            }
+        }
+
+        void write_dict_define_shape(size_t n) { write_extended(ExtendedTypes::DICT_DEFINE_SHAPE, n); }
+        void write_dict_shape(size_t id) { write_extended(ExtendedTypes::DICT_SHAPE, id); }
+        void write_extended_header(ExtendedTypes type, size_t count) { write_extended(type, count); }
+        void write_struct(size_t id) { write_extended(ExtendedTypes::STRUCT, id); }
+        void write_timestamp(uint64_t delta) { write_extended(ExtendedTypes::TIMESTAMP, delta); }
+        void write_writer_switch(uint32_t id) { write_extended(ExtendedTypes::WRITER, id); }
+
+        // The dictionary (if any) is preloaded right after its header, at
+        // the same point in the stream where the reader preloads its copy.
+        void write_capabilities(uint64_t declared, PyObject * dictionary) {
+            uint64_t required = (declared & KNOWN_REQUIRED_CAPABILITIES) | (blobs ? CAP_BLOBS : 0);
+            write_extended(ExtendedTypes::CAPABILITIES, FORMAT_VERSION);
+            write_varint(required);
+            write_varint(declared & ~KNOWN_REQUIRED_CAPABILITIES);
+            if (!dictionary) return;
+
+            uint64_t hash = dictionary_hash(dictionary);
+            if (PyErr_Occurred()) throw nullptr;
+            emit(hash);
+            write_varint(PyTuple_GET_SIZE(dictionary));
+            for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(dictionary); i++) {
+                PyObject * str = PyTuple_GET_ITEM(dictionary, i);
+                if (!interned_index.contains(str)) interned_index[Py_NewRef(str)] = interned_counter;
+                interned_counter++;
+            }
+        }
+
+        // BUFFER is written around its class, format and shape: the header
+        // (which carries the payload size), the three values, then this.
+        void write_buffer_header(PyObject * payload) {
+            write_extended(ExtendedTypes::BUFFER, buffer_payload_size(payload));
+        }
+
+        void write_buffer_payload(PyObject * payload) {
+            if (PyMemoryView_Check(payload)) {
+                Py_buffer * view = PyMemoryView_GET_BUFFER(payload);
+                emit_bytes((const uint8_t *)view->buf, view->len);
+            } else {
+                emit_bytes((const uint8_t *)PyBytes_AS_STRING(payload), PyBytes_GET_SIZE(payload));
+            }
+        }
+
+        static Py_ssize_t buffer_payload_size(PyObject * payload) {
+            return PyMemoryView_Check(payload) ? PyMemoryView_GET_BUFFER(payload)->len : PyBytes_GET_SIZE(payload);
+        }
+
+        void write_datetime_header(PyObject * obj) { write_datetime_fields(obj); }
+
         void write_list_header(size_t n) { write_size(SizedTypes::LIST, n); }
         void write_tuple_header(size_t n) { write_size(SizedTypes::TUPLE, n); }
         void write_dict_header(size_t n) { write_size(SizedTypes::DICT, n); }
@@ -154,7 +154,7 @@ def _write_process_info(fw, info):
     """
     import json
 
-    info = {**info, 'encoding_version': 1}
+    info = {**info, 'encoding_version': _backend_mod.FORMAT_VERSION}
     json_bytes = json.dumps(info, separators=(',', ':')).encode('utf-8')
     fw.write(json_bytes)
     fw.write(b'\n')
@@ -215,6 +215,34 @@ def read_process_info(path, raw=False):
     return info, file_offset
 
 
+def build_dictionary(values, size=1024):
+    """Pick a preset string dictionary from values read out of past traces.
+
+    Counts the identifier-like strings (names, dotted names, keys) found
+    in *values* and their nested lists, tuples and dicts, and returns up
+    to *size* of those seen more than once, most bytes saved first. Pass
+    the result as ``dictionary=`` to both ``writer`` and ``reader``.
+    """
+    from collections import Counter
+
+    counts = Counter()
+    pending = list(values)
+    while pending:
+        value = pending.pop()
+        if type(value) is str:
+            if 1 < len(value) <= 256 and value.replace('.', '_').isidentifier():
+                counts[value] += 1
+        elif isinstance(value, (list, tuple)):
+            pending.extend(value)
+        elif isinstance(value, dict):
+            pending.extend(value.keys())
+            pending.extend(value.values())
+
+    scored = sorted(((count * len(s), s) for s, count in counts.items() if count > 1),
+                    reverse=True)
+    return tuple(s for _, s in scored[:size])
+
+
 class writer(_backend_mod.ObjectWriter):
 
     def __init__(self, path=None, thread=None, output=None,
@@ -228,7 +256,21 @@ class writer(_backend_mod.ObjectWriter):
                  return_queue_capacity=None,
                  quit_on_error=False,
                  serialize_errors=True,
-                 raw=False):
+                 raw=False,
+                 blob_path=None,
+                 blob_threshold=None,
+                 promote_threshold=None,
+                 promote_budget=None,
+                 capture_stacks=False,
+                 timestamps=False,
+                 dictionary=None,
+                 patch_containers=False,
+                 one_level_containers=False,
+                 pool_threads=None,
+                 cpus=None,
+                 sched=None,
+                 nice=None,
+                 thread_name=None):
 
         self._fw = None
 
@@ -237,9 +279,23 @@ class writer(_backend_mod.ObjectWriter):
             self._fw = fw
 
             if preamble is not None:
+                if dictionary is not None:
+                    preamble = {**preamble,
+                                'dictionary': format(dictionary_hash(dictionary), '016x')}
                 _write_process_info(fw, preamble)
 
-            output = _backend_mod.AsyncFilePersister(fw)
+            persister_kwargs = {}
+            if blob_path is not None:
+                persister_kwargs['blob_path'] = str(blob_path)
+            if blob_threshold is not None:
+                persister_kwargs['blob_threshold'] = blob_threshold
+            if pool_threads is not None:
+                persister_kwargs['pool_threads'] = pool_threads
+            for name, value in (('cpus', cpus), ('sched', sched),
+                                ('nice', nice), ('thread_name', thread_name)):
+                if value is not None:
+                    persister_kwargs[name] = value
+            output = _backend_mod.AsyncFilePersister(fw, **persister_kwargs)
 
         self._output = output
         self._disable_retrace = disable_retrace
@@ -259,6 +315,20 @@ class writer(_backend_mod.ObjectWriter):
             kwargs['quit_on_error'] = quit_on_error
         if not serialize_errors:
             kwargs['serialize_errors'] = False
+        if promote_threshold is not None:
+            kwargs['promote_threshold'] = promote_threshold
+        if promote_budget is not None:
+            kwargs['promote_budget'] = promote_budget
+        if capture_stacks:
+            kwargs['capture_stacks'] = True
+        if timestamps:
+            kwargs['timestamps'] = True
+        if dictionary is not None:
+            kwargs['dictionary'] = dictionary
+        if patch_containers:
+            kwargs['patch_containers'] = True
+        if one_level_containers:
+            kwargs['one_level_containers'] = True
 
         super().__init__(output, **kwargs)
 
@@ -377,6 +447,17 @@ class Heartbeat(Control):
     pass
 
 
+class StackDelta(Control):
+    """Change in the recording thread's stack before the next message:
+    drop *to_drop* innermost frames, then append *frames*, a list of
+    (filename, lineno) outermost first."""
+
+    def __init__(self, to_drop, frames):
+        super().__init__(frames)
+        self.to_drop = to_drop
+        self.frames = frames
+
+
 def _resolve_binds(source):
     """Wrap *source* so that Bind markers are resolved immediately.
 
@@ -410,17 +491,25 @@ def per_thread(source, thread, timeout):
 
 class reader(_backend_mod.ObjectStreamReader):
 
-    def __init__(self, path, read_timeout, verbose, start_offset=0, raw=False):
+    def __init__(self, path, read_timeout, verbose, start_offset=0, raw=False,
+                 blob_path=None, dictionary=None):
+        kwargs = {}
+        if blob_path is not None:
+            kwargs['blob_path'] = str(blob_path)
+        if dictionary is not None:
+            kwargs['dictionary'] = dictionary
+
         super().__init__(
             path=str(path),
             deserialize=self.deserialize,
             bind_singleton=Bind(self.bind),
             on_thread_switch=ThreadSwitch,
-            create_stack_delta=lambda to_drop, frames: None,
+            create_stack_delta=StackDelta,
             read_timeout=read_timeout,
             verbose=verbose,
             on_heartbeat=Heartbeat,
-            start_offset=start_offset)
+            start_offset=start_offset,
+            **kwargs)
 
         self.type_deserializer = {}
 
@@ -198,3 +198,20 @@ def test_inflight_no_data_loss_under_pressure(tmp_path):
     assert len(vals) == count
     for i, v in enumerate(vals):
         assert v == f"pressure_{i:05d}", f"Mismatch at index {i}: {v!r}"
+
+
+def test_burst_grows_queue_past_capacity(tmp_path):
+    """A burst far beyond queue_capacity entries round-trips without stalling."""
+    path = tmp_path / "trace.bin"
+    burst = [(i, -i) for i in range(100000)]
+
+    with stream.writer(path, thread=_thread_id, queue_capacity=16, stall_timeout=1,
+                       raw=True) as w:
+        w(burst)
+        w("after")
+        w.flush()
+
+    with stream.reader(path=path, read_timeout=1, verbose=False) as r:
+        vals = _read_values(r)
+
+    assert vals == [burst, "after"]
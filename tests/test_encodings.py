@@ -0,0 +1,895 @@
+"""Roundtrip and size tests for the compact wire encodings."""
+import copy
+import dataclasses
+import enum
+import sys
+
+import pytest
+
+pytest.importorskip("retracesoftware.stream")
+import retracesoftware.stream as stream
+
+
+def _thread_id() -> str:
+    return "main-thread"
+
+
+def _read_value(reader):
+    """Read the next non-control value from reader."""
+    while True:
+        val = reader()
+        if not isinstance(val, stream.Control):
+            return val
+
+
+def _roundtrip(tmp_path, values, **writer_kwargs):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       **writer_kwargs) as writer:
+        for val in values:
+            writer(val)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        result = [_read_value(reader) for _ in values]
+
+    return result, path.stat().st_size
+
+
+def test_negative_ints_roundtrip(tmp_path):
+    values = [-2, -11, -12, -128, -255, -256, -65536, -(2**31), -(2**32),
+              -(2**62), -(2**63), -(2**63) + 1, -(2**64), -1, 0, 2**63 - 1]
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
+
+
+def test_small_negative_ints_are_compact(tmp_path):
+    values = [-2, -3, -4, -5, -6] * 200
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    # one control byte each (the zigzag value fits inline), plus a
+    # little slack for heartbeats
+    assert size < 2 * len(values)
+
+
+def test_floats_roundtrip(tmp_path):
+    import math
+    values = [0.0, -0.0, 1.0, -1.0, 0.5, 1e300, -1e-300, 2.0**53, 2.0**53 + 2,
+              -(2.0**53), 3.14159, float("inf"), float("-inf"), 1.5e38, 5e-324,
+              1.0, 1.0, 1.0000000000000002]
+
+    result, _ = _roundtrip(tmp_path, values + [float("nan")])
+    assert math.isnan(result[-1])
+    for expected, got in zip(values, result):
+        assert got == expected
+        assert math.copysign(1, got) == math.copysign(1, expected)
+
+
+def test_integral_floats_are_compact(tmp_path):
+    values = [float(i) for i in range(1000)]
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    # control + type byte, and at most two size bytes, each
+    assert size < 5 * len(values)
+
+
+def test_slowly_changing_floats_use_xor(tmp_path):
+    base = 1_700_000_000.123
+    values = [base + i * 2**-10 for i in range(1000)]
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    assert size < 8 * len(values)
+
+
+@pytest.mark.parametrize("values", [
+    list(range(-50, 50)),
+    tuple(range(1000, 1100)),
+    [2**63 - 1, -(2**63)] * 10,
+    [i * 0.25 for i in range(64)],
+    tuple(float(i) / 3 for i in range(20)),
+    [i % 3 == 0 for i in range(37)],
+    tuple([True] * 16),
+])
+def test_packed_arrays_roundtrip(tmp_path, values):
+    result, _ = _roundtrip(tmp_path, [values, values])
+    assert result == [values, values]
+    assert all(type(r) is type(values) for r in result)
+    assert all(type(x) is type(values[0]) for x in result[0])
+
+
+def test_mixed_and_overflowing_lists_are_not_packed(tmp_path):
+    values = [[1] * 20 + [1.0], [2**64] + [1] * 20, [True] + [1] * 20, list(range(5))]
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
+    assert [type(x) for x in result[2]] == [type(x) for x in values[2]]
+
+
+def test_packed_int_list_is_compact(tmp_path):
+    values = [list(range(200)) for _ in range(20)]
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    assert size < 1.2 * 200 * len(values)
+
+
+def test_dict_shapes_roundtrip(tmp_path):
+    values = [{"a": i, "b": str(i), "c": [i]} for i in range(5)]
+    values += [{"b": 1, "a": 2, "c": 3}, {"a": 1, "b": 2}, {1: "x", "a": 2}, {}]
+    values += [{"a": {"a": 1, "b": 2, "c": 3}, "b": None, "c": 0.5}] * 3
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
+    assert [list(d) for d in result] == [list(d) for d in values]
+
+
+@pytest.mark.parametrize("patch_containers", [False, True])
+def test_nested_dict_shapes_roundtrip(tmp_path, patch_containers):
+    """A dict defining a shape around one that defines another keeps
+    the two ids apart, so later repeats read back with their own keys."""
+    wide = {f"k{i}": i for i in range(20)}
+    wide["inner"] = {"x": 0}
+    values = [{"a": {"b": 1}, "c": 2}, {"outer": {"k0": 1}}, wide] * 3
+
+    result, _ = _roundtrip(tmp_path, values, patch_containers=patch_containers)
+    assert result == values
+    assert [list(d) for d in result] == [list(d) for d in values]
+
+
+def test_repeated_dict_shapes_are_compact(tmp_path):
+    keys = [f"field_{i}" for i in range(8)]
+    records = [dict.fromkeys(keys, i) for i in range(500)]
+
+    (tmp_path / "plain").mkdir()
+    (tmp_path / "shaped").mkdir()
+    _, plain = _roundtrip(tmp_path / "plain", [list(r.items()) for r in records])
+    result, shaped = _roundtrip(tmp_path / "shaped", records)
+    assert result == records
+    assert shaped < 0.7 * plain
+
+
+def _record_calls(tmp_path, calls):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True) as writer:
+        handles = {}
+        for name, args in calls:
+            if name not in handles:
+                handles[name] = writer.handle(name)
+            handles[name](*args)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        result = []
+        for _, args in calls:
+            result.append((_read_value(reader), tuple(_read_value(reader) for _ in args)))
+
+    return result, path.stat().st_size
+
+
+def test_call_templates_roundtrip(tmp_path):
+    calls = [
+        ("f", (1, None, True, 2.5, "s")),
+        ("f", (-7, None, False, 0.1, "s")),
+        ("g", (2**70, b"x", [1, 2])),
+        ("f", (1, 2, 3, 4, 5)),
+        ("f", (None, None, None, None, None)),
+        ("g", ()),
+        ("f", (3, None, True, 1.5, "t")),
+    ]
+
+    result, _ = _record_calls(tmp_path, calls)
+    assert result == calls
+
+
+def test_repeated_calls_are_compact(tmp_path):
+    calls = [("f", (i, 2 * i)) for i in range(1000)]
+
+    result, size = _record_calls(tmp_path, calls)
+    assert result == calls
+    # opcode, handle and type byte, then two 2-byte varints; the untemplated
+    # encoding needs a handle ref plus control and size bytes per int (7)
+    assert size < 6.5 * len(calls)
+
+
+def test_calls_with_promoted_args_roundtrip(tmp_path):
+    """A hot str argument goes out as a handle, so the call can't use
+    the one-word-per-argument form."""
+    path = tmp_path / "trace.bin"
+
+    text = "".join(["q-"] * 50)
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       promote_threshold=2) as writer:
+        f = writer.handle("f")
+        for i in range(5):
+            f(text, i)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        result = [(_read_value(reader), _read_value(reader), _read_value(reader)) for _ in range(5)]
+
+    assert result == [("f", "q-" * 50, i) for i in range(5)]
+
+
+def test_calls_after_promoted_evictions_roundtrip(tmp_path):
+    """Promoted handles evicted over budget are deleted before a call,
+    not between its handle and arguments."""
+    path = tmp_path / "trace.bin"
+    expected = []
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       promote_threshold=2, promote_budget=200) as writer:
+        f = writer.handle("f")
+        for n in range(20):
+            # Promoted on its second write, so the budget is first found
+            # exceeded at the call that follows.
+            text = str(n % 10) * 64
+            for _ in range(2):
+                writer(text)
+                expected.append(text)
+            f(n, 1.5)
+            expected += ["f", n, 1.5]
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        assert [_read_value(reader) for _ in expected] == expected
+
+
+def test_large_payloads_go_to_blob_file(tmp_path):
+    path = tmp_path / "trace.bin"
+    blobs = tmp_path / "trace.blobs"
+    body = b"x" * 10000
+    text = "y" * 10000
+    values = [body, text, body, text, b"small", "small", text]
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       blob_path=blobs, blob_threshold=1024) as writer:
+        for val in values:
+            writer(val)
+        writer.flush()
+
+    assert path.stat().st_size < 500
+    # one record per distinct payload: 16-byte header + data
+    assert blobs.stat().st_size == 2 * (16 + 10000)
+
+    with stream.reader(path, read_timeout=1, verbose=False, blob_path=blobs) as reader:
+        assert [_read_value(reader) for _ in values] == values
+
+
+def test_blob_file_with_partial_record_is_not_appended_to(tmp_path):
+    path = tmp_path / "trace.bin"
+    blobs = tmp_path / "trace.blobs"
+    # A record cut short, as a failed or interrupted append leaves it.
+    partial = (1).to_bytes(8, "little") + (10000).to_bytes(8, "little") + b"x" * 100
+    blobs.write_bytes(partial)
+    values = [b"x" * 10000, "y" * 10000]
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       blob_path=blobs, blob_threshold=1024) as writer:
+        for val in values:
+            writer(val)
+        writer.flush()
+
+    assert blobs.read_bytes() == partial
+    with stream.reader(path, read_timeout=1, verbose=False, blob_path=blobs) as reader:
+        assert [_read_value(reader) for _ in values] == values
+
+
+def test_hot_immutables_are_promoted_to_handles(tmp_path):
+    config = ("production", "x" * 100, (1, 2.5, b"y" * 40))
+    text = "z" * 200
+    values = [[config, text, i] for i in range(200)] + [config]
+
+    (tmp_path / "plain").mkdir()
+    (tmp_path / "promoted").mkdir()
+    _, plain = _roundtrip(tmp_path / "plain", values)
+    result, promoted = _roundtrip(tmp_path / "promoted", values, promote_threshold=3)
+    assert result == values
+    assert promoted < plain / 5
+
+
+def test_promoted_handles_are_evicted_over_budget(tmp_path):
+    values = []
+    for n in range(20):
+        text = str(n) * 64
+        values += [text] * 5
+
+    result, _ = _roundtrip(tmp_path, values, promote_threshold=2, promote_budget=200)
+    assert result == values
+
+
+class _Point:
+    pass
+
+
+def test_types_are_sent_once_as_handles(tmp_path):
+    values = [_Point, int, [_Point, dict], _Point] * 50
+
+    (tmp_path / "one").mkdir()
+    (tmp_path / "many").mkdir()
+    _, one = _roundtrip(tmp_path / "one", values[:1])
+    result, size = _roundtrip(tmp_path / "many", values)
+    assert result == values
+    # each later sighting is a two-byte handle ref, not another pickle
+    assert size < one + 4 * len(values)
+
+
+class _Color(enum.Enum):
+    RED = "red"
+    BLUE = (0, 0, 255)
+
+
+def test_enum_members_roundtrip(tmp_path):
+    import http
+    import re
+    import signal
+    import socket
+
+    values = [socket.AF_INET, http.HTTPStatus.NOT_FOUND, signal.SIGTERM,
+              re.IGNORECASE | re.MULTILINE, [re.IGNORECASE, re.ASCII],
+              _Color.RED, _Color.BLUE, socket.AF_INET, enum.Flag]
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
+    assert all(r is v for r, v in zip(result, values) if isinstance(v, enum.Enum))
+
+
+def test_enum_members_are_compact(tmp_path):
+    import http
+    values = [http.HTTPStatus.OK, http.HTTPStatus.NOT_FOUND] * 500
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    # EXTENDED control and type bytes, a handle ref and a small int
+    assert size < 6 * len(values)
+
+
+def test_stdlib_value_types_roundtrip(tmp_path):
+    import datetime
+    import decimal
+    import uuid
+    zoneinfo = pytest.importorskip("zoneinfo")
+
+    utc = datetime.timezone.utc
+    try:
+        london = zoneinfo.ZoneInfo("Europe/London")
+    except zoneinfo.ZoneInfoNotFoundError:
+        london = datetime.timezone(datetime.timedelta(hours=1), "BST")
+
+    values = [
+        complex(1.5, -2.0), 1j,
+        datetime.date(2024, 2, 29), datetime.date.min, datetime.date.max,
+        datetime.datetime(2024, 5, 17, 13, 45, 12, 123456),
+        datetime.datetime(2024, 5, 17, 13, 45, tzinfo=utc),
+        datetime.datetime(2024, 5, 17, tzinfo=datetime.timezone(datetime.timedelta(hours=-5), "EST")),
+        datetime.datetime(2024, 10, 27, 1, 30, fold=1, tzinfo=london),
+        datetime.datetime(2024, 10, 27, 1, 30, tzinfo=london),
+        datetime.datetime.max, datetime.datetime.min,
+        datetime.timedelta(days=-3, seconds=5, microseconds=7), datetime.timedelta.max,
+        utc, datetime.timezone(datetime.timedelta(minutes=330)),
+        decimal.Decimal("3.14159"), decimal.Decimal("-0.000"), decimal.Decimal("1E+30"),
+        decimal.Decimal("12345678901234567890.123456789"), decimal.Decimal("-Infinity"),
+        uuid.UUID("12345678-1234-5678-1234-567812345678"), uuid.uuid4(),
+        bytearray(b"mutable"), bytearray(),
+        [datetime.date(2000, 1, 1), {"at": datetime.datetime(2000, 1, 1, tzinfo=utc)}],
+    ]
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
+    assert [type(r) for r in result] == [type(v) for v in values]
+    for got, expected in zip(result, values):
+        if isinstance(expected, datetime.datetime):
+            assert got.tzinfo == expected.tzinfo
+            assert got.fold == expected.fold
+        if isinstance(expected, decimal.Decimal):
+            assert got.as_tuple() == expected.as_tuple()
+
+
+def test_decimal_nans_roundtrip(tmp_path):
+    import decimal
+    values = [decimal.Decimal("NaN"), decimal.Decimal("-sNaN123")]
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert [r.as_tuple() for r in result] == [v.as_tuple() for v in values]
+
+
+def test_bytearray_is_copied_when_written(tmp_path):
+    path = tmp_path / "trace.bin"
+    data = bytearray(b"before")
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True) as writer:
+        writer(data)
+        data[:] = b"after!"
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        assert _read_value(reader) == bytearray(b"before")
+
+
+def test_stdlib_value_types_are_compact(tmp_path):
+    import datetime
+    import uuid
+    start = datetime.datetime(2024, 1, 1, tzinfo=datetime.timezone.utc)
+    values = [(start + datetime.timedelta(seconds=i), uuid.UUID(int=i)) for i in range(500)]
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    # tuple header; datetime: 2+3 date, 6 time, 6 tz; uuid: 2+16
+    assert size < 40 * len(values)
+
+
+class _CustomError(Exception):
+    def __init__(self, code, message):
+        super().__init__(code, message)
+        self.code = code
+
+
+def test_exceptions_roundtrip(tmp_path):
+    import errno
+    values = [
+        ValueError("bad value"), KeyError("missing"), RuntimeError(),
+        ConnectionRefusedError(errno.ECONNREFUSED, "Connection refused"),
+        FileNotFoundError(errno.ENOENT, "No such file", "/tmp/x"),
+        OSError(errno.EXDEV, "Cross-device link", "/a", None, "/b"),
+        StopIteration(42), UnicodeDecodeError("utf-8", b"\xff", 0, 1, "invalid start byte"),
+        _CustomError(3, "custom"),
+        [TimeoutError("t")] * 3,
+    ]
+
+    result, _ = _roundtrip(tmp_path, values)
+
+    def key(exc):
+        if isinstance(exc, list):
+            return [key(e) for e in exc]
+        fields = (type(exc), exc.args)
+        if isinstance(exc, OSError):
+            fields += (exc.errno, exc.strerror, exc.filename, exc.filename2)
+        return fields + (getattr(exc, "code", None),)
+
+    assert [key(r) for r in result] == [key(v) for v in values]
+
+
+def test_repeated_exceptions_are_compact(tmp_path):
+    import errno
+    values = [ConnectionRefusedError(errno.ECONNREFUSED, "Connection refused")] * 1000
+
+    result, size = _roundtrip(tmp_path, values)
+    assert all(type(r) is ConnectionRefusedError and r.errno == errno.ECONNREFUSED for r in result)
+    # the strerror string dominates; pickling each costs 77 bytes
+    assert size < 40 * len(values)
+
+
+@dataclasses.dataclass
+class _Row:
+    id: int
+    name: str
+    tags: list = dataclasses.field(default_factory=list)
+
+
+@dataclasses.dataclass(frozen=True, slots=True)
+class _Point3:
+    x: float
+    y: float
+    z: float
+
+
+class _Slotted:
+    __slots__ = ("a", "b")
+
+    def __init__(self, a, b):
+        self.a = a
+        self.b = b
+
+    def __eq__(self, other):
+        return type(other) is _Slotted and (self.a, self.b) == (other.a, other.b)
+
+
+def _struct_roundtrip(tmp_path, values):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True) as writer:
+        writer.register_struct(_Row, ["id", "name", "tags"])
+        writer.register_struct(_Point3, ("x", "y", "z"))
+        writer.register_struct(_Slotted, ["a", "b"])
+        for val in values:
+            writer(val)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        result = [_read_value(reader) for _ in values]
+
+    return result, path.stat().st_size
+
+
+def test_registered_structs_roundtrip(tmp_path):
+    values = [_Row(1, "a", ["x"]), _Point3(1.0, 2.5, -3.0), _Slotted(1, _Slotted("n", None)),
+              _Row(2, "b"), [_Point3(0.0, 0.0, 0.0)] * 3, {"row": _Row(3, "c", [_Row(4, "d")])}]
+
+    result, _ = _struct_roundtrip(tmp_path, values)
+    assert result == values
+
+
+def test_unset_struct_fields_fall_back_to_serializer(tmp_path):
+    partial = _Slotted.__new__(_Slotted)
+    partial.a = 1
+    result, _ = _struct_roundtrip(tmp_path, [partial, _Slotted(2, 3)])
+    assert result[1] == _Slotted(2, 3)
+
+
+def test_registered_structs_are_compact(tmp_path):
+    values = [_Point3(float(i), 0.5, -1.0) for i in range(500)]
+
+    result, size = _struct_roundtrip(tmp_path, values)
+    assert result == values
+    # two header bytes and three floats; pickle needs over 100 bytes each
+    assert size < 16 * len(values)
+
+
+def test_register_struct_rejects_bad_fields(tmp_path):
+    with stream.writer(tmp_path / "trace.bin", thread=_thread_id, raw=True) as writer:
+        with pytest.raises(TypeError):
+            writer.register_struct(_Slotted, ["missing"])
+        with pytest.raises(ValueError):
+            writer.register_struct(_Row, [])
+        with pytest.raises(TypeError):
+            writer.register_struct(_Row(1, "a"), ["id"])
+
+
+def test_arrays_roundtrip(tmp_path):
+    import array
+    values = [array.array("d", [1.5, -2.0, 3.25]), array.array("i", range(-5, 5)),
+              array.array("B"), array.array("u", "héllo"), array.array("q", [2**62] * 1000)]
+
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
+    assert [r.typecode for r in result] == [v.typecode for v in values]
+
+
+def test_array_is_copied_when_written(tmp_path):
+    import array
+    path = tmp_path / "trace.bin"
+    data = array.array("i", [1, 2, 3])
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True) as writer:
+        writer(data)
+        data[0] = 100
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        assert _read_value(reader) == array.array("i", [1, 2, 3])
+
+
+def test_large_array_is_compact(tmp_path):
+    import array
+    values = [array.array("d", [float(i) for i in range(100000)])]
+
+    result, size = _roundtrip(tmp_path, values)
+    assert result == values
+    assert size < 800000 + 200
+
+
+def test_numpy_arrays_roundtrip(tmp_path):
+    np = pytest.importorskip("numpy")
+    readonly = np.arange(12, dtype=np.int16).reshape(3, 4)
+    readonly.flags.writeable = False
+    values = [np.linspace(0, 1, 7), np.eye(3, dtype=">f4")[:, ::2], readonly,
+              np.zeros((0, 5), dtype=np.uint8)]
+
+    result, _ = _roundtrip(tmp_path, values)
+    for got, expected in zip(result, values):
+        assert type(got) is np.ndarray
+        assert got.dtype == expected.dtype
+        assert got.shape == expected.shape
+        assert np.array_equal(got, expected)
+
+
+def _read_with_stacks(reader, n):
+    """Read n values, replaying StackDeltas into the stack current at each."""
+    stack, result = [], []
+    while len(result) < n:
+        val = reader()
+        if isinstance(val, stream.StackDelta):
+            del stack[len(stack) - val.to_drop:]
+            stack.extend(val.frames)
+        elif not isinstance(val, stream.Control):
+            result.append((val, list(stack)))
+    return result
+
+
+def _caller_stack(expected, value):
+    """Record the caller's stack, outermost first, and pass value through."""
+    frames = []
+    frame = sys._getframe(1)
+    while frame:
+        frames.append((stream.normalize_path(frame.f_code.co_filename), frame.f_lineno))
+        frame = frame.f_back
+    expected.append(frames[::-1])
+    return value
+
+
+def test_captured_stacks_roundtrip(tmp_path):
+    path = tmp_path / "trace.bin"
+    expected = []
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       capture_stacks=True) as writer:
+        def inner(value):
+            writer(_caller_stack(expected, value))
+
+        def outer():
+            for i in range(3):
+                inner(i)
+            writer(_caller_stack(expected, "shallower"))
+            inner("deeper")
+
+        outer()
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        result = _read_with_stacks(reader, 5)
+
+    assert [value for value, _ in result] == [0, 1, 2, "shallower", "deeper"]
+    assert [stack for _, stack in result] == expected
+
+def test_unchanged_stack_is_not_resent(tmp_path):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       capture_stacks=True) as writer:
+        for i in range(100):
+            writer(i)
+        writer.flush()
+
+    deltas = 0
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        values = []
+        while len(values) < 100:
+            val = reader()
+            if isinstance(val, stream.StackDelta):
+                deltas += 1
+            elif not isinstance(val, stream.Control):
+                values.append(val)
+
+    assert values == list(range(100))
+    assert deltas == 1
+
+
+def test_timestamps_track_message_times(tmp_path):
+    import time
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       timestamps=True) as writer:
+        for i in range(3):
+            time.sleep(0.05)
+            writer(i)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        stamps = []
+        for i in range(3):
+            assert _read_value(reader) == i
+            stamps.append(reader.last_timestamp)
+
+    assert stamps[0] >= 40000
+    for earlier, later in zip(stamps, stamps[1:]):
+        assert 40000 <= later - earlier < 1000000
+
+
+def test_timestamps_cost_nothing_within_a_tick(tmp_path):
+    values = list(range(1000))
+    (tmp_path / "plain").mkdir()
+    (tmp_path / "stamped").mkdir()
+    result, plain = _roundtrip(tmp_path / "plain", values)
+    assert result == values
+
+    result, stamped = _roundtrip(tmp_path / "stamped", values, timestamps=True)
+    assert result == values
+    assert stamped - plain < 200
+
+
+def test_trace_declares_its_capabilities(tmp_path):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       timestamps=True) as writer:
+        writer("value")
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        assert _read_value(reader) == "value"
+        assert reader.format_version == stream.FORMAT_VERSION
+        assert reader.capabilities == stream.CAP_TIMESTAMPS
+
+
+def test_blob_trace_needs_blob_path(tmp_path):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       blob_path=tmp_path / "trace.blobs") as writer:
+        writer("small")
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        with pytest.raises(RuntimeError, match="blob_path"):
+            reader()
+
+
+_DICTIONARY_NAMES = tuple(sys.intern(f"field_name_{i}") for i in range(50))
+
+
+def test_preset_dictionary_roundtrip(tmp_path):
+    values = [{name: i for i, name in enumerate(_DICTIONARY_NAMES)}, "field_name_3"]
+    (tmp_path / "plain").mkdir()
+    (tmp_path / "preset").mkdir()
+    dictionary = stream.build_dictionary(values * 2)
+
+    result, plain = _roundtrip(tmp_path / "plain", values)
+    assert result == values
+
+    path = tmp_path / "preset" / "trace.bin"
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       dictionary=dictionary) as writer:
+        for val in values:
+            writer(val)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False,
+                       dictionary=dictionary) as reader:
+        assert [_read_value(reader) for _ in values] == values
+        assert reader.capabilities & stream.CAP_DICTIONARY
+
+    assert set(dictionary) == set(_DICTIONARY_NAMES)
+    assert path.stat().st_size < plain - 500
+
+
+def test_preset_dictionary_must_match(tmp_path):
+    path = tmp_path / "trace.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       dictionary=_DICTIONARY_NAMES) as writer:
+        writer(_DICTIONARY_NAMES[0])
+        writer.flush()
+
+    for dictionary in (None, _DICTIONARY_NAMES[1:]):
+        with stream.reader(path, read_timeout=1, verbose=False,
+                           dictionary=dictionary) as reader:
+            with pytest.raises(RuntimeError, match="preset dictionary"):
+                reader()
+
+
+def _snapshots_roundtrip(tmp_path, container, steps, **writer_kwargs):
+    """Write container after each step that changes it in place."""
+    path = tmp_path / "trace.bin"
+    expected = []
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       **writer_kwargs) as writer:
+        for step in steps:
+            step(container)
+            expected.append(copy.deepcopy(container))
+            writer(container)
+        writer.flush()
+
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        result = []
+        for _ in steps:
+            value = _read_value(reader)
+            result.append(copy.deepcopy(value))
+            value.clear()   # callers own what they are given
+
+    return result, expected, path.stat().st_size
+
+
+def test_patched_dicts_roundtrip(tmp_path):
+    env = {f"VAR_{i}": f"value-{i}" * 4 for i in range(200)}
+
+    def set_key(i):
+        return lambda d: d.__setitem__(f"VAR_{i % 7}", f"changed-{i}")
+
+    steps = [lambda d: None] + [set_key(i) for i in range(50)]
+    steps += [lambda d: d.pop("VAR_100"), lambda d: d.__setitem__("NEW", [1, 2]),
+              lambda d: d.clear() or d.update({f"K{i}": i for i in range(20)})]
+
+    (tmp_path / "plain").mkdir()
+    (tmp_path / "patched").mkdir()
+    result, expected, plain = _snapshots_roundtrip(tmp_path / "plain", dict(env), steps)
+    assert result == expected
+    result, expected, patched = _snapshots_roundtrip(tmp_path / "patched", dict(env), steps,
+                                                     patch_containers=True)
+    assert result == expected
+    assert patched * 10 < plain
+
+
+def test_patched_lists_roundtrip(tmp_path):
+    steps = [lambda l: l.extend(range(20))] + [lambda l: l.append("x" * 40)] * 30
+    steps += [lambda l: l.__setitem__(0, "front"), lambda l: l.__delitem__(slice(5, None))]
+
+    (tmp_path / "plain").mkdir()
+    (tmp_path / "patched").mkdir()
+    result, expected, plain = _snapshots_roundtrip(tmp_path / "plain", [], steps)
+    assert result == expected
+    result, expected, patched = _snapshots_roundtrip(tmp_path / "patched", [], steps,
+                                                     patch_containers=True)
+    assert result == expected
+    assert patched * 3 < plain
+
+
+def test_patch_bases_are_released(tmp_path):
+    import sys
+    # A float per container that only it (and its snapshot) refers to.
+    markers = [float(i) + 0.5 for i in range(300)]
+    containers = [{"marker": markers[i], **{f"k{j}": j for j in range(16)}}
+                  for i in range(300)]
+    baseline = [sys.getrefcount(c) for c in containers]
+    marker_baseline = [sys.getrefcount(m) for m in markers]
+    path = tmp_path / "evict.bin"
+
+    with stream.writer(path, thread=_thread_id, flush_interval=0.01, raw=True,
+                       patch_containers=True) as writer:
+        for c in containers:
+            writer(c)
+        writer(None)        # eviction runs between root values
+        writer.flush()
+
+        # Writing holds other references too; a kept base adds one to its
+        # container and its snapshot one to the marker.
+        held = [sys.getrefcount(c) - b for c, b in zip(containers, baseline)]
+        marked = [sys.getrefcount(m) - b for m, b in zip(markers, marker_baseline)]
+        # The oldest go once MAX_PATCH_BASES (256) are held, with their snapshots.
+        # (The newest is left out: the writer may still hold its last value.)
+        assert set(held[44:-1]) == {held[44]} and set(marked[44:-1]) == {marked[44]}
+        assert held[:44] == [held[44] - 1] * 44
+        assert marked[:44] == [marked[44] - 1] * 44
+
+    values = containers * 2
+    result, _ = _roundtrip(tmp_path, values, patch_containers=True)
+    assert result == values
+
+
+def test_one_level_containers_roundtrip(tmp_path):
+    values = [
+        {"config": {"db": {"host": "localhost", "port": 5432}}, "n": 1},
+        [[1, 2], [3, [4, 5]], {"a": []}],
+        ({"x": [1]}, "tail"),
+        {"flat": 1, "also": "flat"},
+        [],
+    ]
+    result, _ = _roundtrip(tmp_path, values, one_level_containers=True)
+    assert result == values
+
+
+def test_one_level_containers_keep_identity(tmp_path):
+    cyclic = {"name": "root"}
+    cyclic["self"] = cyclic
+    shared = {"x": 1}
+    looped = [1]
+    looped.append(looped)
+
+    result, _ = _roundtrip(tmp_path, [cyclic, [shared, shared], looped],
+                           one_level_containers=True)
+
+    assert result[0]["self"] is result[0]
+    assert result[0]["name"] == "root"
+    assert result[1][0] is result[1][1] and result[1][0] == shared
+    assert result[2][1] is result[2] and result[2][0] == 1
+
+
+def test_preencoded_scalar_containers_roundtrip(tmp_path):
+    mixed = [i if i % 5 else None for i in range(-40, 40)]
+    mixed += [1.5, -0.0, 3.0, 1e300, float("inf"), True, False, -1, 2 ** 63 - 1]
+    mixed += [f"item-{i}" for i in range(10)]
+    table = {f"key-{i}": (i * 0.25 if i % 2 else f"v{i}") for i in range(100)}
+    name = sys.intern("preencoded-name")
+
+    # Interned strings and floats after the slabs must still line up with
+    # the reader's interned indexes and float context.
+    values = [mixed, table, name, 2.75, [mixed, table], name, 2.5]
+    values += [list(mixed) for _ in range(100)]
+    result, _ = _roundtrip(tmp_path, values)
+    assert result == values
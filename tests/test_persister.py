@@ -209,3 +209,332 @@ def test_path_getter(tmp_path):
     fw = FramedWriter(str(path))
     assert fw.path == str(path)
     fw.close()
+
+
+# ---------------------------------------------------------------------------
+# Several writers sharing one persister
+# ---------------------------------------------------------------------------
+
+def _read_by_writer(path, count):
+    """Read count values, grouped by the writer_id each was read under."""
+    by_writer = {}
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        while count:
+            val = reader()
+            if isinstance(val, stream.Control):
+                continue
+            by_writer.setdefault(reader.writer_id, []).append(val)
+            count -= 1
+    return by_writer
+
+
+def test_writers_share_one_persister(tmp_path):
+    """Each writer's values come back in order, with its own string and
+    handle tables, however the persister interleaved them."""
+    path = tmp_path / "out.bin"
+    fw = FramedWriter(str(path), raw=True)
+    p = AsyncFilePersister(fw)
+    a = stream.writer(output=p, thread=_thread_id, flush_interval=999)
+    b = stream.writer(output=p, thread=_thread_id, flush_interval=999)
+
+    sent_a, sent_b = [], []
+    for i in range(500):
+        sent_a.append(f"name_{i % 7}")
+        a(sent_a[-1])
+        sent_b.append({"name": f"name_{i % 5}", "i": i, "f": i / 4})
+        b(sent_b[-1])
+
+    for w in (a, b):
+        w.flush()
+        w.disable()
+    p.close()
+    fw.close()
+
+    assert _read_by_writer(path, len(sent_a) + len(sent_b)) == {0: sent_a, 1: sent_b}
+
+
+def test_shared_persister_keeps_each_writers_thread(tmp_path):
+    """Values are credited to the thread that wrote them when writers on
+    different threads take turns on the wire."""
+    import ctypes
+    import pickle
+
+    # The persister finds a thread's handle in its thread-state dict,
+    # under the writer's thread callable. The dict is borrowed.
+    get_thread_dict = ctypes.pythonapi.PyThreadState_GetDict
+    get_thread_dict.restype = ctypes.c_void_p
+
+    path = tmp_path / "out.bin"
+    fw = FramedWriter(str(path), raw=True)
+    p = AsyncFilePersister(fw)
+    a = _mod.ObjectWriter(p, pickle.dumps, thread=_thread_id)
+    b = _mod.ObjectWriter(p, pickle.dumps, thread=_thread_id)
+
+    # Threads stay alive throughout: the handle is looked up when the
+    # persister serves the entry.
+    import queue
+    tasks = {name: queue.Queue() for name in ("T1", "T2")}
+    done = queue.Queue()
+
+    def worker(name):
+        ctypes.cast(get_thread_dict(), ctypes.py_object).value[_thread_id] = name
+        while (fn := tasks[name].get()) is not None:
+            fn()
+            done.put(None)
+
+    threads = [threading.Thread(target=worker, args=(name,)) for name in tasks]
+    for t in threads:
+        t.start()
+
+    def on_thread(name, fn):
+        tasks[name].put(fn)
+        done.get()
+
+    # T1 through a, T2 through b, then T1 through a again, each on disk
+    # before the next so the wire alternates writers. (drain/resume
+    # would reset the persister's thread tracking and hide the switch.)
+    import time
+    for name, w, val in [("T1", a, "a1"), ("T2", b, "b1"), ("T1", a, "a2"), ("T2", b, "b2")]:
+        size = os.path.getsize(path)
+        def write(w=w, val=val):
+            w(val)
+            w.flush()
+        on_thread(name, write)
+        deadline = time.monotonic() + 5
+        while os.path.getsize(path) == size and time.monotonic() < deadline:
+            time.sleep(0.001)
+
+    for name in tasks:
+        tasks[name].put(None)
+    for t in threads:
+        t.join()
+    for w in (a, b):
+        w.disable()
+    p.close()
+    fw.close()
+
+    credited = []
+    with stream.reader(path, read_timeout=1, verbose=False) as reader:
+        thread = None
+        while len(credited) < 4:
+            val = reader()
+            if isinstance(val, stream.ThreadSwitch):
+                thread = val.value
+            elif not isinstance(val, stream.Control):
+                credited.append((thread, val))
+    assert credited == [("T1", "a1"), ("T2", "b1"), ("T1", "a2"), ("T2", "b2")]
+
+
+def test_persister_outlives_one_of_its_writers(tmp_path):
+    """A writer going away retires only its own queue."""
+    import pickle
+
+    path = tmp_path / "out.bin"
+    fw = FramedWriter(str(path), raw=True)
+    p = AsyncFilePersister(fw)
+    a = _mod.ObjectWriter(p, pickle.dumps, thread=_thread_id)
+    b = _mod.ObjectWriter(p, pickle.dumps, thread=_thread_id)
+
+    a("from a")
+    del a
+    gc.collect()
+    for i in range(100):
+        b(["from b", i])
+    b.flush()
+    b.disable()
+    p.close()
+    fw.close()
+
+    assert _read_by_writer(path, 101) == {0: ["from a"], 1: [["from b", i] for i in range(100)]}
+
+
+# ---------------------------------------------------------------------------
+# Shared worker pool
+# ---------------------------------------------------------------------------
+
+_POOL_THREADS = 2
+
+
+def _native_threads():
+    return len(os.listdir("/proc/self/task"))
+
+
+def _pooled_writer(path):
+    import pickle
+
+    fw = FramedWriter(str(path), raw=True)
+    p = AsyncFilePersister(fw, pool_threads=_POOL_THREADS)
+    return fw, p, _mod.ObjectWriter(p, pickle.dumps, thread=_thread_id)
+
+
+def _close_pooled(fw, p, w):
+    w.flush()
+    w.disable()
+    p.close()
+    fw.close()
+
+
+@pytest.mark.skipif(not os.path.isdir("/proc/self/task"), reason="needs /proc")
+def test_pooled_persisters_share_threads(tmp_path):
+    """Pooled persisters start no threads of their own, and each trace
+    still reads back in order."""
+    # The first pooled writer starts the pool.
+    _close_pooled(*_pooled_writer(tmp_path / "warmup.bin"))
+
+    # Threads from earlier tests may still be exiting, so check for no new
+    # ones rather than an exact count.
+    before = _native_threads()
+    paths = [tmp_path / f"out{i}.bin" for i in range(6)]
+    pooled = [_pooled_writer(path) for path in paths]
+    assert _native_threads() <= before
+
+    for i in range(300):
+        for n, (_, _, w) in enumerate(pooled):
+            w([n, i, f"s{i % 9}"])
+    for parts in pooled:
+        _close_pooled(*parts)
+
+    for n, path in enumerate(paths):
+        assert _read_by_writer(path, 300) == {0: [[n, i, f"s{i % 9}"] for i in range(300)]}
+
+
+def test_pool_size_is_fixed_by_first_persister(tmp_path):
+    _close_pooled(*_pooled_writer(tmp_path / "a.bin"))
+    fw = FramedWriter(str(tmp_path / "b.bin"))
+    with pytest.raises(ValueError):
+        AsyncFilePersister(fw, pool_threads=_POOL_THREADS + 1)
+    with pytest.raises(ValueError):
+        AsyncFilePersister(fw, pool_threads=_POOL_THREADS, thread_name="other")
+    fw.close()
+
+
+# ---------------------------------------------------------------------------
+# Thread placement
+# ---------------------------------------------------------------------------
+
+def _threads_named(prefix):
+    tasks = {}
+    for tid in os.listdir("/proc/self/task"):
+        try:
+            with open(f"/proc/self/task/{tid}/comm") as f:
+                name = f.read().strip()
+        except FileNotFoundError:
+            continue    # exited since the listing
+        if name.startswith(prefix):
+            tasks[name] = int(tid)
+    return tasks
+
+
+@pytest.mark.skipif(not hasattr(os, "sched_getaffinity") or not os.path.isdir("/proc/self/task"),
+                    reason="needs Linux")
+def test_thread_options_apply_to_background_threads(tmp_path):
+    import pickle
+
+    cpu = min(os.sched_getaffinity(0))
+    fw = FramedWriter(str(tmp_path / "out.bin"), raw=True)
+    p = AsyncFilePersister(fw, cpus=[cpu], sched="idle", nice=10, thread_name="rt-test")
+    w = _mod.ObjectWriter(p, pickle.dumps, thread=_thread_id)
+    w("hello")
+    w.flush()
+
+    # Each thread names itself once its other settings are in place.
+    import time
+    deadline = time.monotonic() + 5
+    while len(tasks := _threads_named("rt-test-")) < 2 and time.monotonic() < deadline:
+        time.sleep(0.01)
+    assert set(tasks) == {"rt-test-writer", "rt-test-drain"}
+    for tid in tasks.values():
+        assert os.sched_getaffinity(tid) == {cpu}
+        assert os.sched_getscheduler(tid) == os.SCHED_IDLE
+        assert os.getpriority(os.PRIO_PROCESS, tid) == 10
+
+    w.disable()
+    p.close()
+    fw.close()
+    assert _read_by_writer(tmp_path / "out.bin", 1) == {0: ["hello"]}
+
+
+def test_thread_options_are_checked(tmp_path):
+    fw = FramedWriter(str(tmp_path / "out.bin"))
+    with pytest.raises(ValueError):
+        AsyncFilePersister(fw, sched="fast")
+    with pytest.raises(ValueError):
+        AsyncFilePersister(fw, nice=40)
+    with pytest.raises((ValueError, NotImplementedError)):
+        AsyncFilePersister(fw, cpus=[-1])
+    fw.close()
+
+# ---------------------------------------------------------------------------
+# Sub-interpreters
+# ---------------------------------------------------------------------------
+
+_SUBINTERPRETER_RECORD = """
+import sys
+sys.path[:] = {path!r}
+import pickle, threading
+import retracesoftware.stream as stream
+mod = stream._backend_mod
+fw = mod.FramedWriter({out!r}, raw=True)
+p = mod.AsyncFilePersister(fw, **{options!r})
+w = mod.ObjectWriter(p, pickle.dumps, thread=lambda: threading.current_thread().ident)
+for i in range(200):
+    w(["sub", i, {{"k": i / 2}}])
+w.flush()
+w.disable()
+p.close()
+fw.close()
+"""
+
+
+@pytest.mark.parametrize("options", [{}, {"pool_threads": _POOL_THREADS}])
+def test_records_in_subinterpreter(tmp_path, options):
+    """A sub-interpreter imports its own copy of the module and records
+    through persister threads that attach to it, not the main one."""
+    import sys
+
+    interpreters = pytest.importorskip("_xxsubinterpreters")
+    out = tmp_path / "sub.bin"
+    interp = interpreters.create()
+    try:
+        interpreters.run_string(interp, _SUBINTERPRETER_RECORD.format(
+            path=list(sys.path), out=str(out), options=options))
+    finally:
+        interpreters.destroy(interp)
+
+    assert _read_by_writer(out, 200) == {0: [["sub", i, {"k": i / 2}] for i in range(200)]}
+
+
+def test_records_in_concurrent_subinterpreters(tmp_path):
+    """Sub-interpreters (each with a GIL of its own where the runtime
+    allows it) record at the same time through the shared pool."""
+    import sys
+
+    interpreters = pytest.importorskip("_xxsubinterpreters")
+    outs = [tmp_path / f"sub{n}.bin" for n in range(2)]
+    interps = [interpreters.create() for _ in outs]
+    # An interpreter whose threading module was first imported off the
+    # main thread can't be destroyed (CPython 3.12).
+    for interp in interps:
+        interpreters.run_string(interp, "import threading")
+    errors = []
+
+    def run(interp, out):
+        try:
+            interpreters.run_string(interp, _SUBINTERPRETER_RECORD.format(
+                path=list(sys.path), out=str(out), options={"pool_threads": _POOL_THREADS}))
+        except Exception as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=run, args=pair) for pair in zip(interps, outs)]
+    try:
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+    finally:
+        for interp in interps:
+            interpreters.destroy(interp)
+
+    assert errors == []
+    for out in outs:
+        assert _read_by_writer(out, 200) == {0: [["sub", i, {"k": i / 2}] for i in range(200)]}